@@ -2,37 +2,36 @@ import os,sys,random,shlex
 from os.path import basename
 
 
-def printstats(numseg,numbenign,numoob,numsdc,i):
-	falseop = open(dirn+"/faulty_"+fname+"/"+str(i)+".out",'r') # faulty .out file
-	trueop= open(dirn+"/actual_"+fname+"/"+str(i)+".out",'r') # actual .out file
+# Golden output digest: FNV-1a hash of every 4 KiB block, read by the
+# output monitor of the runtime (KULFI_OUTPUT_MONITOR)
+def writedigest(outfile,digestfile):
+	data=bytearray(open(outfile,'rb').read())
+	hashes=[]
+	for start in range(0,len(data),4096):
+		h=0xcbf29ce484222325
+		for c in data[start:start+4096]:
+			h=((h^c)*0x100000001b3) & 0xffffffffffffffff
+		hashes.append(h)
+	d=open(digestfile,'w')
+	d.write("KULFI-DIGEST 1 4096 "+str(len(data))+" "+str(len(hashes))+"\n")
+	for h in hashes:
+		d.write("%016x\n" % h)
+	d.close()
 
-	line=trueop.readline()
-	s = shlex.split(line)
-	for i in range(len(s)):
-		s[i]=int(s[i])
-	line1=falseop.readline()
-	if(not line1):
+# Outcome record written by the runtime: "<BENIGN|SDC|LENGTH>\t<target>\t<offset>"
+def readoutcome(numseg,numbenign,numoob,numsdc,i):
+	outcome=dirn+"/faulty_"+fname+"/"+str(i)+".outcome"
+	if(not os.path.exists(outcome)):
 		numseg+=1
 		return numseg,numbenign,numoob,numsdc
+	kind=open(outcome,'r').readline().split("\t")[0]
+	if(kind=="BENIGN"):
+		numbenign+=1
+	elif(kind=="SDC"):
+		numsdc+=1
 	else:
-		t=[]    
-		t = shlex.split(line1)
-		for i in range(len(t)):
-			t[i]=int(t[i])
-		if(len(s)==len(t)):
-			flag=0
-			for d in range(len(s)):
-				if(t[d]!=s[d]):
-					numsdc+=1
-					return numseg,numbenign,numoob,numsdc
-		else:
-			numoob+=1
-			return numseg,numbenign,numoob,numsdc
-
-	numbenign+=1
+		numoob+=1
 	return numseg,numbenign,numoob,numsdc
-	falseop.close()
-	trueop.close()
 
 def geninput(size):
 	f=open(dirn+"/tempinput.txt",'w')
@@ -62,13 +61,14 @@ if __name__ == "__main__":
 		os.system("rm */*.bc */*.txt")
 		os.system("rm -rf */faulty_*")
 		os.system("rm -rf */actual_*")
+		os.system("rm -rf */.kulfi_cache")
                 sys.exit()
 	
 	if(sys.argv[1]=="--help" or sys.argv[1]=="?" or sys.argv[1]=="-h"):
 		print "\n"
 		print "Execution format: python sorting.py <ARGS>"
 		print "Arg1: <source_file>            	    type: string"
-		print "Arg2: <Corrupt.c file>        	    type: string"		
+		print "Arg2: <Corrupt.cpp file>        	    type: string"		
 		print "Arg3: <faults.so file>        	    type: string"		
 		print "Arg4: <iteration>	  	    type: integer"		
 		print "Arg5: <byte_position>	  	    type: integer"		
@@ -82,7 +82,7 @@ if __name__ == "__main__":
 		print "Arg13: <function_name>  	   	    type: string"					
 	        print "\n"
                 print"Sample command line: "
-		print "python sorting.py bubblesort/bubblesort.c ../../../src/other/Corrupt.c ../../../bin/faults.so 2 0 10 100 1 1 0 1 0 bubbleSort"
+		print "python sorting.py bubblesort/bubblesort.c ../../../src/other/Corrupt.cpp ../../../bin/faults.so 2 0 10 100 1 1 0 1 0 bubbleSort"
 		print "\n"
 		sys.exit()
 	
@@ -145,15 +145,21 @@ if __name__ == "__main__":
 	os.system("mkdir "+dirn+"/faulty_"+fname+"/")
 	os.system("mkdir "+dirn+"/actual_"+fname+"/")	
 
-	os.system("clang -O1 -emit-llvm "+crptfile+" -c -o "+dirn+"/"+cfname+".bc")
+	# The runtime is not linked into the bitcode; libkulfi_rt is built next to crptfile
 	os.system("clang -O1 -emit-llvm "+progname+" -c -o "+dirn+"/"+fname+".bc")	
-	os.system("llvm-link "+dirn+"/"+cfname+".bc "+dirn+"/"+fname+".bc " + " -o "+dirn+"/linked.bc")
 	
 	
+	# Instrumented and golden programs are compiled to native executables
+	# once and cached under .kulfi_cache
+	sys.path.insert(0,cdirn)
+	import kulfi_build
+	cachedir=dirn+"/.kulfi_cache"
 	if(injecttype):
-		os.system("opt -load "+faultpass+" -dynfault -ef "+str(ef)+" -tf "+str(tf)+" -pe "+str(pointerror)+" -de "+str(dataerror)+" -b "+str(byte_val)+" -ijo "+str(injectonce)+" -pfs "+str(pfs)+" -fn "+fn+" < "+dirn+"/linked.bc > "+dirn+"/final.bc")
+		passopts="-dynfault -ef "+str(ef)+" -tf "+str(tf)+" -pe "+str(pointerror)+" -de "+str(dataerror)+" -b "+str(byte_val)+" -ijo "+str(injectonce)+" -pfs "+str(pfs)+" -fn "+fn
 	else:
-		os.system("opt -load "+faultpass+" -staticfault -ef "+str(ef)+" -tf "+str(tf)+ "-pe "+str(pointerror)+" -de "+str(dataerror)+" -b 0 -ijo "+str(injectonce)+" < "+dirn+"/linked.bc > "+dirn+"/final.bc")
+		passopts="-staticfault -ef "+str(ef)+" -tf "+str(tf)+" -pe "+str(pointerror)+" -de "+str(dataerror)+" -b 0 -ijo "+str(injectonce)
+	faultyexe=kulfi_build.instrumented(dirn+"/"+fname+".bc",faultpass,passopts,cdirn,cachedir)
+	goldenexe=kulfi_build.golden(dirn+"/"+fname+".bc",cachedir)
 
 	stats=open(dirn+"/stats.txt","w")
 	segiters=open(dirn+"/segiter.txt","w")
@@ -164,8 +170,13 @@ if __name__ == "__main__":
 		size=random.randint(2000,10000)
 		geninput(size)
 		print("-----------Iteration Number: "+str(i)+"--------------")
-		os.system("lli "+dirn+"/"+fname+".bc "+dirn+"/tempinput.txt "+dirn+"/actual_"+fname+"/"+str(i)+".out")
-		s=os.system("timeout 1000 lli "+dirn+"/final.bc "+dirn+"/tempinput.txt "+dirn+"/faulty_"+fname+"/"+str(i)+".out")
+		actual=dirn+"/actual_"+fname+"/"+str(i)+".out"
+		faulty=dirn+"/faulty_"+fname+"/"+str(i)+".out"
+		os.system(goldenexe+" "+dirn+"/tempinput.txt "+actual)
+		writedigest(actual,actual+".digest")
+		# The faulty output is compared block by block while the program runs
+		# and is never written to disk
+		s=os.system("KULFI_OUTPUT_MONITOR='"+faulty+"="+actual+".digest' KULFI_OUTCOME="+dirn+"/faulty_"+fname+"/"+str(i)+".outcome timeout 1000 "+faultyexe+" "+dirn+"/tempinput.txt "+faulty)
 
 		if(s == 35584):
 			numseg+=1
@@ -176,7 +187,7 @@ if __name__ == "__main__":
 			hangiters.write(str(i)+"\n")
 			continue
 		else:
-			numseg,numbenign,numoob,numsdc=printstats(numseg,numbenign,numoob,numsdc,i)
+			numseg,numbenign,numoob,numsdc=readoutcome(numseg,numbenign,numoob,numsdc,i)
 
 	stats.write("Segmentation Faults: "+str(numseg)+" Benign Faults: "+str(numbenign)+" Out of Bounds: "+str(numoob)+" SDC: "+str(numsdc))
 			
@@ -0,0 +1,87 @@
+# Scaling test of the dynfault pass: generates a program with N and 4N
+# statements in each of three functions, and times "opt -dynfault" on
+# both. "line" is one straight-line BB of N statements (loads, stores,
+# binary operators, i.e. many fault sites in one BB), "calls" is one BB
+# with 2N calls, half of them to a pointer-returning h() (so many BBs
+# split on calls in one BB, and call results used across them) and
+# "branches" has N compares and branches. The pass is linear in the
+# number of fault sites, so the time at 4N should be about 4 times the
+# time at N; a quadratic hotspot makes it 16 times. Exits with 1 if the
+# ratio is above <max ratio>.
+#
+# python scaling.py <faults.so file> [N] [max ratio]
+import os,sys,time,tempfile,shutil
+
+def gensource(path,n):
+	f=open(path,'w')
+	f.write("int a[8];\n")
+	f.write("int g(int v) { return v ^ (v >> 3); }\n")
+	f.write("int* h(int* p) { return a + ((p - a + 1) & 7); }\n")
+	f.write("int line(int x, int y) {\n")
+	for i in range(n):
+		f.write("\tx = x * "+str(2*i+3)+" + y;\n")
+		f.write("\ty = y ^ (x >> "+str(i%8)+");\n")
+	f.write("\treturn x + y;\n}\n")
+	f.write("int calls(int x) {\n\tint* p = a;\n")
+	for i in range(n):
+		f.write("\tp = h(p);\n")
+		f.write("\tx = g(x + *p);\n")
+	f.write("\treturn x + *p;\n}\n")
+	f.write("int branches(int x, int y) {\n")
+	for i in range(n):
+		f.write("\tif(x & "+str(1<<(i%8))+") y += x;\n")
+		f.write("\tx = x + "+str(i)+";\n")
+	f.write("\treturn x + y;\n}\n")
+	f.write("int main() { return (line(1, 2) + calls(3) + branches(4, 5)) & 1; }\n")
+	f.close()
+
+def runtime(cmd):
+	start=time.time()
+	if(os.system(cmd)!=0):
+		print("Command failed: "+cmd)
+		sys.exit(1)
+	return time.time()-start
+
+# Time of the pass only: opt with the pass minus opt without it
+def passtime(faultpass,bc,log):
+	withpass=runtime("opt -load "+faultpass+" -dynfault -de 1 -pe 1 < "+bc+" > /dev/null 2> "+log)
+	without=runtime("opt < "+bc+" > /dev/null")
+	sites=0
+	for line in open(log,'r'):
+		if(line.startswith("[dynfault]") and "fault sites enumerated" in line):
+			sites=int(line.split()[1])
+	return max(withpass-without,0.001),sites
+
+if __name__ == "__main__":
+	if(len(sys.argv) < 2 or sys.argv[1] in ["--help","-h","?"]):
+		print("Usage: python scaling.py <faults.so file> [N, default 5000] [max ratio, default 6]")
+		sys.exit()
+	faultpass=os.path.realpath(sys.argv[1])
+	n=5000
+	if(len(sys.argv) > 2):
+		n=int(sys.argv[2])
+	maxratio=6.0
+	if(len(sys.argv) > 3):
+		maxratio=float(sys.argv[3])
+	if(not os.path.exists(faultpass)):
+		print(faultpass+" not found")
+		sys.exit(1)
+
+	workdir=tempfile.mkdtemp(prefix="kulfi_scaling")
+	times=[]
+	for size in [n,4*n]:
+		src=os.path.join(workdir,"big"+str(size)+".c")
+		bc=os.path.join(workdir,"big"+str(size)+".bc")
+		gensource(src,size)
+		runtime("clang -O0 -emit-llvm -c "+src+" -o "+bc)
+		t,sites=passtime(faultpass,bc,os.path.join(workdir,"opt"+str(size)+".log"))
+		print("N = %d: %d fault sites, %.2f s" % (size,sites,t))
+		times.append(t)
+	shutil.rmtree(workdir)
+
+	ratio=times[1]/times[0]
+	print("Time at 4N / time at N: %.2f (linear: 4, quadratic: 16)" % ratio)
+	if(ratio > maxratio):
+		print("FAIL: above "+str(maxratio))
+		sys.exit(1)
+	print("PASS")
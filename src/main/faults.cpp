@@ -1,3 +1,88 @@
+// 20261018:
+// -cb (call boundaries): the only fault sites are the arguments of each function, at
+// its entry, and its return values, at each ReturnInst (instrumentCallBoundaries), so
+// the sites are counted once per call instead of in every BB.
+//
+// 20261018:
+// The "kulfi_globals" section lists the address, size and name of the module's writable
+// globals (writeGlobalsTable), for the memory fault mode of the runtime (KULFI_MEM_FAULT).
+//
+// 20261018:
+// Vector fault sites: BinaryOperator/Load results, stored values and CmpInst operands
+// of vector type (i8-i64, float, double elements) call a per vector type stub; the
+// slow path gets the lane from kulfi_vector_lane and uses insertelement.
+//
+// 20261018:
+// Pointer faults keep the pointer's base: the fault site returns corrupted - original
+// (createPointerDelta, ptrtoint only on the slow path, 0 otherwise) and the corrupted
+// pointer is an i8 GEP of the original, instead of a ptrtoint/inttoptr round trip.
+//
+// 20261018:
+// The runtime's declarations and the calls to it are nounwind, isNextFaultInThisBB is
+// readonly and the cold paths do not capture the site; the countdown accesses of the
+// fast path have the TBAA tag of long long.
+//
+// 20261018:
+// -kulfi-ep=<point> adds the pass to the standard -O pipelines (RegisterStandardPasses),
+// so clang -O2/-O3 can instrument with -Xclang -load; a module is only instrumented once.
+//
+// 20261018:
+// -staticfault works again: -sf-specs=<file> builds a list of permanent faults (site,
+// bit, stuck0/stuck1/flip) into one module, selected at run time by KULFI_VARIANT
+// through per site masks; site IDs are the -dynfault ones.
+//
+// 20261018:
+// runOnModule is split into prepareModule / collectTargets / per function steps, so
+// that src/tools/kulfi-lli can instrument each function when the JIT first compiles
+// it (kulfi_enable_lazy_instrumentation); the site IDs are reserved up front.
+//
+// 20261018:
+// The use-def graph is only exported with -kulfi-graph=<file>, in a binary CSR format
+// (writeUseDefGraph) instead of usedefchain.dot; src/other/kulfi_graph.py lists the
+// functions, writes DOT for one of them or forward slices from a fault site.
+//
+// 20261018:
+// -kulfi-stats=<file> writes a JSON report: wall time and peak RSS after each phase,
+// and per function fault site, BB, PHI and instruction counts (see writeStats).
+//
+// 20261018:
+// The read-only analysis of the functions (use-def graph, fault site candidates, BB
+// names) runs on -kulfi-threads worker threads (parallelFor); the results are merged
+// and the functions instrumented serially, in module order.
+//
+// 20261018:
+// Fault site IDs are local to the module: each translation unit can be instrumented
+// on its own (see src/other/kulfi.mk). The module's hash and ID range are in
+// kulfi.module and its manifest; a constructor registers it with the runtime,
+// which turns local IDs into global ones.
+//
+// 20261018:
+// Deterministic output: no more time() seed (see -seed), the CmpInst operand to
+// corrupt is chosen from the site key (getSiteKey), which only depends on the
+// function name, the BB and the instruction ordinal; the key is in the manifest.
+//
+// 20261018:
+// Smaller analysis tables: the use-def graph is recorded per function right before
+// it is instrumented (DenseMap/BitVector, edges in CSR form), appended to
+// usedefchain.dot and freed. Per fault site data is a vector by fault index.
+//
+// 20261018:
+// Each function is instrumented in one sweep in program order: call splitting is
+// linear, instructions are not looked up by scanning their BB, and fault sites are
+// kept in vectors (so fault site IDs follow the program order, not pointer order).
+//
+// 20261018:
+// Fast path: the countdown test of the runtime is inlined at every fault site
+// (createFastPath); the corrupt*_ijo/_multi instance matching -ijo is the cold path.
+// Its arguments are a pointer to a constant site descriptor and the value
+// (lowerFaultSites) instead of six scalars.
+// The fault site manifest (writeManifest) replaces fault_sites.txt; BB names are
+// in its string pool instead of one global string per BB.
+//
+// 20261018:
+// The runtime is no longer llvm-linked into the target. Only declarations of its
+// entry points are emitted (see declareRuntimeFunctions); link with libkulfi_rt.
+
 // 20140303:
 // Fix BB count of Splitted Call Instructions
 
@@ -40,6 +125,11 @@
 #include <iostream>
 #include <fstream>
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <llvm/Pass.h>
 #include <llvm/ADT/ArrayRef.h>
 #include <llvm/Argument.h>
@@ -50,21 +140,33 @@
 #include <llvm/Instructions.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/ADT/Statistic.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/BitVector.h>
 #include <llvm/CodeGen/MachineOperand.h>
 #include <llvm/Support/CommandLine.h>
 #include "llvm/Analysis/LoopPass.h"
 #include "llvm/Support/InstIterator.h"
 #include "llvm/PassManager.h"
 #include "llvm/CallingConv.h"
+#include "llvm/DataLayout.h"
 #include "llvm/Analysis/Verifier.h"
 #include "llvm/Assembly/PrintModulePass.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/MDBuilder.h"
+#include "llvm/GVMaterializer.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 // Enable this macro to use old code
 // Otherwise, use the code on 2013-07-23
 //#define IGNORE_20130723_CHANGES
 
 using namespace llvm;
-const char* getMyTypeName(const Value* v);
+unsigned char getMyTypeId(const Value* v);
+static bool isFunctionNameBlacklisted(const char* fn);
 static IRBuilder<true, ConstantFolder, IRBuilderDefaultInserter<true> >* g_irbuilder;
 
 static cl::opt<std::string> func_list("fn", cl::desc("Name(s) of the function(s) to be targeted"), cl::value_desc("func1 func2 func3"), cl::init(""), cl::ValueRequired);
@@ -75,6 +177,14 @@ static cl::opt<bool> data_err("de", cl::desc("Inject Data Register Error"), cl::
 static cl::opt<int> ijo("ijo", cl::desc("Inject Error Only Once"), cl::value_desc("0/1"), cl::init(1), cl::ValueRequired);
 static cl::opt<int> print_fs("pfs", cl::desc("Print Fault Statistics"), cl::value_desc("0/1"), cl::init(0));
 static cl::opt<bool> ptr_err("pe", cl::desc("Inject Pointer Register Error"), cl::value_desc("0/1"), cl::init(0), cl::ValueRequired);
+static cl::opt<unsigned> seed("seed", cl::desc("Seed of the random choices made by the pass (-b when not given, the -staticfault site)"), cl::value_desc("N"), cl::init(0));
+static cl::opt<unsigned> num_threads("kulfi-threads", cl::desc("Threads for the analysis of the functions (0: one per CPU)"), cl::value_desc("N"), cl::init(0));
+static cl::opt<std::string> stats_file("kulfi-stats", cl::desc("Write the time and memory used by each phase of the pass and per function counts to this file (JSON)"), cl::value_desc("filename"), cl::init(""));
+static cl::opt<std::string> graph_file("kulfi-graph", cl::desc("Write the use-def graph of the instrumented functions to this file (see kulfi_graph.py)"), cl::value_desc("filename"), cl::init(""));
+static cl::opt<std::string> sf_specs("sf-specs", cl::desc("Static fault variants: lines of <fault site ID> <bit> <stuck0|stuck1|flip>"), cl::value_desc("filename"), cl::init(""));
+static cl::opt<std::string> extension_point("kulfi-ep", cl::desc("Also run -dynfault in the standard -O pipelines (clang -O2/-O3) at: optimizer-last, scalar-late, loop-end, O0 or none"), cl::value_desc("point"), cl::init("none"));
+static cl::opt<bool> call_boundary("cb", cl::desc("Call-boundary mode: the fault sites are the arguments of each function at its entry and its return values"), cl::value_desc("0/1"), cl::init(0));
+static cl::opt<bool> fast_path("fastpath", cl::desc("Inline the fault site countdown test instead of calling the runtime at every site"), cl::value_desc("0/1"), cl::init(1));
 
 // Injection "whitelist"
 static std::list<std::string> inj_funcname_whitelist;
@@ -134,6 +244,7 @@ Value* func_corruptIntAdr_32bit;
 Value* func_corruptIntAdr_64bit;
 Value* func_corruptFloatAdr_32bit;
 Value* func_corruptFloatAdr_64bit;
+Value* func_corruptPtrDelta; // i64 (i8*): corrupted - original, see createPointerDelta
 Value* func_print_faultStatistics;
 Value* func_incrementFaultSitesEnumerated;
 Value* func_printInstCount;
@@ -141,20 +252,224 @@ Value* func_initFaultInjectionCampaign;
 Value* func_main;
 Value* func_isNextFaultInThisBB;
 std::string cstr=""; /*stores fault site name used by fault injection pass*/
-unsigned int lstsize=0; /*Stores instruction list used by static fault injection pass*/
 
 int g_fault_index = 0;
 enum FaultType {
 	DYN_FAULT_DATA,
 	DYN_FAULT_PTR
 };
-// Instruction may change ?
-static std::map<int, std::pair<std::string, FaultType> > g_fault_sites;
+// Per fault site information, indexed by fault index (see getFaultSite)
+struct FaultSiteRecord {
+	BasicBlock* bb;   // Original BB of the site
+	unsigned key;     // Stable across builds, see getSiteKey
+	unsigned line;    // Source line, 0 if unknown
+	FaultType type;
+	bool logged;      // Set by logFaultSiteInfo
+	bool injected;    // Is the fault site at this index really injected?
+};
+static std::vector<FaultSiteRecord> g_fault_sites;
+
+static FaultSiteRecord& getFaultSite(int fault_index) {
+	assert(fault_index >= 0);
+	if(g_fault_sites.size() <= (unsigned)fault_index) {
+		FaultSiteRecord empty = { NULL, 0, 0, DYN_FAULT_DATA, false, false };
+		g_fault_sites.resize(fault_index + 1, empty);
+	}
+	return g_fault_sites[fault_index];
+}
+
+// FNV-1a. The site key identifies a fault site by its position in the source
+//   function (function name, BB ordinal, instruction ordinal, kind), so it stays
+//   the same from one build to the next as long as the function does not change,
+//   unlike the fault index, which depends on everything instrumented before it.
+static unsigned hashBytes(unsigned h, const void* data, unsigned len) {
+	const unsigned char* p = (const unsigned char*)data;
+	for(unsigned i=0; i<len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static unsigned hashString(const std::string& s) {
+	return hashBytes(2166136261u, s.data(), s.size());
+}
+
+static unsigned getSiteKey(unsigned func_hash, unsigned bb_ordinal, unsigned inst_ordinal, FaultType kind) {
+	unsigned v[3] = { bb_ordinal, inst_ordinal, (unsigned)kind };
+	return hashBytes(func_hash, v, sizeof(v));
+}
+
+// Worker threads for the read-only analysis of the functions. A job must not
+//   change the IR, create types or constants, or print; its results go into
+//   its own slot of <arg> and are merged by the caller in index order.
+static unsigned getNumThreads() {
+#ifdef TOMMY_TEST
+	return 1; // test0 is not thread safe
+#else
+	if(num_threads > 0) return num_threads;
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (unsigned)n : 1;
+#endif
+}
+
+struct ParallelJob {
+	void (*work)(void* arg, unsigned i);
+	void* arg;
+	unsigned n;
+	unsigned next; // Next index to hand out
+};
 
-std::set<Instruction*> corrupted_ptrs;
-std::set<BasicBlock*> call_next_bbs; // The BB that follows a Call BB. 
-std::map<BasicBlock*, unsigned> bb_fs_counts; // Fault Site count of each BB
-std::map<BasicBlock*, std::string> bb_names; // BB names.
+static void* parallelWorker(void* p) {
+	ParallelJob* job = (ParallelJob*)p;
+	for(;;) {
+		unsigned i = __sync_fetch_and_add(&job->next, 1);
+		if(i >= job->n) break;
+		job->work(job->arg, i);
+	}
+	return NULL;
+}
+
+// Calls work(arg, i) for i = 0 .. n-1 on up to getNumThreads() threads
+static void parallelFor(unsigned n, void (*work)(void*, unsigned), void* arg) {
+	ParallelJob job = { work, arg, n, 0 };
+	unsigned nthreads = std::min(getNumThreads(), n);
+	std::vector<pthread_t> threads;
+	for(unsigned i = 1; i < nthreads; i++) {
+		pthread_t t;
+		if(pthread_create(&t, NULL, parallelWorker, &job) != 0) break; // The others do the work
+		threads.push_back(t);
+	}
+	parallelWorker(&job);
+	for(unsigned i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+}
+
+// -kulfi-stats report. Phases are timed with beginPhase() / endPhase(); phases
+//   that are interleaved (e.g. instrumentation and DOT writing) add up.
+struct PhaseStats {
+	const char* name;
+	double seconds;
+	long max_rss_kb; // Peak RSS of the process at the end of the phase
+};
+struct FunctionStats {
+	Function* F;
+	unsigned bbs, insts, phis; // Before the pass
+	unsigned candidates, sites; // Fault site candidates / instrumented fault sites
+};
+static std::vector<PhaseStats> phase_stats;
+static std::vector<FunctionStats> function_stats;
+static DenseMap<Function*, unsigned> function_stats_idx;
+static double pass_start;
+
+static double getWallTime() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static long getMaxRSS() {
+	struct rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+	return ru.ru_maxrss; // KiB on Linux
+}
+
+static double beginPhase() {
+	return getWallTime();
+}
+
+static void endPhase(const char* name, double start) {
+	double seconds = getWallTime() - start;
+	for(unsigned i = 0; i < phase_stats.size(); i++) {
+		if(!strcmp(phase_stats[i].name, name)) {
+			phase_stats[i].seconds += seconds;
+			phase_stats[i].max_rss_kb = getMaxRSS();
+			return;
+		}
+	}
+	PhaseStats ps = { name, seconds, getMaxRSS() };
+	phase_stats.push_back(ps);
+}
+
+static void countFunction(const Function& F, unsigned& bbs, unsigned& insts, unsigned& phis) {
+	bbs = insts = phis = 0;
+	for(Function::const_iterator bi = F.begin(); bi != F.end(); bi++) {
+		bbs++;
+		for(BasicBlock::const_iterator ii = bi->begin(); ii != bi->end(); ii++) {
+			insts++;
+			if(isa<PHINode>(&*ii)) phis++;
+		}
+	}
+}
+
+// Counts of every function that may be instrumented, before the pass changes them
+static void recordFunctionStats(Module& M) {
+	if(stats_file == "") return;
+	for(Module::iterator it = M.begin(); it != M.end(); it++) {
+		if(it->isDeclaration() || isFunctionNameBlacklisted(it->getName().str().c_str())) continue;
+		FunctionStats fs;
+		fs.F = it;
+		countFunction(*it, fs.bbs, fs.insts, fs.phis);
+		fs.candidates = fs.sites = 0;
+		function_stats_idx[fs.F] = function_stats.size();
+		function_stats.push_back(fs);
+	}
+}
+
+static FunctionStats* getFunctionStats(Function* F) {
+	DenseMap<Function*, unsigned>::iterator it = function_stats_idx.find(F);
+	return (it == function_stats_idx.end()) ? NULL : &function_stats[it->second];
+}
+
+static void writeJSONString(FILE* f, const std::string& str) {
+	fputc('"', f);
+	for(unsigned i = 0; i < str.size(); i++) {
+		unsigned char c = str[i];
+		if(c == '"' || c == '\\') fprintf(f, "\\%c", c);
+		else if(c < 0x20) fprintf(f, "\\u%04x", c);
+		else fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void writeStats(Module& M) {
+	if(stats_file == "") return;
+	FILE* f = fopen(stats_file.c_str(), "w");
+	if(!f) {
+		errs() << "[dynfault] Cannot write " << stats_file << "\n";
+		return;
+	}
+	fprintf(f, "{\n  \"module\": ");
+	writeJSONString(f, M.getModuleIdentifier());
+	fprintf(f, ",\n  \"threads\": %u,\n", getNumThreads());
+	fprintf(f, "  \"seconds\": %.6f,\n", getWallTime() - pass_start);
+	fprintf(f, "  \"max_rss_kb\": %ld,\n", getMaxRSS());
+	fprintf(f, "  \"fault_sites\": %d,\n", g_fault_index);
+	fprintf(f, "  \"phases\": [");
+	for(unsigned i = 0; i < phase_stats.size(); i++) {
+		fprintf(f, "%s\n    {\"name\": \"%s\", \"seconds\": %.6f, \"max_rss_kb\": %ld}",
+			i ? "," : "", phase_stats[i].name, phase_stats[i].seconds, phase_stats[i].max_rss_kb);
+	}
+	fprintf(f, "\n  ],\n  \"functions\": [");
+	for(unsigned i = 0; i < function_stats.size(); i++) {
+		const FunctionStats& fs = function_stats[i];
+		unsigned bbs, insts, phis;
+		countFunction(*fs.F, bbs, insts, phis);
+		fprintf(f, "%s\n    {\"name\": ", i ? "," : "");
+		writeJSONString(f, fs.F->getName().str());
+		fprintf(f, ", \"candidates\": %u, \"sites\": %u, \"bbs\": %u, \"bbs_added\": %u, "
+			"\"phis_added\": %u, \"insts\": %u, \"insts_added\": %u}",
+			fs.candidates, fs.sites, bbs, bbs - fs.bbs, phis - fs.phis, insts, insts - fs.insts);
+	}
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
+	errs() << "[dynfault] Statistics written to " << stats_file << "\n";
+}
+
+SmallPtrSet<Instruction*, 256> corrupted_ptrs;
+SmallPtrSet<BasicBlock*, 64> call_next_bbs; // The BB that follows a Call BB. 
+DenseMap<BasicBlock*, unsigned> bb_fs_counts; // Fault Site count of each BB
+DenseMap<BasicBlock*, std::string> bb_names; // BB names.
 
 static std::string instToString(const Instruction* inst) {
 	std::string str;
@@ -169,191 +484,867 @@ static std::string instToString(const Instruction* inst) {
 #ifdef TOMMY_TEST
 std::map<const Value*, std::string> test0;
 #endif
-unsigned long num_nodes;
-std::set<unsigned long> is_in_chain; // Is a node in the use-def chain?
-std::set<unsigned long> is_terminator; // Is this a terminator instruction?
-std::set<int> injected_fault_indices; // Is the fault site at this index really injected?
-std::map<const BasicBlock*, std::list<unsigned long> > nodeids_in_basicblocks;
-std::map<const Function*, std::list<const BasicBlock*> > bbs_in_funcs;
-std::map<const Value*, unsigned long> fault_site_to_nodeid;
-std::map<unsigned long, int> nodeid_to_fault_site_id;
-std::map<unsigned long, const char*> node_type_names;
-std::list<std::pair<unsigned long, unsigned long> > usedef_edge_list;
-std::list<std::pair<unsigned long, unsigned long> > branch_edge_list;
+// The graph of one function: its instructions are numbered in program order
+//   just before the function is instrumented. Node i is "Node<first_node+i>"
+//   in the -kulfi-graph file. The graph is written out and freed once the
+//   function is instrumented.
+// Without -kulfi-graph, only node_ids is filled (it gives the instruction
+//   ordinals of the site keys).
+struct UseDefGraph {
+	const Function* func;
+	unsigned long first_node;
+	DenseMap<const Value*, unsigned> node_ids; // Instruction -> node
+	std::vector<unsigned char> types;          // By node, see node_type_names
+	std::vector<int> fault_site_ids;           // By node, -1 if not a fault site
+	BitVector is_in_chain;                     // Is a node in the use-def chain?
+	BitVector is_terminator;                   // Is this a terminator instruction?
+	// Use-def edges in CSR form: the uses of node i are
+	//   edge_uses[edge_begin[i]] ... edge_uses[edge_begin[i+1]-1]
+	std::vector<unsigned> edge_begin;
+	std::vector<unsigned> edge_uses;
+};
+unsigned long num_nodes; // Nodes in all the graphs so far
+static UseDefGraph* curr_graph; // Graph of the function being instrumented
 
 // Predicate "shall we inject errors in THIS BB?"
 //   Is a Boolean value.
-std::map<const BasicBlock*, Value*> bb_to_pred;
+DenseMap<const BasicBlock*, Value*> bb_to_pred;
 // There should not be "incrementFaultSiteCount"s for
 // "alternative BB" and "next BB"'s!
-std::set<BasicBlock*> blacklisted_bbs;
-void writeFaultSiteDOTGraph();
+SmallPtrSet<BasicBlock*, 64> blacklisted_bbs;
+// The BB a fault site's branch was split from, for the BBs that branch creates
+//   (createBranchForCorruptInst); the head keeps the original BasicBlock.
+DenseMap<const BasicBlock*, BasicBlock*> site_bb_origins;
+static BasicBlock* getSiteBBOrigin(BasicBlock* bb) {
+	BasicBlock* origin = site_bb_origins.lookup(bb);
+	return origin ? origin : bb;
+}
+void recordUseDefChain(Function& F, UseDefGraph& g);
+void writeUseDefGraph(const UseDefGraph& g);
+void endUseDefGraph();
 
-// Don't use this routine. It's painfully slow!
 static void logFaultSiteInfo(const Instruction* inst, int fault_index, FaultType fault_type) {
-	assert((g_fault_sites.find(fault_index) == g_fault_sites.end()) &&
-		"Each fault site shall have a unique number.");
+	FaultSiteRecord& fs = getFaultSite(fault_index);
+	assert(!fs.logged && "Each fault site shall have a unique number.");
 #ifdef TOMMY_TEST
 	std::string inst_str = instToString(inst);
 	if(!(test0[inst] == inst_str)) {
 		errs() << test0[inst] << "   vs   " << inst_str << "\n";
 	}
-#else
-	std::string inst_str = "blah";
 #endif
 	// Instruction to Instruction I.D.
-	const Value* site = dynamic_cast<const Value*>(inst);
-	assert(site);
-	if(site) {
-		unsigned long node_id = fault_site_to_nodeid.at(site);
-		nodeid_to_fault_site_id[node_id] = fault_index;
+	if(curr_graph && !curr_graph->fault_site_ids.empty()) {
+		DenseMap<const Value*, unsigned>::const_iterator itr = curr_graph->node_ids.find(inst);
+		assert(itr != curr_graph->node_ids.end());
+		curr_graph->fault_site_ids[itr->second] = fault_index;
 	}
-	g_fault_sites[fault_index] = std::make_pair(inst_str, fault_type);
+	fs.type = fault_type;
+	fs.line = inst->getDebugLoc().getLine();
+	fs.logged = true;
 }
 
 // Do not perform fault injection to these functions!
+// (The runtime itself is not in the module anymore; see declareRuntimeFunctions)
 static const char* blacklist[] = {
-	"shouldInject",
-	"incrementInstCount",
-	"print_faultStatistics",
-	"__printInstCount",
-	"printFaultInfo",
-	"initializeFaultInjectionCampaign",
-	"incrementFaultSiteHit",
-	"incrementInstCount",
-	"__printInstCount",
-	"corruptIntData_16bit",
-	"corruptIntData_32bit",
-	"corruptIntData_64bit",
-	"corruptIntData_8bit",
-	"corruptIntData_1bit",
-	"corruptFloatData_32bit",
-	"corruptFloatData_64bit",
-	"corruptFloatData_80bit",
-	"corruptIntAdr_32bit",
-	"corruptIntAdr_64bit",
-	"corruptFloatAdr_32bit",
-	"corruptFloatAdr_64bit",
-	"print_faultStatistics",
-	"printFaultInfo",
 	"main",
-	"onCountDownReachesZero",
-	"isNextFaultInThisBB",
-	"incrementFaultSiteCount",
-	"onEnteringBB",
 	"_ZNK3MPI8Cartcomm5CloneEv",
-	"flushBBEntries",
-	"_ZN11BBHistEntryC1Ev", // BBHistEntry::BBHistEntry()
-	"_ZN11BBHistEntryC2Ev",
-	"_ZN11BBHistEntryC3Ev", // Can anyone tell me why {1,2,3}?
-	"writeFaultSiteHitHistogram",
 	"_GLOBAL__I_a", // .text.startup
-	"MY_SET_SIGSEGV_HANDLER",
-	"EnableKulfi",
-	"DisableKulfi"
+	"MY_SET_SIGSEGV_HANDLER"
 };
 
 static bool isFunctionNameBlacklisted(const char* fn) {
 	for(unsigned i=0; i<sizeof(blacklist) / sizeof(const char*); i++) {
 		if(!strcmp(blacklist[i], fn)) return true;
 	}
+	// Anything named kulfi* belongs to the runtime or is emitted by this pass
+	if(!strncmp(fn, "kulfi", 5)) return true;
 	return false;
 }
 
-// Counts how many fault sites there are in the BasicBlocks in this Module.
-static void appendInstCountCalls(Module& M) {
-	Module::FunctionListType &fl = M.getFunctionList();
-	for(Module::iterator it = fl.begin(); it!=fl.end(); it++) {
-		Function& F = *it;
-		std::string cstr = it->getName().str();
-		bool is_blacklisted = isFunctionNameBlacklisted(cstr.c_str());
-		if(is_blacklisted) continue;
-		for(Function::iterator bi = F.begin(); bi!=F.end(); bi++) {
-			BasicBlock* bb = &(*bi);
-			if(blacklisted_bbs.find(bb) != blacklisted_bbs.end()) continue;
+// Runtime entry points, provided by libkulfi_rt at link time.
+// The types here must match the prototypes in src/other/kulfi_rt.h.
+// bool/char/short values need the same zeroext/signext attributes clang
+//   puts on the definitions, or the upper bits of the registers are garbage.
+static void addExtAttr(Value* fn, unsigned idx, Type* ty) {
+	Function* F = dyn_cast<Function>(fn);
+	if(!F) return; // Declared with a different type by the target; leave it alone
+	if(ty->isIntegerTy(1))
+		F->addAttribute(idx, Attributes::get(F->getContext(), Attributes::ZExt));
+	else if(ty->isIntegerTy(8) || ty->isIntegerTy(16))
+		F->addAttribute(idx, Attributes::get(F->getContext(), Attributes::SExt));
+}
 
-			Instruction* first_inst = getFirstNonPHINonLandingPad(bb);
-			
-			unsigned size = 0;
-			if(!(bb_fs_counts.find(bb) != bb_fs_counts.end())) {
-				bb->getParent()->dump();
-				assert(false);
-			}
-			size = bb_fs_counts[bb];
-			if(size < 1) continue;
-			if(call_next_bbs.find(bb) != call_next_bbs.end()) { size = size + 1; }
-			std::vector<Value*> args;
-			assert(bb_names.find(bb) != bb_names.end());
-			std::string bbn = bb_names[bb];
-			
-			// Create a global variable.
-			IRBuilder<> irb(bb);
-			Value* global_str_ptr = irb.CreateGlobalString(bbn, "bbname");
-			std::vector<Value*> indices;
-			indices.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), 0));
-			indices.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), 0));
-			
-			GetElementPtrInst* gep_str = GetElementPtrInst::CreateInBounds(global_str_ptr,
-				indices,
-				"bbname", first_inst);
-			
-			args.push_back(gep_str);
-			args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()),
-				size));
-			CallInst* inc_call = CallInst::Create(func_incrementFaultSitesEnumerated, args,
-				"", first_inst);
-			
-			assert(inc_call);
-			// Do not inject into this call
-			corrupted_ptrs.insert(inc_call);
+// Attributes of the runtime's entry points (see kulfi_rt.h): none throws, so the
+//   calls need no landing pads and do not pin the code around them.
+static void setNoUnwind(Value* fn) {
+	if(Function* F = dyn_cast<Function>(fn)) F->setDoesNotThrow();
+}
+
+// The instrumentation code calls a 6-argument stub, kulfi.site.corrupt*, with
+//   (fault_index, ijo, ef, tf, byte_val, value) at every fault site.
+// lowerFaultSites() then replaces each stub call with (kulfi_site*, value):
+//   a pointer into one constant table of site descriptors (see kulfi_rt.h).
+//   ijo, ef, tf and byte_val are the same for the whole module; they are in
+//   kulfi.config, which every descriptor points to.
+struct CorruptFunction {
+	Function* stub;
+	Value* target; // Fast path wrapper or the cold corrupt*_ijo/_multi instance
+	bool is_fast_path;
+};
+static std::vector<CorruptFunction> corrupt_functions;
+
+// Layout of struct kulfi_module, struct kulfi_config and struct kulfi_site in kulfi_rt.h
+enum { KULFI_SITE_DATA = 0, KULFI_SITE_PTR = 1 };
+
+static StructType* getModuleType(Module& M) {
+	StructType* ty = M.getTypeByName("kulfi_module");
+	if(ty) return ty;
+	std::vector<Type*> fields(3, Type::getInt32Ty(M.getContext())); // hash, num_sites, site_base
+	return StructType::create(M.getContext(), fields, "kulfi_module");
+}
+
+static StructType* getConfigType(Module& M) {
+	StructType* ty = M.getTypeByName("kulfi_config");
+	if(ty) return ty;
+	std::vector<Type*> fields(4, Type::getInt32Ty(M.getContext())); // ef, tf, byte_val, inject_once
+	fields.push_back(PointerType::getUnqual(getModuleType(M)));
+	return StructType::create(M.getContext(), fields, "kulfi_config");
+}
+
+// Identifies the module among the ones linked into the program. Fault site IDs
+//   (g_fault_index) start from 1 in every module; the runtime adds the base of
+//   the module's range to them (kulfi_register_module).
+// opt may read the module from stdin, so the names of the symbols it defines
+//   are hashed too.
+static unsigned g_module_hash = 0;
+
+static unsigned getModuleHash(Module& M) {
+	unsigned h = hashString(M.getModuleIdentifier());
+	for(Module::iterator it = M.begin(); it != M.end(); it++) {
+		if(it->isDeclaration() || it->hasLocalLinkage()) continue;
+		std::string name = it->getName().str();
+		h = hashBytes(h, name.c_str(), name.size() + 1);
+	}
+	for(Module::global_iterator it = M.global_begin(); it != M.global_end(); it++) {
+		if(it->isDeclaration() || it->hasLocalLinkage()) continue;
+		std::string name = it->getName().str();
+		h = hashBytes(h, name.c_str(), name.size() + 1);
+	}
+	return h;
+}
+
+static StructType* getSiteType(Module& M) {
+	StructType* ty = M.getTypeByName("kulfi_site");
+	if(ty) return ty;
+	LLVMContext& C = M.getContext();
+	std::vector<Type*> fields;
+	fields.push_back(Type::getInt32Ty(C));   // site_id
+	fields.push_back(Type::getInt16Ty(C));   // kind
+	fields.push_back(Type::getInt16Ty(C));   // width
+	fields.push_back(Type::getInt8PtrTy(C)); // func
+	fields.push_back(Type::getInt8PtrTy(C)); // bb
+	fields.push_back(PointerType::getUnqual(getConfigType(M)));
+	return StructType::create(C, fields, "kulfi_site");
+}
+
+// Fault site manifest (struct kulfi_manifest in kulfi_rt.h), emitted in the
+//   "kulfi_manifest" section by writeManifest(). Everything in it refers to
+//   names by their offset in its string pool, so the section needs no
+//   relocations. Function and BB names used by the instrumentation point into
+//   the same pool, through strings_placeholder until the manifest exists.
+#define KULFI_MANIFEST_VERSION 3
+struct ManifestSite {
+	int site_id;
+	unsigned kind, width, func_id, bb_id, line, key;
+};
+static std::vector<ManifestSite> manifest_sites;
+static std::vector<std::pair<unsigned, unsigned> > manifest_bbs; // (name, func_id)
+static std::vector<unsigned> manifest_funcs; // name
+static std::map<std::string, unsigned> manifest_bb_ids, manifest_func_ids;
+static std::map<std::string, unsigned> string_offsets;
+static std::string string_pool;
+static GlobalVariable* strings_placeholder = NULL;
+// Set by kulfi_enable_lazy_instrumentation(): the JIT emits code before the
+//   manifest could exist, so names are separate strings and there is no manifest
+static bool lazy_mode = false;
+static std::map<std::string, GlobalVariable*> lazy_names;
+
+static unsigned getStringOffset(const std::string& name) {
+	std::map<std::string, unsigned>::iterator it = string_offsets.find(name);
+	if(it != string_offsets.end()) return it->second;
+	unsigned offset = string_pool.size();
+	string_pool += name;
+	string_pool.push_back('\0');
+	string_offsets[name] = offset;
+	return offset;
+}
+
+// Pointer to <name> in the manifest's string pool (in lazy mode, to a string of its own)
+static Constant* getNameString(Module& M, const std::string& name) {
+	LLVMContext& C = M.getContext();
+	if(lazy_mode) {
+		GlobalVariable*& gv = lazy_names[name];
+		if(!gv) {
+			Constant* str = ConstantDataArray::getString(C, name);
+			gv = new GlobalVariable(M, str->getType(), true, GlobalValue::PrivateLinkage,
+				str, "kulfi.name");
+		}
+		Constant* zero = ConstantInt::get(Type::getInt32Ty(C), 0);
+		Constant* indices[] = { zero, zero };
+		return ConstantExpr::getInBoundsGetElementPtr(gv, indices);
+	}
+	if(!strings_placeholder) {
+		strings_placeholder = new GlobalVariable(M, ArrayType::get(Type::getInt8Ty(C), 0), true,
+			GlobalValue::ExternalLinkage, NULL, "kulfi.manifest.strings");
+	}
+	Constant* indices[] = { ConstantInt::get(Type::getInt32Ty(C), 0),
+		ConstantInt::get(Type::getInt32Ty(C), getStringOffset(name)) };
+	return ConstantExpr::getInBoundsGetElementPtr(strings_placeholder, indices);
+}
+
+static unsigned getManifestFuncId(const std::string& func) {
+	std::map<std::string, unsigned>::iterator it = manifest_func_ids.find(func);
+	if(it != manifest_func_ids.end()) return it->second;
+	unsigned id = manifest_funcs.size();
+	manifest_funcs.push_back(getStringOffset(func));
+	manifest_func_ids[func] = id;
+	return id;
+}
+
+// BB names are unique in the module (see addBBEntryCalls)
+static unsigned getManifestBBId(const std::string& bb, const std::string& func) {
+	std::map<std::string, unsigned>::iterator it = manifest_bb_ids.find(bb);
+	if(it != manifest_bb_ids.end()) return it->second;
+	unsigned id = manifest_bbs.size();
+	manifest_bbs.push_back(std::make_pair(getStringOffset(bb), getManifestFuncId(func)));
+	manifest_bb_ids[bb] = id;
+	return id;
+}
+
+// Keeps <gv> in the object file although nothing refers to it
+static void appendToUsed(Module& M, GlobalValue* gv) {
+	LLVMContext& C = M.getContext();
+	Type* i8ptr = Type::getInt8PtrTy(C);
+	std::vector<Constant*> used;
+	GlobalVariable* old = M.getGlobalVariable("llvm.used");
+	if(old) {
+		if(ConstantArray* init = dyn_cast<ConstantArray>(old->getInitializer())) {
+			for(unsigned i=0; i<init->getNumOperands(); i++) used.push_back(init->getOperand(i));
 		}
+		old->eraseFromParent();
+	}
+	used.push_back(ConstantExpr::getBitCast(gv, i8ptr));
+	ArrayType* ty = ArrayType::get(i8ptr, used.size());
+	GlobalVariable* gv_used = new GlobalVariable(M, ty, false, GlobalValue::AppendingLinkage,
+		ConstantArray::get(ty, used), "llvm.used");
+	gv_used->setSection("llvm.metadata");
+}
+
+static void writeManifest(Module& M) {
+	if(manifest_sites.empty() && !strings_placeholder) return;
+	LLVMContext& C = M.getContext();
+	Type* i16 = Type::getInt16Ty(C);
+	Type* i32 = Type::getInt32Ty(C);
+
+	// Each manifest is a multiple of 8 bytes, so that the ones of all
+	//   linked modules follow each other in the section without gaps
+	const unsigned header_size = 40, site_size = 24, bb_size = 8, func_size = 4;
+	unsigned size = header_size + site_size * manifest_sites.size() +
+		bb_size * manifest_bbs.size() + func_size * manifest_funcs.size() + string_pool.size();
+	while(size % 8) { string_pool.push_back('\0'); size++; }
+
+	std::vector<Constant*> fields, elems;
+	fields.push_back(ConstantDataArray::getString(C, "KULFIMF", true));
+	fields.push_back(ConstantInt::get(i32, KULFI_MANIFEST_VERSION));
+	fields.push_back(ConstantInt::get(i32, size));
+	fields.push_back(ConstantInt::get(i32, manifest_sites.size()));
+	fields.push_back(ConstantInt::get(i32, manifest_bbs.size()));
+	fields.push_back(ConstantInt::get(i32, manifest_funcs.size()));
+	fields.push_back(ConstantInt::get(i32, string_pool.size()));
+	fields.push_back(ConstantInt::get(i32, g_module_hash));
+	fields.push_back(ConstantInt::get(i32, g_fault_index)); // num_site_ids
+	Constant* header = ConstantStruct::getAnon(C, fields, true);
+
+	std::vector<Type*> site_fields(1, i32);
+	site_fields.push_back(i16); site_fields.push_back(i16);
+	site_fields.push_back(i32); site_fields.push_back(i32); site_fields.push_back(i32);
+	site_fields.push_back(i32);
+	StructType* site_ty = StructType::get(C, site_fields, true);
+	for(unsigned i=0; i<manifest_sites.size(); i++) {
+		const ManifestSite& ms = manifest_sites[i];
+		fields.clear();
+		fields.push_back(ConstantInt::get(i32, ms.site_id));
+		fields.push_back(ConstantInt::get(i16, ms.kind));
+		fields.push_back(ConstantInt::get(i16, ms.width));
+		fields.push_back(ConstantInt::get(i32, ms.func_id));
+		fields.push_back(ConstantInt::get(i32, ms.bb_id));
+		fields.push_back(ConstantInt::get(i32, ms.line));
+		fields.push_back(ConstantInt::get(i32, ms.key));
+		elems.push_back(ConstantStruct::get(site_ty, fields));
+	}
+	ArrayType* sites_ty = ArrayType::get(site_ty, elems.size());
+	Constant* sites = ConstantArray::get(sites_ty, elems);
+
+	StructType* bb_ty = StructType::get(i32, i32, NULL);
+	elems.clear();
+	for(unsigned i=0; i<manifest_bbs.size(); i++) {
+		elems.push_back(ConstantStruct::get(bb_ty, ConstantInt::get(i32, manifest_bbs[i].first),
+			ConstantInt::get(i32, manifest_bbs[i].second), NULL));
+	}
+	ArrayType* bbs_ty = ArrayType::get(bb_ty, elems.size());
+	Constant* bbs = ConstantArray::get(bbs_ty, elems);
+
+	elems.clear();
+	for(unsigned i=0; i<manifest_funcs.size(); i++)
+		elems.push_back(ConstantInt::get(i32, manifest_funcs[i]));
+	Constant* funcs = ConstantArray::get(ArrayType::get(i32, elems.size()), elems);
+
+	Constant* strings = ConstantDataArray::getString(C, string_pool, false);
+
+	fields.clear();
+	fields.push_back(header);
+	fields.push_back(sites);
+	fields.push_back(bbs);
+	fields.push_back(funcs);
+	fields.push_back(strings);
+	Constant* init = ConstantStruct::getAnon(C, fields, true);
+	GlobalVariable* manifest = new GlobalVariable(M, init->getType(), true,
+		GlobalValue::InternalLinkage, init, "kulfi.manifest");
+	manifest->setSection("kulfi_manifest");
+	manifest->setAlignment(8);
+	appendToUsed(M, manifest);
+
+	if(strings_placeholder) {
+		Constant* indices[] = { ConstantInt::get(i32, 0), ConstantInt::get(i32, 4) };
+		Constant* pool = ConstantExpr::getInBoundsGetElementPtr(manifest, indices);
+		strings_placeholder->replaceAllUsesWith(
+			ConstantExpr::getBitCast(pool, strings_placeholder->getType()));
+		strings_placeholder->eraseFromParent();
+		strings_placeholder = NULL;
+	}
+}
+
+// The writable globals of the module (struct kulfi_global in kulfi_rt.h), in the
+//   "kulfi_globals" section: memory mode corrupts their words as well as the heap's.
+//   Names go into the manifest's string pool, so this runs before writeManifest.
+static void writeGlobalsTable(Module& M) {
+	LLVMContext& C = M.getContext();
+	Type* i8ptr = Type::getInt8PtrTy(C);
+	Type* i64 = Type::getInt64Ty(C);
+	DataLayout TD(&M);
+	StructType* global_ty = StructType::get(i8ptr, i64, i8ptr, NULL);
+	std::vector<Constant*> elems;
+	for(Module::global_iterator it = M.global_begin(); it != M.global_end(); ++it) {
+		GlobalVariable* gv = it;
+		if(gv->isDeclaration() || gv->isConstant() || gv->isThreadLocal() || gv->hasSection())
+			continue;
+		if(gv->getName().startswith("kulfi") || gv->getName().startswith("llvm.")) continue;
+		uint64_t size = TD.getTypeAllocSize(gv->getType()->getElementType());
+		if(size < 8) continue; // Not a whole word
+		elems.push_back(ConstantStruct::get(global_ty, ConstantExpr::getBitCast(gv, i8ptr),
+			ConstantInt::get(i64, size), getNameString(M, gv->getName().str()), NULL));
+	}
+	if(elems.empty()) return;
+	ArrayType* table_ty = ArrayType::get(global_ty, elems.size());
+	GlobalVariable* table = new GlobalVariable(M, table_ty, true, GlobalValue::InternalLinkage,
+		ConstantArray::get(table_ty, elems), "kulfi.globals");
+	table->setSection("kulfi_globals");
+	table->setAlignment(8);
+	appendToUsed(M, table);
+}
+
+// The runtime's countdown test, at the end of <entry>: branches to <skip> (where the
+//   countdown is decremented, the caller adds the terminator) or to <slow>.
+static void createCountdownTest(Module& M, BasicBlock* entry, BasicBlock* skip,
+	BasicBlock* slow) {
+	LLVMContext& C = M.getContext();
+	Type* i64 = Type::getInt64Ty(C);
+	Constant* countdown = M.getOrInsertGlobal("kulfi_site_countdown", i64);
+	// The countdown is a long long: with clang's TBAA tag for long long, type-based
+	//   alias analysis knows it is not the int, double or pointer the program
+	//   loads, so they can still be hoisted or reused across fault sites
+	MDBuilder mdb(C);
+	MDNode* tbaa = mdb.createTBAANode("long long",
+		mdb.createTBAANode("omnipotent char", mdb.createTBAARoot("Simple C/C++ TBAA")));
+	IRBuilder<> irb(entry);
+	LoadInst* cnt = irb.CreateLoad(countdown, "countdown");
+	cnt->setMetadata(LLVMContext::MD_tbaa, tbaa);
+	Value* is_skip = irb.CreateICmpSGT(cnt, ConstantInt::get(i64, 0));
+	// At most one site in a whole interval takes the slow path
+	irb.CreateCondBr(is_skip, skip, slow, mdb.createBranchWeights(1000, 1));
+
+	irb.SetInsertPoint(skip);
+	StoreInst* dec = irb.CreateStore(irb.CreateSub(cnt, ConstantInt::get(i64, 1)), countdown);
+	dec->setMetadata(LLVMContext::MD_tbaa, tbaa);
+}
+
+// The runtime's countdown test:
+//   if(kulfi_site_countdown > 0) { kulfi_site_countdown--; return value; }
+//   return cold(site, value);
+// -ijo is known here, so <cold> is already the matching corrupt*_ijo/_multi instance.
+static Function* createFastPath(Module& M, Value* cold, const char* name, Type* valTy) {
+	LLVMContext& C = M.getContext();
+	std::vector<Type*> params;
+	params.push_back(PointerType::getUnqual(getSiteType(M)));
+	params.push_back(valTy);
+	Function* F = Function::Create(FunctionType::get(valTy, params, false),
+		GlobalValue::InternalLinkage, std::string("kulfi.fast.") + name, &M);
+	F->addFnAttr(Attributes::AlwaysInline);
+
+	Function::arg_iterator ai = F->arg_begin();
+	Value* site = ai++;
+	Value* value = ai++;
+
+	BasicBlock* entry = BasicBlock::Create(C, "entry", F);
+	BasicBlock* skip  = BasicBlock::Create(C, "skip", F);
+	BasicBlock* slow  = BasicBlock::Create(C, "slow", F);
+	createCountdownTest(M, entry, skip, slow);
+	IRBuilder<> irb(skip);
+	irb.CreateRet(value);
+
+	irb.SetInsertPoint(slow);
+	CallInst* call = irb.CreateCall2(cold, site, value);
+	call->setDoesNotThrow();
+	irb.CreateRet(call);
+	return F;
+}
+
+// Pointer faults are an offset from the original pointer: the fault site returns
+//   corrupted - original, which is 0 unless the fault is injected, and the pass
+//   rebuilds the pointer as an i8 GEP of the original one (see CorruptPointer).
+//   The pointer keeps its base, so alias analysis still knows what it points to;
+//   the ptrtoint only exists in the slow path:
+//     if(kulfi_site_countdown > 0) { kulfi_site_countdown--; return 0; }
+//     return cold(site, (long long)p) - (long long)p;
+// Without the fast path, the slow path is the whole function.
+static Function* createPointerDelta(Module& M, Value* cold) {
+	LLVMContext& C = M.getContext();
+	Type* i64 = Type::getInt64Ty(C);
+	std::vector<Type*> params;
+	params.push_back(PointerType::getUnqual(getSiteType(M)));
+	params.push_back(Type::getInt8PtrTy(C));
+	Function* F = Function::Create(FunctionType::get(i64, params, false),
+		GlobalValue::InternalLinkage, "kulfi.fast.corruptPtrDelta", &M);
+	F->addFnAttr(Attributes::AlwaysInline);
+
+	Function::arg_iterator ai = F->arg_begin();
+	Value* site = ai++;
+	Value* ptr = ai++;
+
+	BasicBlock* slow;
+	if(fast_path) {
+		BasicBlock* entry = BasicBlock::Create(C, "entry", F);
+		BasicBlock* skip  = BasicBlock::Create(C, "skip", F);
+		slow = BasicBlock::Create(C, "slow", F);
+		createCountdownTest(M, entry, skip, slow);
+		ReturnInst::Create(C, ConstantInt::get(i64, 0), skip);
+	} else {
+		slow = BasicBlock::Create(C, "slow", F);
+	}
+
+	IRBuilder<> irb(slow);
+	Value* addr = irb.CreatePtrToInt(ptr, i64);
+	CallInst* call = irb.CreateCall2(cold, site, addr);
+	call->setDoesNotThrow();
+	irb.CreateRet(irb.CreateSub(call, addr));
+	return F;
+}
+
+// The corrupt*_ijo/_multi instance matching -ijo: valTy (const kulfi_site*, valTy)
+static Value* getColdFunction(Module& M, const char* name, Type* valTy) {
+	std::vector<Type*> params;
+	params.push_back(PointerType::getUnqual(getSiteType(M)));
+	params.push_back(valTy);
+	std::string fname = std::string(name) + (ijo ? "_ijo" : "_multi");
+	Value* cold = M.getOrInsertFunction(fname, FunctionType::get(valTy, params, false));
+	addExtAttr(cold, 0, valTy);
+	addExtAttr(cold, params.size(), valTy);
+	setNoUnwind(cold);
+	if(Function* F = dyn_cast<Function>(cold)) F->setDoesNotCapture(1); // The site descriptor
+	return cold;
+}
+
+static Value* declareCorruptFunction(Module& M, const char* name, Type* valTy) {
+	LLVMContext& C = M.getContext();
+	Value* cold = getColdFunction(M, name, valTy);
+
+	CorruptFunction cf;
+	cf.is_fast_path = fast_path;
+	cf.target = fast_path ? createFastPath(M, cold, name, valTy) : cold;
+	std::vector<Type*> params(5, Type::getInt32Ty(C)); // fault_index, ijo, ef, tf, byte_val
+	params.push_back(valTy);
+	cf.stub = Function::Create(FunctionType::get(valTy, params, false),
+		GlobalValue::ExternalLinkage, std::string("kulfi.site.") + name, &M);
+	corrupt_functions.push_back(cf);
+	return cf.stub;
+}
+
+// The stub of pointer faults: (fault_index, ijo, ef, tf, byte_val, i8* p) -> i64 offset.
+//   The cold path is corruptIntData_64bit's; the wrapper is always inlined.
+static Value* declarePointerDeltaFunction(Module& M) {
+	LLVMContext& C = M.getContext();
+	Type* i64 = Type::getInt64Ty(C);
+	Value* cold = getColdFunction(M, "corruptIntData_64bit", i64);
+
+	CorruptFunction cf;
+	cf.is_fast_path = true;
+	cf.target = createPointerDelta(M, cold);
+	std::vector<Type*> params(5, Type::getInt32Ty(C));
+	params.push_back(Type::getInt8PtrTy(C));
+	cf.stub = Function::Create(FunctionType::get(i64, params, false),
+		GlobalValue::ExternalLinkage, "kulfi.site.corruptPtrDelta", &M);
+	corrupt_functions.push_back(cf);
+	return cf.stub;
+}
+
+// Vector fault sites corrupt one lane: the runtime chooses the lane (kulfi_vector_lane)
+//   and the cold path of the element type the bit:
+//     if(kulfi_site_countdown > 0) { kulfi_site_countdown--; return value; }
+//     lane = kulfi_vector_lane(site, N);
+//     return insertelement(value, cold(site, extractelement(value, lane)), lane);
+// Without the fast path, the slow path is the whole function.
+static Function* createVectorFastPath(Module& M, Value* cold, const std::string& name,
+	VectorType* vecTy) {
+	LLVMContext& C = M.getContext();
+	Type* i32 = Type::getInt32Ty(C);
+	std::vector<Type*> params;
+	params.push_back(PointerType::getUnqual(getSiteType(M)));
+	params.push_back(i32);
+	Value* func_vectorLane = M.getOrInsertFunction("kulfi_vector_lane",
+		FunctionType::get(i32, params, false));
+	setNoUnwind(func_vectorLane);
+	if(Function* F = dyn_cast<Function>(func_vectorLane)) F->setDoesNotCapture(1);
+
+	params[1] = vecTy;
+	Function* F = Function::Create(FunctionType::get(vecTy, params, false),
+		GlobalValue::InternalLinkage, "kulfi.fast." + name, &M);
+	F->addFnAttr(Attributes::AlwaysInline);
+
+	Function::arg_iterator ai = F->arg_begin();
+	Value* site = ai++;
+	Value* value = ai++;
+
+	BasicBlock* slow;
+	if(fast_path) {
+		BasicBlock* entry = BasicBlock::Create(C, "entry", F);
+		BasicBlock* skip  = BasicBlock::Create(C, "skip", F);
+		slow = BasicBlock::Create(C, "slow", F);
+		createCountdownTest(M, entry, skip, slow);
+		ReturnInst::Create(C, value, skip);
+	} else {
+		slow = BasicBlock::Create(C, "slow", F);
+	}
 
-		if(cstr == "main") { // Outro
-			BasicBlock* bb = &(it->back());
-			Instruction* first_inst = bb->getFirstNonPHI();
-			CallInst* instcnt_call = CallInst::Create(func_printInstCount, 
-				std::vector<Value*>(), "", first_inst);
-			assert(instcnt_call);
+	IRBuilder<> irb(slow);
+	CallInst* lane = irb.CreateCall2(func_vectorLane, site,
+		ConstantInt::get(i32, vecTy->getNumElements()), "lane");
+	lane->setDoesNotThrow();
+	CallInst* call = irb.CreateCall2(cold, site, irb.CreateExtractElement(value, lane));
+	call->setDoesNotThrow();
+	irb.CreateRet(irb.CreateInsertElement(value, call, lane));
+	return F;
+}
+
+// Stub per vector type, created on first use
+static std::map<Type*, Value*> vector_corrupt_functions;
+
+// The stub of the fault sites on <vecTy> values, or NULL if the element type
+//   has no corrupt function (i1, pointers, x86_fp80)
+static Value* getVectorCorruptFunction(Module& M, Type* vecTy) {
+	if(!vecTy->isVectorTy()) return NULL;
+	std::map<Type*, Value*>::iterator it = vector_corrupt_functions.find(vecTy);
+	if(it != vector_corrupt_functions.end()) return it->second;
+
+	Type* elTy = vecTy->getScalarType();
+	const char* name = NULL;
+	if(elTy->isIntegerTy(8))       name = "corruptIntData_8bit";
+	else if(elTy->isIntegerTy(16)) name = "corruptIntData_16bit";
+	else if(elTy->isIntegerTy(32)) name = "corruptIntData_32bit";
+	else if(elTy->isIntegerTy(64)) name = "corruptIntData_64bit";
+	else if(elTy->isFloatTy())     name = "corruptFloatData_32bit";
+	else if(elTy->isDoubleTy())    name = "corruptFloatData_64bit";
+	if(!name) {
+		vector_corrupt_functions[vecTy] = NULL;
+		return NULL;
+	}
+
+	LLVMContext& C = M.getContext();
+	std::string vname = std::string(name) + ".v" +
+		utostr(cast<VectorType>(vecTy)->getNumElements());
+	CorruptFunction cf;
+	cf.is_fast_path = true;
+	cf.target = createVectorFastPath(M, getColdFunction(M, name, elTy), vname,
+		cast<VectorType>(vecTy));
+	std::vector<Type*> params(5, Type::getInt32Ty(C)); // fault_index, ijo, ef, tf, byte_val
+	params.push_back(vecTy);
+	cf.stub = Function::Create(FunctionType::get(vecTy, params, false),
+		GlobalValue::ExternalLinkage, "kulfi.site." + vname, &M);
+	corrupt_functions.push_back(cf);
+	vector_corrupt_functions[vecTy] = cf.stub;
+	return cf.stub;
+}
+
+// The fault site call on a vector value (the last of <args>), or NULL
+static CallInst* createVectorCorruptCall(std::vector<Value*>& args, Instruction* insert_before) {
+	Module& M = *insert_before->getParent()->getParent()->getParent();
+	Value* fn = getVectorCorruptFunction(M, args.back()->getType());
+	if(!fn) return NULL;
+	CallInst* CallI = CallInst::Create(fn, args, "call_corruptVector", insert_before);
+	CallI->setCallingConv(CallingConv::C);
+	return CallI;
+}
+
+static bool compareFaultIndex(const std::pair<int, CallInst*>& a,
+	const std::pair<int, CallInst*>& b) {
+	return a.first < b.first;
+}
+
+static GlobalVariable* g_config = NULL;
+
+// Creates kulfi.config, kulfi.module (IDs 1 .. g_fault_index) and the constructor that
+//   registers the module with the runtime
+static void createModuleConfig(Module& M) {
+	LLVMContext& C = M.getContext();
+	StructType* config_ty = getConfigType(M);
+	Type* i32 = Type::getInt32Ty(C);
+
+	// The runtime writes site_base into kulfi.module when the constructor registers it
+	g_module_hash = getModuleHash(M);
+	StructType* module_ty = getModuleType(M);
+	std::vector<Constant*> module_fields;
+	module_fields.push_back(ConstantInt::get(i32, g_module_hash));
+	module_fields.push_back(ConstantInt::get(i32, g_fault_index)); // IDs are 1 .. g_fault_index
+	module_fields.push_back(ConstantInt::get(i32, 0));
+	GlobalVariable* module = new GlobalVariable(M, module_ty, false, GlobalValue::InternalLinkage,
+		ConstantStruct::get(module_ty, module_fields), "kulfi.module");
+
+	std::vector<Type*> params(1, module->getType());
+	Constant* func_registerModule = M.getOrInsertFunction("kulfi_register_module",
+		FunctionType::get(Type::getVoidTy(C), params, false));
+	Function* ctor = Function::Create(FunctionType::get(Type::getVoidTy(C), false),
+		GlobalValue::InternalLinkage, "kulfi.register_module", &M);
+	std::vector<Value*> args(1, module);
+	CallInst::Create(func_registerModule, args, "",
+		ReturnInst::Create(C, BasicBlock::Create(C, "", ctor)));
+	appendToGlobalCtors(M, ctor, 65535);
+
+	std::vector<Constant*> config_fields;
+	config_fields.push_back(ConstantInt::get(i32, print_fs ? 0 : (int)ef));
+	config_fields.push_back(ConstantInt::get(i32, tf));
+	config_fields.push_back(ConstantInt::get(i32, byte_val));
+	config_fields.push_back(ConstantInt::get(i32, ijo));
+	config_fields.push_back(module);
+	g_config = new GlobalVariable(M, config_ty, true, GlobalValue::InternalLinkage,
+		ConstantStruct::get(config_ty, config_fields), "kulfi.config");
+}
+
+// Builds a site descriptor table, <table_name>, for the stub calls in the module
+//   and replaces them.
+static void lowerFaultSiteCalls(Module& M, const std::string& table_name) {
+	LLVMContext& C = M.getContext();
+	StructType* site_ty = getSiteType(M);
+	Type* i32 = Type::getInt32Ty(C);
+	Type* i16 = Type::getInt16Ty(C);
+
+	// (fault_index, call), and the CorruptFunction of each call
+	std::vector<std::pair<int, CallInst*> > calls;
+	std::map<CallInst*, CorruptFunction*> call_cf;
+	for(unsigned i=0; i<corrupt_functions.size(); i++) {
+		Function* stub = corrupt_functions[i].stub;
+		for(Value::use_iterator ui = stub->use_begin(); ui != stub->use_end(); ui++) {
+			CallInst* CI = cast<CallInst>(*ui);
+			int fault_index = (int)cast<ConstantInt>(CI->getArgOperand(0))->getSExtValue();
+			calls.push_back(std::make_pair(fault_index, CI));
+			call_cf[CI] = &corrupt_functions[i];
+		}
+	}
+	std::stable_sort(calls.begin(), calls.end(), compareFaultIndex);
+
+	std::vector<Constant*> descs;
+	for(unsigned i=0; i<calls.size(); i++) {
+		int fault_index = calls[i].first;
+		CallInst* CI = calls[i].second;
+		Type* valTy = CI->getType();
+		const FaultSiteRecord& fs = getFaultSite(fault_index);
+		std::string bbname = "";
+		if(fs.bb && bb_names.count(fs.bb))
+			bbname = bb_names[fs.bb];
+		std::string funcname = CI->getParent()->getParent()->getName();
+
+		ManifestSite ms;
+		ms.site_id = fault_index;
+		ms.kind = (fs.logged && fs.type == DYN_FAULT_PTR) ?
+			KULFI_SITE_PTR : KULFI_SITE_DATA;
+		ms.width = valTy->isPointerTy() ? 64 : valTy->getPrimitiveSizeInBits();
+		ms.func_id = getManifestFuncId(funcname);
+		ms.bb_id = getManifestBBId(bbname, funcname);
+		ms.line = fs.line;
+		ms.key = fs.key;
+		manifest_sites.push_back(ms);
+
+		std::vector<Constant*> fields;
+		fields.push_back(ConstantInt::get(i32, fault_index));
+		fields.push_back(ConstantInt::get(i16, ms.kind));
+		fields.push_back(ConstantInt::get(i16, ms.width));
+		fields.push_back(getNameString(M, funcname));
+		fields.push_back(getNameString(M, bbname));
+		fields.push_back(g_config);
+		descs.push_back(ConstantStruct::get(site_ty, fields));
+	}
+	ArrayType* table_ty = ArrayType::get(site_ty, descs.size());
+	GlobalVariable* table = new GlobalVariable(M, table_ty, true, GlobalValue::InternalLinkage,
+		ConstantArray::get(table_ty, descs), table_name);
+
+	Constant* zero = ConstantInt::get(i32, 0);
+	for(unsigned i=0; i<calls.size(); i++) {
+		CallInst* CI = calls[i].second;
+		CorruptFunction* cf = call_cf[CI];
+		Constant* indices[] = { zero, ConstantInt::get(i32, i) };
+		Constant* site = ConstantExpr::getInBoundsGetElementPtr(table, indices);
+		std::vector<Value*> args;
+		args.push_back(site);
+		args.push_back(CI->getArgOperand(5));
+		CallInst* lowered = CallInst::Create(cf->target, args, "", CI);
+		lowered->setDoesNotThrow();
+		lowered->takeName(CI);
+		CI->replaceAllUsesWith(lowered);
+		CI->eraseFromParent();
+		if(cf->is_fast_path) {
+			InlineFunctionInfo IFI;
+			bool ok = InlineFunction(lowered, IFI);
+			assert(ok);
 		}
 	}
 }
 
-// 20130709: This feature is added to ensure that
-//   fault IDs and actually injected fault sites match
-static void printFaultSiteInfo() {
-	FILE* fs_f = fopen("fault_sites.txt", "w");
-	if(!fs_f) fs_f = stderr;
-	fprintf(fs_f, "FaultSiteID\tType\tInstruction\n");
-	for(std::map<int, std::pair<std::string, FaultType> >::iterator itr = g_fault_sites.begin(); itr != g_fault_sites.end(); itr++) {
-		std::string inst_string;
-
-		// Index of fault
-		int idx = (*itr).first;
-
-		// Type of fault
-		FaultType fault_type = (*itr).second.second;
-		std::string fault_type_sz;
-		switch(fault_type) {
-			case DYN_FAULT_PTR:
-				fault_type_sz = "Pointer"; break;
-			case DYN_FAULT_DATA:
-				fault_type_sz = "Data";    break;
-			default:
-				assert(0);
+static void lowerFaultSites(Module& M) {
+	createModuleConfig(M);
+	lowerFaultSiteCalls(M, "kulfi.sites");
+	for(unsigned i=0; i<corrupt_functions.size(); i++) {
+		corrupt_functions[i].stub->eraseFromParent();
+		if(corrupt_functions[i].is_fast_path)
+			cast<Function>(corrupt_functions[i].target)->eraseFromParent();
+	}
+	corrupt_functions.clear();
+	vector_corrupt_functions.clear();
+}
+
+static void declareRuntimeFunctions(Module& M) {
+	LLVMContext& C = M.getContext();
+	Type* i32 = Type::getInt32Ty(C);
+	std::vector<Type*> params;
+
+	// The old workflow linked Corrupt.bc into the target; its functions would be instrumented
+	Function* rt = M.getFunction("initializeFaultInjectionCampaign");
+	if(rt && !rt->isDeclaration()) {
+		report_fatal_error("[dynfault] The module contains the KULFI runtime. "
+			"Do not llvm-link Corrupt.bc; link the instrumented program with libkulfi_rt instead.");
+	}
+
+	func_corruptIntData_8bit    = declareCorruptFunction(M, "corruptIntData_8bit",    Type::getInt8Ty(C));
+	func_corruptIntData_16bit   = declareCorruptFunction(M, "corruptIntData_16bit",   Type::getInt16Ty(C));
+	func_corruptIntData_32bit   = declareCorruptFunction(M, "corruptIntData_32bit",   i32);
+	func_corruptIntData_64bit   = declareCorruptFunction(M, "corruptIntData_64bit",   Type::getInt64Ty(C));
+	func_corruptFloatData_32bit = declareCorruptFunction(M, "corruptFloatData_32bit", Type::getFloatTy(C));
+	func_corruptFloatData_64bit = declareCorruptFunction(M, "corruptFloatData_64bit", Type::getDoubleTy(C));
+	func_corruptFloatData_80bit = declareCorruptFunction(M, "corruptFloatData_80bit", Type::getX86_FP80Ty(C));
+	func_corruptIntAdr_32bit    = declareCorruptFunction(M, "corruptIntAdr_32bit",    Type::getInt32PtrTy(C));
+	func_corruptIntAdr_64bit    = declareCorruptFunction(M, "corruptIntAdr_64bit",    Type::getInt64PtrTy(C));
+	func_corruptFloatAdr_32bit  = declareCorruptFunction(M, "corruptFloatAdr_32bit",  Type::getFloatPtrTy(C));
+	func_corruptFloatAdr_64bit  = declareCorruptFunction(M, "corruptFloatAdr_64bit",  Type::getDoublePtrTy(C));
+	func_corruptPtrDelta        = declarePointerDeltaFunction(M);
+
+	params.clear();
+	func_isNextFaultInThisBB = M.getOrInsertFunction("isNextFaultInThisBB",
+		FunctionType::get(Type::getInt1Ty(C), params, false));
+	addExtAttr(func_isNextFaultInThisBB, 0, Type::getInt1Ty(C));
+	// Only reads the runtime's state: calls in a BB without stores or other runtime
+	//   calls can be merged, and the predicate does not block GVN or LICM of loads
+	setNoUnwind(func_isNextFaultInThisBB);
+	if(Function* F = dyn_cast<Function>(func_isNextFaultInThisBB)) F->setOnlyReadsMemory();
+	func_printInstCount = M.getOrInsertFunction("__printInstCount",
+		FunctionType::get(Type::getVoidTy(C), params, false));
+	setNoUnwind(func_printInstCount);
+
+	params.push_back(Type::getInt8PtrTy(C)); // BB name
+	params.push_back(i32);                    // # of fault sites in BB
+	func_incrementFaultSitesEnumerated = M.getOrInsertFunction("incrementFaultSiteCount",
+		FunctionType::get(Type::getVoidTy(C), params, false));
+	setNoUnwind(func_incrementFaultSitesEnumerated);
+
+	params.assign(2, i32); // ef, tf
+	func_initFaultInjectionCampaign = M.getOrInsertFunction("initializeFaultInjectionCampaign",
+		FunctionType::get(Type::getVoidTy(C), params, false));
+	setNoUnwind(func_initFaultInjectionCampaign);
+
+	params.assign(4, i32); // ijo, ef, tf, byte_val; ignored by the runtime
+	func_print_faultStatistics = M.getOrInsertFunction("print_faultStatistics",
+		FunctionType::get(i32, params, false));
+	setNoUnwind(func_print_faultStatistics);
+}
+
+// Counts how many fault sites there are in the BasicBlocks of this Function.
+static void appendInstCountCalls(Function& F) {
+	Module& M = *F.getParent();
+	std::string cstr = F.getName().str();
+	for(Function::iterator bi = F.begin(); bi!=F.end(); bi++) {
+		BasicBlock* bb = &(*bi);
+		if(blacklisted_bbs.count(bb)) continue;
+
+		Instruction* first_inst = getFirstNonPHINonLandingPad(bb);
+		
+		unsigned size = 0;
+		if(!bb_fs_counts.count(bb)) {
+			bb->getParent()->dump();
+			assert(false);
 		}
+		size = bb_fs_counts[bb];
+		if(size < 1) continue;
+		if(call_next_bbs.count(bb)) { size = size + 1; }
+		std::vector<Value*> args;
+		assert(bb_names.count(bb));
+		std::string bbn = bb_names[bb];
+		
+		// The name is in the manifest's string pool
+		getManifestBBId(bbn, cstr);
+		args.push_back(getNameString(M, bbn));
+		args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()),
+			size));
+		CallInst* inc_call = CallInst::Create(func_incrementFaultSitesEnumerated, args,
+			"", first_inst);
+		
+		assert(inc_call);
+		inc_call->setDoesNotThrow();
+		// Do not inject into this call
+		corrupted_ptrs.insert(inc_call);
+	}
 
-		// Instruction dump (column 3)
-		std::string inst_str = (*itr).second.first;
+	if(cstr == "main") { // Outro
+		BasicBlock* bb = &(F.back());
+		Instruction* first_inst = bb->getFirstNonPHI();
+		CallInst* instcnt_call = CallInst::Create(func_printInstCount, 
+			std::vector<Value*>(), "", first_inst);
+		assert(instcnt_call);
+	}
+}
 
-		fprintf(fs_f, "%d\t%s\t%s\n", idx, fault_type_sz.c_str(), inst_str.c_str());
+// ... and in this Module.
+static void appendInstCountCalls(Module& M) {
+	Module::FunctionListType &fl = M.getFunctionList();
+	for(Module::iterator it = fl.begin(); it!=fl.end(); it++) {
+		std::string cstr = it->getName().str();
+		bool is_blacklisted = isFunctionNameBlacklisted(cstr.c_str());
+		if(is_blacklisted) continue;
+		appendInstCountCalls(*it);
 	}
-	fclose(fs_f);
 }
 
+
 // Description of this function:
 // It corrupts a pointer (means: inst->getType()->isPointerType() == true)
-// by converting it to a 64-bit integer (b/c assuming a 64-bit machine),
-//    corrupting the integer with existing routines, and converting it back.
+// by offsetting it: the fault site returns the difference between the corrupted
+//    and the original address (0 unless the fault is injected, see
+//    createPointerDelta), and the corrupted pointer is an i8 GEP of inst.
 // One caveat is that "replace all uses" of inst should be replaced with
 //    "replace all uses but the first" when updating uses of inst.
 Value* CorruptPointer(Value* inst,
@@ -361,29 +1352,12 @@ Value* CorruptPointer(Value* inst,
 	BasicBlock* BB,
 	std::vector<Value*>& _args) {
 	Instruction* INext = &*BINext;
-	char name_ptr2int[40], corr_name_ptr2int[40], corr_name_ptr[40];
-	sprintf(name_ptr2int, "TheFirstGuy");
-	sprintf(corr_name_ptr2int, "TheSecondGuy");
-	sprintf(corr_name_ptr, "TheThirdGuy");
-	CallInst* CallI = NULL;
 	assert(inst->getType()->isPointerTy());
-	Value* iPtr = NULL; // Pointer converted to Integer.
-	if(INext!=NULL) {
-		iPtr = new PtrToIntInst(inst,
-			IntegerType::getInt64Ty(getGlobalContext()),
-			name_ptr2int,
-			INext
-		);
-		corrupted_ptrs.insert((Instruction*)(iPtr));
-	} else {
-		iPtr = new PtrToIntInst(inst,
-			IntegerType::getInt64Ty(getGlobalContext()),
-			name_ptr2int,
-			BB
-		);
-		corrupted_ptrs.insert((Instruction*)(iPtr));
-	}
-	if(!iPtr) assert(0);
+	IRBuilder<> irb(BB);
+	if(INext != NULL) irb.SetInsertPoint(INext);
+
+	Value* bytePtr = irb.CreateBitCast(inst, Type::getInt8PtrTy(getGlobalContext()),
+		"TheFirstGuy");
 	std::vector<Value*> args;// = _args;
 	args.clear();
 	// Increment g_fault_index
@@ -395,52 +1369,19 @@ Value* CorruptPointer(Value* inst,
 		Value* v = *itr;
 		args.push_back((Value*)v);
 	}
-	args.push_back(iPtr); // <--- The input param is not modified!
-
-	
-	#define CHECK_ARGS(fn) \
-	{ \
-		Function* f = (Function*)(fn); \
-		errs() << "::::" << f->getArgumentList().size() << "," << args.size() ; \
-		errs() << "\n"; \
-		inst->getType()->dump(); \
-		errs() << "\n"; \
-		Function::ArgumentListType::iterator itr = f->getArgumentList().begin(); \
-		std::vector<Value*>::iterator itr2 = args.begin(); \
-		for(; itr!=f->getArgumentList().end(); itr++, itr2++) { \
-			Value* v = *itr2; \
-			Argument* a = &(*itr); \
-			Type* t_v = v->getType(); \
-			Type* t_a = a->getType(); \
-			errs() << " :: "; \
-			t_v->dump();  \
-			errs() << " ";  \
-			t_a->dump();  \
-			errs() << " \n"; \
-		} \
-	}
-//	CHECK_ARGS(func_corruptIntAdr_64bit);	
-	
-	Value* corruptedPtr = NULL;
-	if(INext != NULL) { 
-		CallI = CallInst::Create(func_corruptIntData_64bit, args, corr_name_ptr2int, INext);
-		corruptedPtr = new IntToPtrInst(CallI,
-			inst->getType(),
-			corr_name_ptr,
-			INext
-		);
-		corrupted_ptrs.insert(CallI);
-		corrupted_ptrs.insert((Instruction*)(corruptedPtr));
-	} else {
-		CallI = CallInst::Create(func_corruptIntData_64bit, args, corr_name_ptr2int, BB);
-		corruptedPtr = new IntToPtrInst(CallI,
-			inst->getType(),
-			corr_name_ptr,
-			BB
-		);
-		corrupted_ptrs.insert(CallI); 
-		corrupted_ptrs.insert((Instruction*)(corruptedPtr));
-	}
+	args.push_back(bytePtr); // <--- The input param is not modified!
+
+	CallInst* CallI = irb.CreateCall(func_corruptPtrDelta, args, "TheSecondGuy");
+	Value* gep = irb.CreateGEP(bytePtr, CallI);
+	Value* corruptedPtr = irb.CreateBitCast(gep, inst->getType(), "TheThirdGuy");
+
+	// Blacklist them (do not corrupt them once more in ptr corruption)
+	corrupted_ptrs.insert(CallI);
+	corrupted_ptrs.insert(cast<Instruction>(gep));
+	// The casts may be folded (inst is already an i8*, or a constant)
+	if(bytePtr != inst && isa<Instruction>(bytePtr))
+		corrupted_ptrs.insert(cast<Instruction>(bytePtr));
+	if(corruptedPtr != gep) corrupted_ptrs.insert(cast<Instruction>(corruptedPtr));
 	return corruptedPtr;
 }
 
@@ -452,13 +1393,8 @@ static PHINode* createBranchForCorruptInst(Value* corrupted,
 	BasicBlock *injBB, *prevBB, *nextBB;
 
 	prevBB = ((Instruction*)corrupted)->getParent();
-	BasicBlock::iterator split_at_inj, split_at_next, itr;
-	for(itr = prevBB->begin(); itr != prevBB->end(); itr++) {
-		if((&*itr) == corrupted) {
-			split_at_inj = itr;
-			break;
-		}
-	}
+	BasicBlock::iterator split_at_inj((Instruction*)corrupted), split_at_next, itr;
+	itr = split_at_inj;
 	itr++;
 	split_at_next = itr;
 
@@ -474,9 +1410,11 @@ static PHINode* createBranchForCorruptInst(Value* corrupted,
 	nextBB = injBB ->splitBasicBlock(split_at_next);
 	blacklisted_bbs.insert(injBB);
 	blacklisted_bbs.insert(nextBB);
+	site_bb_origins[injBB] = site_bb_origins[nextBB] = getSiteBBOrigin(prevBB);
 	TerminatorInst* prevBBT_old = prevBB->getTerminator();
 	prevBBT_old->eraseFromParent();
-	Value* pred = (Value*)(bb_to_pred.at(prevBB));
+	Value* pred = bb_to_pred.lookup(prevBB);
+	assert(pred);
 	BranchInst::Create(injBB, nextBB, pred, prevBB);
 	bb_to_pred[nextBB] = pred;
 
@@ -492,19 +1430,29 @@ static PHINode* createBranchForCorruptInst(Value* corrupted,
 //   I hope this would make the resultant binaries run faster
 // This all happens inside 1 BB, so it should be safe to replace
 //   the uses of "original" only in the current BB
+// The sites of a BB are inserted from the last one up (see instrumentFunction),
+//   so the rest of the BB is already split into the BBs of the later sites: the
+//   uses replaced are those in any BB split from the same BB, but not in the head
+//   (before the site) nor in this site's prevBB and injBB. They are found through
+//   the use list of "original", not by walking the instructions.
 static void wrapCorruptInstWithBranch(Value* corrupted, 
 	Value* original) {
 	PHINode* corruptValPhi = createBranchForCorruptInst(corrupted, original);
 	// replace uses of "original" with "corrupted"
 	assert(corruptValPhi);
 	BasicBlock* nextBB = corruptValPhi->getParent();
-	BasicBlock::iterator bi = nextBB->begin();
-	bi++; // Skip the PHINode
-	while(bi != nextBB->end()) {
-		Instruction* valu = &(*bi);
-		valu->replaceUsesOfWith(original, corruptValPhi);
-		bi++;
+	BasicBlock* origin = getSiteBBOrigin(nextBB);
+	BasicBlock* prevBB = corruptValPhi->getIncomingBlock(0);
+	BasicBlock* injBB = corruptValPhi->getIncomingBlock(1);
+	std::vector<Use*> uses; // Setting a use unlinks it from the use list
+	for(Value::use_iterator ui = original->use_begin(); ui != original->use_end(); ui++) {
+		Instruction* valu = dyn_cast<Instruction>(*ui);
+		if(!valu || valu == corruptValPhi) continue;
+		BasicBlock* bb = valu->getParent();
+		if(bb == origin || bb == prevBB || bb == injBB || getSiteBBOrigin(bb) != origin) continue;
+		uses.push_back(&ui.getUse());
 	}
+	for(unsigned i = 0; i < uses.size(); i++) uses[i]->set(corruptValPhi);
 	return;
 }
 
@@ -520,87 +1468,81 @@ static void wrapCorruptInstWithBranch(Value* corrupted,
 //
 // [ Inst ] [ Inst ] [ Inst ]          [ Call ]         [ Inst ]
 //
-static BasicBlock::iterator getFirstCallInst(BasicBlock* bb) {
-	BasicBlock::iterator it;
-	for(it = bb->begin(); it!=bb->end(); it++) {
-		Instruction* inst = &(*it);
-		if(isa<CallInst>(inst)) {
-			return it;
-		}
-	}
-	return bb->end();
-}
+// splitBasicBlock() keeps the head in the old BB and moves the rest, so the calls
+//   of a BB are split from the last one up: each split only moves the instructions
+//   up to the next call. The new BBs are then named in program order, which gives
+//   them the names they would get if they were split from the first call down.
 static void splitBBOnCallInsts(Module& M) {
 	Module::FunctionListType &fnList = M.getFunctionList();
 	for(Module::iterator it = fnList.begin(); it != fnList.end(); it++) {
 		Function& F = *it;
-		Function::iterator startFrom = F.begin();
-		while(true) {
-			bool is_found = false; // found CallInst in function
-			Function::iterator currBB = F.begin();
-			BasicBlock::iterator itr_callI;
-			// while currBB has a CallInst
-
-			// move to "next-BB"
-			while(currBB != startFrom && currBB != F.end()) {
-				currBB++;
+		std::string x = F.getName();
+		std::vector<BasicBlock*> bbs;
+		for(Function::iterator currBB = F.begin(); currBB != F.end(); currBB++)
+			bbs.push_back(&(*currBB));
+		for(unsigned i = 0; i < bbs.size(); i++) {
+			BasicBlock* bb = bbs[i];
+			std::vector<Instruction*> calls;
+			for(BasicBlock::iterator bi = bb->begin(); bi != bb->end(); bi++)
+				if(isa<CallInst>(&*bi)) calls.push_back(&*bi);
+			if(calls.empty()) continue;
+
+			std::vector<BasicBlock*> split_bbs(2 * calls.size()); // callBB, nextStart, ...
+			for(int c = (int)calls.size() - 1; c >= 0; c--) {
+				BasicBlock::iterator next2(calls[c]);
+				next2++;
+				split_bbs[2*c + 1] = bb->splitBasicBlock(next2);
+				split_bbs[2*c] = bb->splitBasicBlock(BasicBlock::iterator(calls[c]));
 			}
-			if(currBB == F.end()) break;
-			assert(currBB == startFrom);
-
-			do {
-				for(; currBB != F.end(); currBB++) {
-					BasicBlock* bb = &(*currBB);
-					itr_callI = getFirstCallInst(bb);
-					if(itr_callI != bb->end()) {
-						is_found = true;
-						break;
-					}
-				}
-			} while(false);
-
-			if(is_found) {
-				std::string x = F.getName();
-				BasicBlock* callBB = (*currBB).splitBasicBlock(itr_callI, x + "_callBB");
+			for(unsigned c = 0; c < calls.size(); c++) {
+				BasicBlock* callBB = split_bbs[2*c];
+				BasicBlock* nextStart = split_bbs[2*c + 1];
+				callBB->setName(x + "_callBB");
 				blacklisted_bbs.insert(callBB);
-				BasicBlock::iterator next2 = callBB->begin();
-				next2++;
-				BasicBlock* nextStart = callBB->splitBasicBlock(next2, x + "_nextCallBB");
+				nextStart->setName(x + "_nextCallBB");
 				call_next_bbs.insert(nextStart);
-				bool is_ok = false;
-				for(Function::iterator itr = F.begin(); itr!=F.end(); itr++) {
-					if((&(*itr)) == nextStart) {
-						startFrom = itr;
-						is_ok = true;
-					}
-				}
-				assert(is_ok);
-			} else break;
+			}
 		}
 	}
 }
 #endif
+// Names of the BBs of one function, before they are made unique in the module
+typedef std::pair<Function*, std::vector<std::string> > FunctionBBNames;
+
+static void nameBasicBlocksJob(void* arg, unsigned i) {
+	FunctionBBNames& names = ((FunctionBBNames*)arg)[i];
+	Function& F = *names.first;
+	std::string fname = F.getName().str();
+	unsigned fnbbcnt = 0; // fnbbcnt reads "function BB count".
+	for(Function::iterator it2 = F.begin(); it2 != F.end(); it2++) {
+		BasicBlock* pBB = &(*it2);
+		if(pBB->getName().size() > 0) {
+			names.second.push_back(pBB->getName().str());
+		} else {
+			names.second.push_back(fname + "_" + utostr(fnbbcnt));
+		}
+		fnbbcnt++;
+	}
+}
+
 void addBBEntryCalls(Module& M) {
 	const unsigned LEN = 1024;
 	char tmp[LEN]; // Function name may be very long, resulting in stack smashing
 	unsigned len = 0;
-	std::set<std::string> used_names;
+	std::vector<FunctionBBNames> names;
 	Module::FunctionListType &fnList = M.getFunctionList();
-	for(Module::iterator it = fnList.begin(); it != fnList.end(); it++) {
-		Function& F = *it;
-		Function::iterator it2 = F.begin();
-		unsigned fnbbcnt = 0; // fnbbcnt reads "function BB count".
-		for(; it2 != F.end(); it2++) {
+	for(Module::iterator it = fnList.begin(); it != fnList.end(); it++)
+		names.push_back(FunctionBBNames(&(*it), std::vector<std::string>()));
+	if(names.empty()) return;
+	parallelFor(names.size(), nameBasicBlocksJob, &names[0]);
+
+	// Make them unique, in module order
+	std::set<std::string> used_names;
+	for(unsigned i = 0; i < names.size(); i++) {
+		Function::iterator it2 = names[i].first->begin();
+		for(unsigned j = 0; j < names[i].second.size(); j++, it2++) {
 			BasicBlock* pBB = &(*it2);
-			std::string bbname, bbname1;
-			if(pBB->getName().size() > 0) {
-				bbname = pBB->getName();
-			} else {
-				len = strlen(F.getName().data());
-				assert(len <= LEN); 
-				sprintf(tmp, "%s_%u", F.getName().data(), fnbbcnt);
-				bbname = tmp;
-			}
+			std::string bbname = names[i].second[j], bbname1;
 			unsigned retry_cnt = 0;
 			bbname1 = bbname;
 			while(used_names.find(bbname) != used_names.end()) {
@@ -612,7 +1554,6 @@ void addBBEntryCalls(Module& M) {
 			}
 			used_names.insert(bbname);
 			bb_names[pBB] = bbname;
-			fnbbcnt++;
 		}
 	}
 }
@@ -636,11 +1577,10 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 
 	/*Locate the instruction I in the basic block BB*/  
 	Value *inst = &(*I);    
-	if(corrupted_ptrs.find(I) != corrupted_ptrs.end()) return false;
+	if(corrupted_ptrs.count(I)) return false;
 	
 	BasicBlock *BB = I->getParent();   
-	BasicBlock::iterator BI, BINext;
-	for(BI=BB->begin(); BI!=BB->end(); BI++) { if(BI == *I) break; }
+	BasicBlock::iterator BI(I), BINext;
 
 	/*Build argument list before calling Corrupt function*/
 	CallInst* CallI=NULL;
@@ -687,6 +1627,9 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 			CallI = CallInst::Create(func_corruptFloatData_64bit,args,"call_corruptFloatData_64bit",I);
 			assert(CallI);
 			CallI->setCallingConv(CallingConv::C);
+		} /*Vector Data*/
+		else if(tstOp->getOperand(0)->getType()->isVectorTy()){
+			CallI = createVectorCorruptCall(args, I);
 		}
 
 		if(CallI) {
@@ -709,7 +1652,7 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 					//    have already been corrupted.
 //					inst->dump();
 //					errs() << corrupted_ptrs.size() << " etys\n";
-					if(corrupted_ptrs.find(I) != corrupted_ptrs.end()) return false;
+					if(corrupted_ptrs.count(I)) return false;
 //					errs() << "args has " << args.size() << "etys\n";
 					args.pop_back();
 					Value* corruptedPtr = CorruptPointer(inst, I, BB, args);
@@ -732,7 +1675,7 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 	/*Choose a fault site in CmpInst and insert Corrupt function call*/
 	if(CmpInst* cmpOp = dyn_cast<CmpInst>(inst))
 	{
-		unsigned int opPos=rand()%2;
+		unsigned int opPos=(getFaultSite(fault_index).key >> 16) & 1;
 		User* tcmpOp = &*cmpOp;
 		args.push_back(tcmpOp->getOperand(opPos));
 		CallI = NULL;
@@ -767,7 +1710,7 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 			BI->setOperand(opPos, cast1);
 			return true;
 		} else { // OKay, it's a pointer....
-			// Convert to 64-bit integer, corrupt it, then convert back
+			// Offset it by the fault site's delta (an i8 GEP, not a ptrtoint round trip)
 			
 #ifndef IGNORE_20130723_CHANGES
 			BINext = BI; BINext++;
@@ -779,56 +1722,45 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 				prevBB = cmpOp->getParent();
 
 				// prevBB
-				BasicBlock::iterator split_at_inj, split_at_next, itr;
-				for(itr = prevBB->begin(); itr!=prevBB->end(); itr++)
-					if((&*itr) == cmpOp) break;
-				split_at_inj = itr;
-				assert(split_at_inj  != prevBB->end());
+				BasicBlock::iterator split_at_inj(cmpOp), split_at_next;
 				injBB = prevBB->splitBasicBlock(split_at_inj);
 
 				Instruction* inj_insert_here = &(injBB->front());
 
 				// injBB
-				Value* i_addr = new PtrToIntInst(
-					tcmpOp->getOperand(opPos),
-					IntegerType::getInt64Ty(getGlobalContext()),
-						tcmpOp->getOperand(opPos)->getName(),
-					//I 
-					inj_insert_here
+				// The offset of the corrupted pointer from the original one; the
+				//   pointer itself is an i8 GEP of the original (see CorruptPointer)
+				Type* i8ptr = Type::getInt8PtrTy(getGlobalContext());
+				Value* byte_ptr = new BitCastInst(tcmpOp->getOperand(opPos), i8ptr,
+					tcmpOp->getOperand(opPos)->getName(),
+					prevBB->getTerminator()
 				);
-				if(!i_addr) { assert(0 && "Cannot PtrToInt inst. This should not happen!"); }
 				args.pop_back();
-				args.push_back(i_addr);
-				CallI = CallInst::Create(func_corruptIntData_64bit,
+				args.push_back(byte_ptr);
+				CallI = CallInst::Create(func_corruptPtrDelta,
 					args,
 					tcmpOp->getOperand(opPos)->getName(),
 					//I
 					inj_insert_here
 				);
-				Value* corrupted_ptr = new IntToPtrInst(
-					CallI,
-					the_op_type,
-					tcmpOp->getOperand(opPos)->getName(),
-					//I
-					inj_insert_here
-				);
 
 				// nextBB
-				split_at_next = injBB->begin();
-				while(true) {
-					if((&*split_at_next) == inj_insert_here) break;
-					split_at_next++;
-				}
+				split_at_next = inj_insert_here;
 				nextBB = injBB->splitBasicBlock(split_at_next);
-				corruptValPhi = PHINode::Create(the_op_type, 0, "BBBB",
+				corruptValPhi = PHINode::Create(CallI->getType(), 0, "BBBB",
 					&(nextBB->front()));
-				corruptValPhi->addIncoming(tcmpOp->getOperand(opPos), prevBB);
-				corruptValPhi->addIncoming(corrupted_ptr, injBB);
+				corruptValPhi->addIncoming(ConstantInt::get(CallI->getType(), 0), prevBB);
+				corruptValPhi->addIncoming(CallI, injBB);
+				Instruction* gep = GetElementPtrInst::Create(byte_ptr, corruptValPhi,
+					"", cmpOp);
+				Instruction* corrupted_ptr = new BitCastInst(gep, the_op_type,
+					tcmpOp->getOperand(opPos)->getName(), cmpOp);
 
 				// prevBB's terminator (do this after {next|inj}BB are ready.)
 				TerminatorInst* prevBBT_old = prevBB->getTerminator();
 				prevBBT_old->eraseFromParent();
-				Value* pred = (Value*)(bb_to_pred.at(prevBB));
+				Value* pred = bb_to_pred.lookup(prevBB);
+				assert(pred);
 				BranchInst::Create(injBB, nextBB, pred, prevBB);
 				bb_to_pred[nextBB] = pred;
 				blacklisted_bbs.insert(injBB);
@@ -837,10 +1769,12 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 				// Blacklist them (do not corrupt them once more in ptr corruption)
 				corrupted_ptrs.insert(CallI);
 				corrupted_ptrs.insert((Instruction*)(tcmpOp->getOperand(opPos)));
-				corrupted_ptrs.insert((Instruction*)(corrupted_ptr));
+				corrupted_ptrs.insert((Instruction*)(byte_ptr));
+				corrupted_ptrs.insert(gep);
+				corrupted_ptrs.insert(corrupted_ptr);
 				corrupted_ptrs.insert(corruptValPhi);
 
-				cmpOp->setOperand(opPos, corruptValPhi);
+				cmpOp->setOperand(opPos, corrupted_ptr);
 				return true;
 			}
 #else
@@ -893,6 +1827,8 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 				CallI = CallInst::Create(func_corruptFloatData_80bit,args,"call_corruptfloatData_80bit",I);
 				assert(CallI);
 				CallI->setCallingConv(CallingConv::C);
+			} else if(tcmpOp->getOperand(opPos)->getType()->isVectorTy()) {
+				CallI = createVectorCorruptCall(args, I);
 			}
 		}
 		if(CallI) {
@@ -1011,6 +1947,9 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 				CallI = CallInst::Create(func_corruptFloatData_64bit, args, "call_corruptFloatData_64bit", INext);
 				assert(CallI);
 				CallI->setCallingConv(CallingConv::C);
+			} /*Vector Data*/
+			else if(inst->getType()->isVectorTy()){
+				CallI = createVectorCorruptCall(args, INext);
 			}
 		}
 		if(CallI) {
@@ -1033,29 +1972,14 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 #else
 			// Fix on 20130725
 			// After this change, use of inst may be across >1 BB's
+			// corruptVal is right after inst, so it dominates every use of inst
+			//   but its own: they are replaced through the use list of inst.
 			if(isa<CallInst>(inst)) {
-				Function* F = BB->getParent();
-				Function::iterator FI = F->begin();
-				while(FI != F->end()) {
-					if((&(*FI)) == BB) break;
-					FI++; // FI should point to BI's BB
-				}
-
-				BasicBlock::iterator BI2 = BI;
-				BI2++;
-				BI2++;
-				
-				while(true) {
-					while(BI2 != BB->end()) {
-						Instruction* valu = &(*BI2);
-						valu->replaceUsesOfWith(inst, corruptVal);
-						BI2++;
-					}
-					FI++;
-					if(FI == F->end()) break;
-					BB = &(*FI);
-					BI2 = BB->begin();
+				std::vector<Use*> uses; // Setting a use unlinks it from the use list
+				for(Value::use_iterator ui = inst->use_begin(); ui != inst->use_end(); ui++) {
+					if(*ui != corruptVal) uses.push_back(&ui.getUse());
 				}
+				for(unsigned i = 0; i < uses.size(); i++) uses[i]->set(corruptVal);
 			} else {
 				wrapCorruptInstWithBranch(corruptVal, inst);
 			}
@@ -1065,7 +1989,7 @@ bool InjectError_DataReg_Dyn(Instruction *I, int fault_index)
 			return false;
 			/*
 			if(inst->getType()->isPointerTy() && ptr_err==1) {
-				if(corrupted_ptrs.find(I) != corrupted_ptrs.end()) return false;
+				if(corrupted_ptrs.count(I)) return false;
 
 				args.pop_back();
 				// How about casting to a 64 bit, corrupt, and converting back?
@@ -1122,14 +2046,9 @@ bool InjectError_PtrError_Dyn(Instruction *I, int fault_index)
 
 	/*Locate the instruction I in the basic block BB*/  
 	Value *inst = &(*I);
-	if(corrupted_ptrs.find(I) != corrupted_ptrs.end()) return false;
+	if(corrupted_ptrs.count(I)) return false;
 	BasicBlock *BB = I->getParent();   
-	BasicBlock::iterator BI;
-	for(BI=BB->begin();BI!=BB->end();BI++) {
-		if (BI == *I) break;
-	}
-	// if not found then return false.
-	if(BI==BB->end()) return false;
+	BasicBlock::iterator BI(I);
 
 	/*Choose the pointer operand in StoreInst and insert Corrupt function call*/
 	if(StoreInst* stOp = dyn_cast<StoreInst>(inst)) 
@@ -1313,10 +2232,400 @@ bool InjectError_PtrError_Dyn(Instruction *I, int fault_index)
 	}/*end if*/   
 	return false;
 }/*end InjectError_PtrError*/
+
+// -cb: can a value of type <ty> be an argument or return value fault site?
+static bool isCallBoundaryType(Type* ty) {
+	if(ty->isPointerTy()) return ptr_err;
+	if(!data_err) return false;
+	Type* elTy = ty->getScalarType();
+	return elTy->isIntegerTy(8) || elTy->isIntegerTy(16) || elTy->isIntegerTy(32) ||
+		elTy->isIntegerTy(64) || elTy->isFloatTy() || elTy->isDoubleTy();
+}
+
+// -cb: is <v> an argument or return value fault site? (Arguments without uses are not)
+static bool isCallBoundarySite(Argument* arg) {
+	return !arg->use_empty() && isCallBoundaryType(arg->getType());
+}
+static bool isCallBoundarySite(ReturnInst* ret) {
+	return ret && ret->getReturnValue() && isCallBoundaryType(ret->getReturnValue()->getType());
+}
+
+// -cb: the number of fault site IDs instrumentCallBoundaries gives <F>
+static unsigned countCallBoundarySites(Function* F) {
+	unsigned n = 0;
+	for(Function::arg_iterator ai = F->arg_begin(); ai != F->arg_end(); ai++)
+		if(isCallBoundarySite(ai)) n++;
+	for(Function::iterator fi = F->begin(); fi != F->end(); fi++)
+		if(isCallBoundarySite(dyn_cast<ReturnInst>(fi->getTerminator()))) n++;
+	return n;
+}
+
+// -cb: inserts the fault site of <v> before <pos>, whose BB has a predicate, and
+//   returns the value to use instead of <v>. Pointers are corrupted like the
+//   pointer fault sites, through an i8 GEP (see CorruptPointer).
+static Value* insertCallBoundarySite(Value* v, Instruction* pos, int fault_index) {
+	LLVMContext& C = getGlobalContext();
+	Type* i32 = Type::getInt32Ty(C);
+	std::vector<Value*> args;
+	args.push_back(ConstantInt::get(i32, fault_index));
+	args.push_back(ConstantInt::get(i32, ijo));
+	args.push_back(ConstantInt::get(i32, print_fs ? 0 : (int)ef));
+	args.push_back(ConstantInt::get(i32, tf));
+	args.push_back(ConstantInt::get(i32, byte_val));
+
+	Type* ty = v->getType();
+	IRBuilder<> irb(pos);
+	if(ty->isPointerTy()) {
+		Value* bytePtr = irb.CreateBitCast(v, Type::getInt8PtrTy(C));
+		args.push_back(bytePtr);
+		CallInst* delta = irb.CreateCall(func_corruptPtrDelta, args, "call_corruptPtrDelta");
+		PHINode* deltaPhi = createBranchForCorruptInst(delta,
+			ConstantInt::get(Type::getInt64Ty(C), 0));
+		irb.SetInsertPoint(pos);
+		return irb.CreateBitCast(irb.CreateGEP(bytePtr, deltaPhi), ty);
+	}
+
+	args.push_back(v);
+	CallInst* CallI = NULL;
+	if(ty->isVectorTy()) {
+		CallI = createVectorCorruptCall(args, pos);
+	} else {
+		Value* fn = NULL;
+		if(ty->isIntegerTy(8))       fn = func_corruptIntData_8bit;
+		else if(ty->isIntegerTy(16)) fn = func_corruptIntData_16bit;
+		else if(ty->isIntegerTy(32)) fn = func_corruptIntData_32bit;
+		else if(ty->isIntegerTy(64)) fn = func_corruptIntData_64bit;
+		else if(ty->isFloatTy())     fn = func_corruptFloatData_32bit;
+		else if(ty->isDoubleTy())    fn = func_corruptFloatData_64bit;
+		CallI = CallInst::Create(fn, args, "call_corruptArgRet", pos);
+		CallI->setCallingConv(CallingConv::C);
+	}
+	assert(CallI);
+	return createBranchForCorruptInst(CallI, v);
+}
+
+// -cb: fault sites on the arguments of <F> at its entry (after the allocas, which
+//   stay in the entry block) and on the value of each ReturnInst. The entry BB
+//   counts the argument sites once per call, the BB of a return its site once per
+//   return; the other BBs have none (see appendInstCountCalls).
+static void instrumentCallBoundaries(Function* F, FunctionStats* stats) {
+	unsigned func_hash = hashString(F->getName().str());
+	BasicBlock* entry = &(F->getEntryBlock());
+
+	// Where the BBs are before the entry is split
+	std::vector<std::pair<ReturnInst*, unsigned> > rets; // (return, BB ordinal)
+	unsigned bbi = 0;
+	for(Function::iterator fi = F->begin(); fi != F->end(); fi++, bbi++) {
+		ReturnInst* ret = dyn_cast<ReturnInst>(fi->getTerminator());
+		if(isCallBoundarySite(ret)) rets.push_back(std::make_pair(ret, bbi));
+	}
+	std::vector<Argument*> fargs;
+	for(Function::arg_iterator ai = F->arg_begin(); ai != F->arg_end(); ai++) {
+		if(isCallBoundarySite(ai)) fargs.push_back(ai);
+	}
+	if(fargs.empty() && rets.empty()) return;
+
+	BasicBlock::iterator first = entry->begin();
+	while(isa<AllocaInst>(first)) first++;
+	Instruction* pos = first;
+	if(!fargs.empty() || (!rets.empty() && rets[0].second == 0)) {
+		CallInst* pred = CallInst::Create(func_isNextFaultInThisBB, std::vector<Value*>(),
+			"isNextFaultInThisBB", pos);
+		pred->setDoesNotThrow();
+		pred->setOnlyReadsMemory();
+		bb_to_pred[entry] = pred;
+	}
+
+	for(unsigned i = 0; i < fargs.size(); i++) {
+		Argument* arg = fargs[i];
+		std::vector<Use*> uses;
+		for(Value::use_iterator ui = arg->use_begin(); ui != arg->use_end(); ui++)
+			uses.push_back(&ui.getUse());
+		g_fault_index++;
+		FaultSiteRecord& fs = getFaultSite(g_fault_index);
+		fs.bb = entry;
+		fs.key = getSiteKey(func_hash, ~0u, arg->getArgNo(), // Not an instruction ordinal
+			arg->getType()->isPointerTy() ? DYN_FAULT_PTR : DYN_FAULT_DATA);
+		fs.type = arg->getType()->isPointerTy() ? DYN_FAULT_PTR : DYN_FAULT_DATA;
+		fs.line = pos->getDebugLoc().getLine();
+		fs.logged = true;
+		Value* corrupted = insertCallBoundarySite(arg, pos, g_fault_index);
+		for(unsigned u = 0; u < uses.size(); u++) uses[u]->set(corrupted);
+		fs.injected = true;
+		bb_fs_counts[entry]++;
+		if(stats) { stats->candidates++; stats->sites++; }
+	}
+
+	for(unsigned i = 0; i < rets.size(); i++) {
+		ReturnInst* ret = rets[i].first;
+		BasicBlock* bb = ret->getParent();
+		BasicBlock* orig_bb = (rets[i].second == 0) ? entry : bb;
+		if(orig_bb != entry) {
+			CallInst* pred = CallInst::Create(func_isNextFaultInThisBB, std::vector<Value*>(),
+				"isNextFaultInThisBB", getFirstNonPHINonLandingPad(bb));
+			pred->setDoesNotThrow();
+			pred->setOnlyReadsMemory();
+			bb_to_pred[bb] = pred;
+		}
+		g_fault_index++;
+		logFaultSiteInfo(ret, g_fault_index, ret->getReturnValue()->getType()->isPointerTy() ?
+			DYN_FAULT_PTR : DYN_FAULT_DATA);
+		FaultSiteRecord& fs = getFaultSite(g_fault_index);
+		fs.bb = orig_bb;
+		fs.key = getSiteKey(func_hash, rets[i].second, curr_graph->node_ids.lookup(ret), fs.type);
+		ret->setOperand(0, insertCallBoundarySite(ret->getReturnValue(), ret, g_fault_index));
+		fs.injected = true;
+		bb_fs_counts[orig_bb]++;
+		if(stats) { stats->candidates++; stats->sites++; }
+	}
+}
 /******************************************************************************************************************************/
 
-// Use-def chain graph information
-void recordUseDefChain(Module& M);
+// Analysis results of one function. analyzeFunction() only reads the IR, so
+//   it runs on worker threads (see parallelFor); instrumentFunction() is serial.
+struct FunctionAnalysis {
+	Function* F;
+	bool is_in_whitelist;
+	// Fault site candidates (in program order; every BB has an entry, possibly empty)
+	std::vector<std::pair<BasicBlock*, std::vector<Instruction*> > > ilist;
+	UseDefGraph graph; // Use-def graph of the function before it is instrumented
+};
+
+static bool isFaultSiteCandidate(Value* in) {
+	if(call_boundary) return false; // See instrumentCallBoundaries
+	if(data_err) {
+		if(isa<BinaryOperator>(in) || 
+			isa<CmpInst>(in)       ||
+			isa<StoreInst>(in)     ||
+			isa<LoadInst>(in))
+		{
+			return true;
+		}
+	}
+	if(ptr_err) {
+		if(isa<StoreInst>(in) || 
+		isa<LoadInst>(in)  ||
+		isa<CallInst>(in)  ||
+		isa<AllocaInst>(in)) 
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static void analyzeFunction(FunctionAnalysis& fa) {
+	if(!fa.is_in_whitelist) {
+		for(Function::iterator fi = fa.F->begin(); fi != fa.F->end(); fi++)
+			fa.ilist.push_back(std::make_pair(&(*fi), std::vector<Instruction*>()));
+		return;
+	}
+	recordUseDefChain(*fa.F, fa.graph);
+
+	/*Cache instruction references with in a function to be considered for fault injection*/             
+	for(Function::iterator fi = fa.F->begin(); fi != fa.F->end(); fi++) {
+		BasicBlock& BB = *fi;
+		fa.ilist.push_back(std::make_pair(&BB, std::vector<Instruction*>()));
+		std::vector<Instruction*>& sites = fa.ilist.back().second;
+		for(BasicBlock::iterator bi = BB.begin(); bi!=BB.end(); bi++) {
+			Instruction* I = &(*bi);
+			if(isFaultSiteCandidate(I)) sites.push_back(I);
+		}
+	}
+}
+
+static void analyzeFunctionJob(void* arg, unsigned i) {
+	analyzeFunction(((FunctionAnalysis*)arg)[i]);
+}
+
+static void instrumentFunction(FunctionAnalysis& fa) {
+	std::vector<std::pair<BasicBlock*, std::vector<Instruction*> > >& ilist = fa.ilist;
+	// Graph nodes are numbered in module order
+	fa.graph.first_node = num_nodes;
+	num_nodes += fa.graph.node_ids.size();
+	curr_graph = fa.is_in_whitelist ? &fa.graph : NULL;
+	FunctionStats* stats = getFunctionStats(fa.F);
+	double t = beginPhase();
+
+	// declare an i1 @ beginning of BB
+#ifndef IGNORE_20130723_CHANGES
+	for(unsigned bbi = 0; bbi < ilist.size(); bbi++) {
+		if(ilist[bbi].second.empty()) continue;
+		BasicBlock* pBB = ilist[bbi].first;
+		Instruction* first = getFirstNonPHINonLandingPad(pBB);
+		std::vector<Value*> args;
+		CallInst* pred = CallInst::Create(func_isNextFaultInThisBB,
+			args, "isNextFaultInThisBB", first);
+		pred->setDoesNotThrow();
+		pred->setOnlyReadsMemory();
+		bb_to_pred[pBB] = pred;
+	}
+#endif
+
+	// Change on 20130723: Using predicate; may save C.P.U. time
+	// Adverse side effect #1: will break a BasicBlock::iterator
+	// luckily, we're not using a BasicBlock::iterator. 
+	unsigned func_hash = hashString(fa.F->getName().str());
+	for(unsigned bbi = 0; bbi < ilist.size(); bbi++) {
+		BasicBlock* pBB = ilist[bbi].first;
+		const std::vector<Instruction*>& theSet = ilist[bbi].second;
+		unsigned bb_fs_count = 0;
+		// The IDs are in program order, but the sites are inserted from the last one
+		//   up: each site splits the BB, which then only moves the instructions up
+		//   to the next site instead of the whole rest of the BB
+		int sites_per_inst = (ptr_err ? 1 : 0) + (data_err ? 1 : 0);
+		int first_index = g_fault_index;
+		g_fault_index += sites_per_inst * theSet.size();
+		for(int ii = (int)theSet.size() - 1; ii >= 0; ii--) {
+			Instruction* inst = theSet[ii];
+			int fault_index = first_index + sites_per_inst * ii;
+			// Ordinal of the instruction in the function, before instrumentation
+			unsigned ordinal = curr_graph->node_ids.lookup(inst);
+			if(ptr_err) {
+				fault_index++;
+				getFaultSite(fault_index).bb = pBB;
+				getFaultSite(fault_index).key = getSiteKey(func_hash, bbi, ordinal, DYN_FAULT_PTR);
+				if(InjectError_PtrError_Dyn(inst, fault_index)) {
+					getFaultSite(fault_index).injected = true;
+					bb_fs_count++;
+				}
+				if(stats) stats->candidates++;
+			}
+			if(data_err) {
+				fault_index++;
+				getFaultSite(fault_index).bb = pBB;
+				getFaultSite(fault_index).key = getSiteKey(func_hash, bbi, ordinal, DYN_FAULT_DATA);
+				if(InjectError_DataReg_Dyn(inst, fault_index)) {
+					getFaultSite(fault_index).injected = true;
+					bb_fs_count++;
+				}
+				if(stats) stats->candidates++;
+			}               
+		}
+		bb_fs_counts[pBB] = bb_fs_count;
+		if(stats) stats->sites += bb_fs_count;
+	}
+	if(call_boundary && fa.is_in_whitelist) instrumentCallBoundaries(fa.F, stats);
+	endPhase("instrumentation", t);
+
+	// Done with this function's graph
+	t = beginPhase();
+	if(curr_graph) writeUseDefGraph(*curr_graph);
+	curr_graph = NULL;
+	endPhase("graph", t);
+}
+
+// Everything runOnModule does before the target functions are analyzed and
+//   instrumented: call splitting, BB names, runtime declarations, -pfs calls.
+static void prepareModule(Module& M) {
+	pass_start = getWallTime();
+	g_irbuilder = new IRBuilder<true, ConstantFolder, IRBuilderDefaultInserter<true> >(getGlobalContext());
+	double t = beginPhase();
+	readFunctionInjWhitelist();
+	endPhase("whitelist", t);
+	errs() << "Fault injection white list read\n";
+	recordFunctionStats(M);
+	t = beginPhase();
+	splitBBOnCallInsts(M);
+	endPhase("call_splitting", t);
+	errs() << "BBs split on CallInsts\n";
+	t = beginPhase();
+	addBBEntryCalls(M);
+	endPhase("bb_naming", t);
+	
+	srand(seed);
+	if(byte_val < 0 || byte_val > 7) 
+	byte_val = rand()%8;				 
+	/*Check for assertion violation(s)*/
+	assert(byte_val<=7 && byte_val>=0);
+	assert(ef>=0 && tf>=1 && ef<=tf);
+	assert(ijo==1 || ijo==0);
+	assert(print_fs==1 || print_fs==0);
+	assert(ptr_err==1 || ptr_err==0);
+	assert(data_err==1 || data_err==0);                
+	StringRef lstr;
+	Module::FunctionListType &functionList = M.getFunctionList();
+
+	/*Declare the runtime's entry points. Also insert print_faultStatistics() 
+	 * at the end of each function in case -pfs flag is set from the command line*/
+	declareRuntimeFunctions(M);
+	func_main = M.getFunction("main");
+	unsigned int j=0;
+	for (Module::iterator it = functionList.begin(); it != functionList.end(); ++it,j++) {
+		lstr = it->getName();
+		cstr = lstr.str();                                        
+		if(it->isDeclaration()) continue;
+		if(!isFunctionNameBlacklisted(cstr.c_str())) {
+			if(print_fs) {
+				assert(func_print_faultStatistics);
+				Function *Fmain = it;	
+				inst_iterator Imain,INmain,Emain;
+				Imain=inst_begin(Fmain);
+				INmain=Imain;
+				INmain++;
+				for(Emain=inst_end(Fmain);INmain!=Emain;Imain++,INmain++);
+				Value *inst = &(*Imain);
+				std::vector<Value*> args;
+				args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()),ijo));
+				args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()),ef));
+				args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()),tf));
+				args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()),byte_val));
+				if(isa<ReturnInst>(inst)) {
+					Instruction* Im = &(*Imain);
+					CallInst* CallI = CallInst::Create(func_print_faultStatistics,args,"call_print_faultStatistics",Im);
+					CallI->setCallingConv(CallingConv::C);
+				} else {
+					 Instruction* Im = &(*Imain);
+					 BasicBlock *BBm = Im->getParent();
+					 CallInst* CallI = CallInst::Create(func_print_faultStatistics,args,"call_print_faultStatistics",BBm);
+					 CallI->setCallingConv(CallingConv::C);
+				}
+			}
+			continue;                           
+		}          
+	}/*end for*/
+}
+
+static void collectTargets(Module& M, std::vector<Function*>& targets, std::vector<bool>& whitelisted) {
+	/* Cache instructions from all the targetable functions for fault injection in case func list is not
+	 * defined by the use. If func list if defined by the use then cache only function defined by the user*/         
+	StringRef lstr;
+	Module::FunctionListType &functionList = M.getFunctionList();
+	std::vector<std::string> flist = splitAtSpace(func_list);
+	for (Module::iterator it = functionList.begin(); it != functionList.end(); ++it){ 
+		lstr = it->getName();
+		cstr = lstr.str();   	 	            
+		if(isFunctionNameBlacklisted(cstr.c_str()))
+			continue;
+		Function *F=NULL;
+		bool is_in_whitelist = true;
+		/*if the user defined function list is empty or the currently selected function is in the list of
+		 * user defined function list then consider the function for fault injection*/
+		if(!func_list.compare("") || std::find(flist.begin(), flist.end(), cstr)!=flist.end()) {
+			F = it;
+			if(!shouldInjectFunction(F)) is_in_whitelist = false;
+		} else {
+			continue;
+		}
+		if(F->begin()==F->end())
+			continue;
+		targets.push_back(F);
+		whitelisted.push_back(is_in_whitelist);
+	}
+}
+
+static void insertCampaignInit(Function* mainF) {
+	BasicBlock* b = mainF->begin();
+	Instruction* first = b->begin();
+	
+	std::vector<Value*> args;
+	args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), ef));
+	args.push_back(ConstantInt::get( IntegerType::getInt32Ty(getGlobalContext()), tf));
+
+	CallInst* call_init = CallInst::Create(func_initFaultInjectionCampaign,
+		args, "", first);
+	assert(call_init);
+}
 
 /*Dynamic Fault Injection LLVM Pass*/
 namespace {
@@ -1326,453 +2635,359 @@ public:
 	static char ID; 
 	dynfault() : ModulePass(ID) {}
 	virtual bool runOnModule(Module &M) {
-		g_irbuilder = new IRBuilder<true, ConstantFolder, IRBuilderDefaultInserter<true> >(getGlobalContext());
-		readFunctionInjWhitelist();
-		errs() << "Fault injection white list read\n";
-		recordUseDefChain(M);
-		errs() << "Def-use chain recorded\n";
-		splitBBOnCallInsts(M);
-		errs() << "BBs split on CallInsts\n";
-		addBBEntryCalls(M);
-		
-		srand(time(NULL));
-		if(byte_val < 0 || byte_val > 7) 
-		byte_val = rand()%8;				 
-		/*Check for assertion violation(s)*/
-		assert(byte_val<=7 && byte_val>=0);
-		assert(ef>=0 && tf>=1 && ef<=tf);
-		assert(ijo==1 || ijo==0);
-		assert(print_fs==1 || print_fs==0);
-		assert(ptr_err==1 || ptr_err==0);
-		assert(data_err==1 || data_err==0);                
-		StringRef lstr;
-		Module::FunctionListType &functionList = M.getFunctionList();
-		std::vector<std::string> flist = splitAtSpace(func_list);
-		std::vector<std::string>::iterator vecit;
-
-		/*Cache function references of the function defined in Corrupt.c/cpp. Also insert print_faultStatistics() 
-		 * at the end ofmain() in case -pfs flag is set from the command line*/
-		unsigned int j=0;
-		for (Module::iterator it = functionList.begin(); it != functionList.end(); ++it,j++) {
-			lstr = it->getName();
-			cstr = lstr.str();                                        
-			if (cstr.find("isNextFaultInThisBB") != std::string::npos) {
-				func_isNextFaultInThisBB = &*it; continue;
-			} if(cstr.find("print_faultStatistics")!=std::string::npos){
-				func_print_faultStatistics =&*it; continue;
-			} if(cstr.find("corruptIntData_16bit")!=std::string::npos) {
-				func_corruptIntData_16bit =&*it; continue;
-			} if(cstr.find("corruptIntData_32bit")!=std::string::npos) {
-				func_corruptIntData_32bit =&*it; continue;
-			} if(cstr.find("corruptIntData_64bit")!=std::string::npos) {
-				func_corruptIntData_64bit =&*it; continue;
-			} if(cstr.find("corruptIntData_8bit")!=std::string::npos) {
-				func_corruptIntData_8bit =&*it; continue;
-			} if(cstr.find("corruptFloatData_32bit")!=std::string::npos) {
-				func_corruptFloatData_32bit =&*it; continue;
-			} if(cstr.find("corruptFloatData_64bit")!=std::string::npos) {
-				func_corruptFloatData_64bit =&*it; continue;
-			} if(cstr.find("corruptFloatData_80bit")!=std::string::npos) {
-				func_corruptFloatData_80bit =&*it; continue;
-			} if(cstr.find("corruptIntAdr_32bit")!=std::string::npos) {
-				func_corruptIntAdr_32bit =&*it; continue;
-			} if(cstr.find("corruptIntAdr_64bit")!=std::string::npos) {
-				func_corruptIntAdr_64bit =&*it; continue;
-			} if(cstr.find("corruptFloatAdr_32bit")!=std::string::npos) {
-				func_corruptFloatAdr_32bit =&*it; continue;
-			} if(cstr.find("corruptFloatAdr_64bit")!=std::string::npos) {
-				func_corruptFloatAdr_64bit =&*it; continue;
-			} if(cstr.find("incrementFaultSiteCount")!=std::string::npos) {
-				func_incrementFaultSitesEnumerated =&*it; continue;                            
-			} if(cstr.find("__printInstCount")!=std::string::npos) {
-				func_printInstCount = &*it; continue;
-			} if(cstr.find("initializeFaultInjectionCampaign")!=std::string::npos) {
-				func_initFaultInjectionCampaign = &*it; continue;
-			} if(cstr == "main") {
-				func_main = &*it; continue;
-			} if(!isFunctionNameBlacklisted(cstr.c_str())) {
-				if(print_fs) {
-					assert(func_print_faultStatistics);
-					Function *Fmain = it;	
-					inst_iterator Imain,INmain,Emain;
-					Imain=inst_begin(Fmain);
-					INmain=Imain;
-					INmain++;
-					for(Emain=inst_end(Fmain);INmain!=Emain;Imain++,INmain++);
-					Value *inst = &(*Imain);
-					std::vector<Value*> args;
-					args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()),ijo));
-					args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()),ef));
-					args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()),tf));
-					args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()),byte_val));
-					if(isa<ReturnInst>(inst)) {
-						Instruction* Im = &(*Imain);
-						CallInst* CallI = CallInst::Create(func_print_faultStatistics,args,"call_print_faultStatistics",Im);
-						CallI->setCallingConv(CallingConv::C);
-					} else {
-						 Instruction* Im = &(*Imain);
-						 BasicBlock *BBm = Im->getParent();
-						 CallInst* CallI = CallInst::Create(func_print_faultStatistics,args,"call_print_faultStatistics",BBm);
-						 CallI->setCallingConv(CallingConv::C);
-					}
-				}
-				continue;                           
-			}          
-		}/*end for*/
-						
-		/* Cache instructions from all the targetable functions for fault injection in case func list is not
-		 * defined by the use. If func list if defined by the use then cache only function defined by the user*/         
-		for (Module::iterator it = functionList.begin(); it != functionList.end(); ++it,j++){ 
-			lstr = it->getName();
-			cstr = lstr.str();   	 	            
-			if(cstr.find("print_faultStatistics")!=std::string::npos  ||
-				cstr.find("corruptIntData_8bit")!=std::string::npos   ||
-				cstr.find("corruptIntData_16bit")!=std::string::npos   ||
-				cstr.find("corruptIntData_32bit")!=std::string::npos   ||
-				cstr.find("corruptIntData_64bit")!=std::string::npos   ||
-				cstr.find("corruptFloatData_32bit")!=std::string::npos ||
-				cstr.find("corruptFloatData_64bit")!=std::string::npos ||
-				cstr.find("corruptIntAdr_32bit")!=std::string::npos    ||
-				cstr.find("corruptIntAdr_64bit")!=std::string::npos    ||
-				cstr.find("corruptFloatAdr_32bit")!=std::string::npos  ||
-				cstr.find("corruptFloatAdr_64bit")!=std::string::npos  ||
-				isFunctionNameBlacklisted(cstr.c_str()) )
-				continue;
-			Function *F=NULL;
-			bool is_in_whitelist = true;
-			/*if the user defined function list is empty or the currently selected function is in the list of
-			 * user defined function list then consider the function for fault injection*/
-			if(!func_list.compare("") || std::find(flist.begin(), flist.end(), cstr)!=flist.end()) {
-				F = it;
-				if(!shouldInjectFunction(F)) is_in_whitelist = false;
-			} else {
-				continue;
-			}
-			if(F->begin()==F->end())
-				continue;
-
-			/*Cache instruction references with in a function to be considered for fault injection*/             
-			std::map<BasicBlock*, std::set<Instruction*> > ilist;
-			for(Function::iterator fi = F->begin(); fi!=F->end(); fi++) {
-				BasicBlock& BB = *fi;
-				BasicBlock* pBB = &BB;
-				ilist[pBB] = std::set<Instruction*>();
-				unsigned vuln = 0;
-				if(is_in_whitelist) {
-					for(BasicBlock::iterator bi = BB.begin(); bi!=BB.end(); bi++) {
-						unsigned vuln_delta = 0;
-						Instruction* I = &(*bi);
-						Value *in = &(*I);  
-						Instruction* p_in = &*I;
-						if(in == NULL) continue;
-						if(data_err) {
-							if(isa<BinaryOperator>(in) || 
-								isa<CmpInst>(in)       ||
-								isa<StoreInst>(in)     ||
-								isa<LoadInst>(in))
-							{
-								ilist[pBB].insert(p_in);
-								vuln_delta = 1;
-							}
-						}
-						if(ptr_err) {
-							if(isa<StoreInst>(in) || 
-							isa<LoadInst>(in)  ||
-							isa<CallInst>(in)  ||
-							isa<AllocaInst>(in)) 
-							{
-								ilist[pBB].insert(p_in);
-								vuln_delta = 1;
-							}
-						}
-						vuln += vuln_delta;
-					}
-
-					// declare an i1 @ beginning of BB
-#ifndef IGNORE_20130723_CHANGES
-					if(vuln > 0)				
-					{
-						Instruction* first = getFirstNonPHINonLandingPad(pBB);
-						std::vector<Value*> args;
-						CallInst* pred = CallInst::Create(func_isNextFaultInThisBB,
-							args, "isNextFaultInThisBB", first);
-						bb_to_pred[pBB] = pred;
-					}
-#endif
-				}
-			}
-			/*Check if instruction list is empty*/
-			if(ilist.empty())
-				continue;
-
-			// Change on 20130723: Using predicate; may save C.P.U. time
-			// Adverse side effect #1: will break a BasicBlock::iterator
-			// luckily, we're not using a BasicBlock::iterator. 
-			std::map<BasicBlock*, std::set<Instruction*> >::iterator itrBBI;
-			for(itrBBI = ilist.begin(); itrBBI != ilist.end(); itrBBI++) {
-				BasicBlock* pBB = itrBBI->first;
-				std::set<Instruction*> theSet = itrBBI->second;
-				unsigned bb_fs_count = 0;
-				for(std::set<Instruction*>::iterator itr = theSet.begin(); itr != theSet.end(); itr++) {
-					fprintf(stderr, "%d faults injected\r", g_fault_index);
-//					Instruction* inst = *(ilist.begin());
-					Instruction* inst = *itr;
-					if(ptr_err) {
-						g_fault_index++;
-						if(InjectError_PtrError_Dyn(inst, g_fault_index)) {
-							injected_fault_indices.insert(g_fault_index);
-							bb_fs_count++;
-						}
-					}
-					if(data_err) {
-						g_fault_index++;
-						if(InjectError_DataReg_Dyn(inst, g_fault_index)) {
-							injected_fault_indices.insert(g_fault_index);
-							bb_fs_count++;
-						}
-					}               
-				}
-				bb_fs_counts[pBB] = bb_fs_count;
+		if(M.getGlobalVariable("kulfi.module", true)) {
+			errs() << "[dynfault] The module is already instrumented.\n";
+			return false;
+		}
+		prepareModule(M);
+		std::vector<Function*> targets;
+		std::vector<bool> whitelisted;
+		collectTargets(M, targets, whitelisted);
+
+		// The analysis of a function does not change the IR, so the functions of a
+		//   window are analyzed in parallel; they are then instrumented one by one,
+		//   in module order, and their analysis results are freed.
+		unsigned window = 4 * getNumThreads();
+		for(unsigned w = 0; w < targets.size(); w += window) {
+			unsigned n = std::min(window, (unsigned)targets.size() - w);
+			std::vector<FunctionAnalysis> analyses(n);
+			for(unsigned i = 0; i < n; i++) {
+				analyses[i].F = targets[w + i];
+				analyses[i].is_in_whitelist = whitelisted[w + i];
 			}
+			double t = beginPhase();
+			parallelFor(n, analyzeFunctionJob, &analyses[0]);
+			endPhase("analysis", t); // Use-def chains and fault site candidates
+			for(unsigned i = 0; i < n; i++)
+				instrumentFunction(analyses[i]);
 		}
+		double t = beginPhase();
+		endUseDefGraph();
+		endPhase("graph", t);
+
+		errs() << "[dynfault] " << g_fault_index << " fault sites enumerated.\n";
 
 		/* Now I am going to split the BB's
 		 * So the counts should only be -approximate-
 		 * The # of fault sites is added at the beginning of a BB
 		 */
+		t = beginPhase();
 		appendInstCountCalls(M);
+		endPhase("count_insertion", t);
 		
 		// Insert call to initialize fault injection campaign if there's main()
 		//   when the injected program starts
-		if(func_main)
-		{
-			BasicBlock* b = ((Function*)(func_main))->begin();
-			Instruction* first = b->begin();
-			
-			std::vector<Value*> args;
-			args.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), ef));
-			args.push_back(ConstantInt::get( IntegerType::getInt32Ty(getGlobalContext()), tf));
+		if(func_main) insertCampaignInit((Function*)func_main);
 
-			CallInst* call_init = CallInst::Create(func_initFaultInjectionCampaign,
-				args, "", first);
-			assert(call_init);
-		}
+		t = beginPhase();
+		lowerFaultSites(M);
+		writeGlobalsTable(M);
+		writeManifest(M);
+		endPhase("lowering", t);
+		writeStats(M);
 
-		// Print out fault site statistics.
-		writeFaultSiteDOTGraph();
-
-		return false;
+		// prepareModule already splits BBs and adds the BB entry calls, so the module
+		//   is changed even without fault sites (-kulfi-ep needs to know)
+		return true;
 	}/*end function definition*/
 };/*end class definition*/
 }/*end namespace*/
 
 char dynfault::ID = 0;
 static RegisterPass<dynfault> F0("dynfault", "Dynamic Fault Injection emulating transient hardware error behavior");
-/******************************************************************************************************************************/
 
-/*Prints static fault injection statistics*/
-void printStat(unsigned int indexloc, bool inst_flag, bool func_flag) {
-	if(!func_flag)
-	{
-		errs()<<"#################################################"<< '\n';
-		errs()<<"Error: Couldn't select a valid function" << '\n';
-		errs()<<"#################################################"<< '\n';
-	} else {
-		if(inst_flag) {
-			errs()<<"#################################################"<< '\n';
-			errs()<<"Error injected in the function: "<< cstr <<'\n';
-			errs()<<"Error injected in the instruction at position " << indexloc <<'\n' ;
-			errs()<<"Number of instruction in the function: " << lstsize <<'\n' ;
-			errs()<<"Successfully inserted fault!!" << '\n';            
-			errs()<<"#################################################"<< '\n';
-		} else {
-			errs()<<"#################################################"<< '\n';
-			errs()<<"Error: Couldn't select a valid instruction" << '\n';
-			errs()<<"#################################################"<< '\n';
-		}
-	}
+// -kulfi-ep: the pass runs inside the pipeline clang builds for -O<n>
+//   (clang -O3 -Xclang -load -Xclang faults.so -mllvm -kulfi-ep=optimizer-last),
+//   so that the instrumented code is optimized like production code.
+static void addDynfaultAt(const char* point, PassManagerBase& PM) {
+	if(extension_point == point) PM.add(new dynfault());
+}
+static void addAtOptimizerLast(const PassManagerBuilder& Builder, PassManagerBase& PM) {
+	addDynfaultAt("optimizer-last", PM); // After all IR optimizations, vectorization included
 }
+static void addAtScalarOptimizerLate(const PassManagerBuilder& Builder, PassManagerBase& PM) {
+	addDynfaultAt("scalar-late", PM); // The passes after it optimize the instrumentation too
+}
+static void addAtLoopOptimizerEnd(const PassManagerBuilder& Builder, PassManagerBase& PM) {
+	addDynfaultAt("loop-end", PM);
+}
+static void addAtOptLevel0(const PassManagerBuilder& Builder, PassManagerBase& PM) {
+	addDynfaultAt("O0", PM);
+}
+static RegisterStandardPasses F2(PassManagerBuilder::EP_OptimizerLast, addAtOptimizerLast);
+static RegisterStandardPasses F3(PassManagerBuilder::EP_ScalarOptimizerLate, addAtScalarOptimizerLate);
+static RegisterStandardPasses F4(PassManagerBuilder::EP_LoopOptimizerEnd, addAtLoopOptimizerEnd);
+static RegisterStandardPasses F5(PassManagerBuilder::EP_EnabledOnOptLevel0, addAtOptLevel0);
+
+// Lazy instrumentation under the JIT (src/tools/kulfi-lli). The module is
+//   prepared as by runOnModule, but a target function is only analyzed,
+//   instrumented and lowered when the JIT materializes it, i.e. right before
+//   its first call is compiled. The fault site IDs of every target function
+//   are reserved up front, in module order, so they are the same as with
+//   opt -dynfault, and so are the keys.
+namespace {
+struct LazyTarget {
+	int site_base; // g_fault_index before the function's first site
+	bool is_in_whitelist;
+};
 
-/*Injects static fault(s) into data register*/
-bool InjectError_DataReg(Instruction *I) {
-	/*generate random probablity and check it against user defined probablity*/
-	int p=(rand()%tf)+1;
-	if(p>ef)        
+class LazyInstrumenter : public GVMaterializer {
+	DenseMap<const GlobalValue*, LazyTarget> pending;
+public:
+	unsigned num_targets, num_instrumented;
+
+	LazyInstrumenter() : num_targets(0), num_instrumented(0) {}
+	void addTarget(Function* F, int site_base, bool is_in_whitelist) {
+		LazyTarget lt;
+		lt.site_base = site_base;
+		lt.is_in_whitelist = is_in_whitelist;
+		pending[F] = lt;
+		num_targets++;
+	}
+	virtual bool isMaterializable(const GlobalValue* GV) const {
+		return pending.count(GV);
+	}
+	virtual bool isDematerializable(const GlobalValue* GV) const {
 		return false;
-	
-	/*Locate the instruction I in the basic block BB*/
-	BasicBlock *BB = I->getParent();   
-	BasicBlock::iterator BI;
-	for(BI=BB->begin();BI!=BB->end();BI++)    
-			if (BI == *I)
-	 break;   
-	Value *inst = &(*I);   
-	
-	unsigned int bPos=(8*byte_val)+rand()%8;
-	unsigned int opPos=rand()%2;
-	int mask = ~(0x1<<bPos);                                                    
-
-	/*Check if I is of type BinaryOperator and inject error if true*/
-	if(BinaryOperator *binOp = dyn_cast<BinaryOperator>(inst))
-	{ 						    
-		 Value *tVal=ConstantInt::get(binOp->getOperand(opPos)->getType(),mask);
-		 BinaryOperator *N = BinaryOperator::Create(Instruction::And, tVal, binOp->getOperand(opPos), inst->getName(), BI);
-		 BI->setOperand(opPos,N);	
-		 return true;
-	}/*end if*/
+	}
+	virtual bool Materialize(GlobalValue* GV, std::string* ErrInfo = 0);
+	virtual bool MaterializeModule(Module* M, std::string* ErrInfo = 0);
+};
+}
 
-	/*Check if I is of type CmpInst and inject error if true*/
-	if(CmpInst *cmpOp = dyn_cast<CmpInst>(inst))
-	{      
-		 User* tcmpOp = &*cmpOp;
-		 Value *tVal=ConstantInt::get(tcmpOp->getOperand(opPos)->getType(),mask);
-		 BinaryOperator *N = BinaryOperator::Create(Instruction::And, tVal, tcmpOp->getOperand(opPos), inst->getName(), BI);
-		 BI->setOperand(opPos,N);	
-		 return true;
-	}/*end if*/
+static LazyInstrumenter* lazy_instrumenter = NULL;
+
+bool LazyInstrumenter::Materialize(GlobalValue* GV, std::string* ErrInfo) {
+	DenseMap<const GlobalValue*, LazyTarget>::iterator it = pending.find(GV);
+	if(it == pending.end()) return false;
+	LazyTarget lt = it->second;
+	pending.erase(it);
+	Function* F = cast<Function>(GV);
+	Module& M = *F->getParent();
+
+	FunctionAnalysis fa;
+	fa.F = F;
+	fa.is_in_whitelist = lt.is_in_whitelist;
+	double t = beginPhase();
+	analyzeFunction(fa);
+	endPhase("analysis", t);
+	int num_site_ids = g_fault_index;
+	g_fault_index = lt.site_base;
+	instrumentFunction(fa);
+	g_fault_index = num_site_ids;
+
+	t = beginPhase();
+	appendInstCountCalls(*F);
+	endPhase("count_insertion", t);
+	if(F == func_main) insertCampaignInit(F);
+	t = beginPhase();
+	lowerFaultSiteCalls(M, "kulfi.sites." + F->getName().str());
+	endPhase("lowering", t);
+	num_instrumented++;
 	return false;
-}/*InjectError_DataReg*/
-
-
-/*Injects static fault(s) into pointer register*/
-bool InjectError_PtrError(Instruction *I)
-{
-	/*generate random probablity and check it against user defined probablity*/
-	int p=(rand()%tf)+1;
-	if(p>ef)        
-			return false;
-
-	/*Locate the instruction I in the basic block BB*/
-	BasicBlock *BB = I->getParent();   
-	BasicBlock::iterator BI;
-	for(BI=BB->begin();BI!=BB->end();BI++)    
-			if (BI == *I)
-	 break;
-	Value *inst = &(*I);  
-
-	unsigned int bPos=(8*byte_val)+rand()%8;
-	int mask = ~(0x1<<bPos);                     
-
-	/*Check if I is of type StoreInst and inject error if true*/
-	if(StoreInst *stInst = dyn_cast<StoreInst>(inst)) { 
-		Value *top = &(*(stInst->getPointerOperand())); 
-		
-		Value* iAddr = new PtrToIntInst(stInst->getPointerOperand(),
-			IntegerType::getInt64Ty(getGlobalContext()),
-			top->getName(),
-			stInst
-			);
-		if(!iAddr) assert(0 && "Create PtrToInt inst error. This should not happen!");
-
-		Value *tVal = ConstantInt::get(IntegerType::getInt64Ty(getGlobalContext()), mask);
- 
-		BinaryOperator *N = BinaryOperator::Create(Instruction::And,
-			tVal, iAddr, top->getName(), BI);
-
-		Value* corruptedAddr = new IntToPtrInst(N,
-			stInst->getPointerOperand()->getType(),
-			top->getName(),
-			stInst
-			);
-
-		BI->setOperand(1, corruptedAddr); /* 1? */
-		return true;
-	}/*end if*/
-
-	/*Check if I is of type LoadInst and inject error if true*/
-	if(LoadInst *ldInst = dyn_cast<LoadInst>(inst)) { 
-		// LLVM says we can't cast an int32* to an integer.
+}
 
-//    IntegerType* iTy = cast<IntegerType>(ldInst->getPointerOperand()->getType());
-		Value *top = &(*(ldInst->getPointerOperand()));
+bool LazyInstrumenter::MaterializeModule(Module* M, std::string* ErrInfo) {
+	while(!pending.empty()) {
+		if(Materialize(const_cast<GlobalValue*>(pending.begin()->first), ErrInfo))
+			return true;
+	}
+	return false;
+}
 
-		Value* iAddr = new PtrToIntInst(ldInst->getPointerOperand(),
-			IntegerType::getInt64Ty(getGlobalContext()),
-			top->getName(),
-			ldInst
-			);
-		if(!iAddr) assert(0 && "Create Ptr To Int Inst Error");
+// Prepares <M> and makes it instrument its target functions when they are
+//   materialized. The -dynfault options (-ef, -tf, -fn, ...) apply.
+extern "C" void kulfi_enable_lazy_instrumentation(Module* M) {
+	lazy_mode = true;
+	prepareModule(*M);
+	std::vector<Function*> targets;
+	std::vector<bool> whitelisted;
+	collectTargets(*M, targets, whitelisted);
+
+	// Same numbering as instrumentFunction(): one ID per kind of fault per candidate
+	lazy_instrumenter = new LazyInstrumenter();
+	unsigned ids_per_candidate = (ptr_err ? 1 : 0) + (data_err ? 1 : 0);
+	for(unsigned i = 0; i < targets.size(); i++) {
+		lazy_instrumenter->addTarget(targets[i], g_fault_index, whitelisted[i]);
+		if(!whitelisted[i]) continue;
+		if(call_boundary) {
+			g_fault_index += countCallBoundarySites(targets[i]);
+			continue;
+		}
+		for(inst_iterator I = inst_begin(targets[i]), E = inst_end(targets[i]); I != E; ++I) {
+			if(isFaultSiteCandidate(&*I)) g_fault_index += ids_per_candidate;
+		}
+	}
+	createModuleConfig(*M);
+	if(func_main && std::find(targets.begin(), targets.end(), func_main) == targets.end())
+		insertCampaignInit((Function*)func_main);
+	M->setMaterializer(lazy_instrumenter); // The module owns it
+	errs() << "[dynfault] " << g_fault_index << " fault site IDs reserved in "
+		<< targets.size() << " functions.\n";
+}
 
-//    Value *tVal=ConstantInt::get(ldInst->getPointerOperand()->getType(),mask);
-		Value *tVal = ConstantInt::get(IntegerType::getInt64Ty(getGlobalContext()), mask);
-			
-//    BinaryOperator *N = BinaryOperator::Create(Instruction::And, 
-//        tVal, ldInst->getPointerOperand(), top->getName(), BI);
-		BinaryOperator *N = BinaryOperator::Create(Instruction::And,
-				tVal, iAddr, top->getName(), BI);
+// Writes the -kulfi-graph and -kulfi-stats files of what has been instrumented
+extern "C" void kulfi_finish_lazy_instrumentation(Module* M) {
+	if(!lazy_instrumenter) return;
+	endUseDefGraph();
+	writeStats(*M);
+	errs() << "[dynfault] " << lazy_instrumenter->num_instrumented << " of "
+		<< lazy_instrumenter->num_targets << " functions instrumented.\n";
+	lazy_instrumenter = NULL;
+}
+/******************************************************************************************************************************/
 
-		Value* corruptedAddr = new IntToPtrInst(N,
-			ldInst->getPointerOperand()->getType(),
-			top->getName(),
-			ldInst
-			);
+/*Static Fault Injection: permanent faults (stuck-at-0, stuck-at-1, bit flip) of fault sites.
+ *Fault sites are numbered as by -dynfault with the same -fn, -de and -pe options (LocalID in
+ *kulfi_manifest.py): one ID for the pointer and one for the data fault of each candidate.
+ *
+ *With -sf-specs=<file>, one module holds all the variants listed in the file, one per line:
+ *  <fault site ID> <bit> <stuck0|stuck1|flip>
+ *Variant N is the Nth line (blank lines and lines starting with # do not count); it is
+ *selected at run time by the KULFI_VARIANT environment variable, copied into kulfi_variant
+ *by a constructor; 0 or unset runs the original program. Each site with a fault in some
+ *variant computes ((value & and_mask) | or_mask) ^ xor_mask; the constructor sets the masks
+ *of the selected variant, so the cost of a site does not depend on the number of variants.
+ *
+ *Without -sf-specs, one random site is chosen (-seed, -b, -ef/-tf as before) and stuck at 0.*/
+
+enum StaticFaultMode { SF_STUCK0, SF_STUCK1, SF_FLIP };
+struct StaticFaultSpec {
+	int site_id;
+	unsigned bit;
+	StaticFaultMode mode;
+	unsigned variant;
+};
 
-		BI->setOperand(0, corruptedAddr);
+// A static fault site: the value corrupted by its faults and its masks
+struct StaticFaultSite {
+	Instruction* inst;
+	FaultType type;
+	GlobalVariable *and_mask, *or_mask, *xor_mask;
+};
 
-		return true;
-	}/*end if*/
+static void readStaticFaultSpecs(std::vector<StaticFaultSpec>& specs) {
+	std::ifstream in(sf_specs.c_str());
+	if(!in) {
+		report_fatal_error("[staticfault] Cannot read " + sf_specs);
+	}
+	std::string line;
+	unsigned lineno = 0;
+	while(std::getline(in, line)) {
+		lineno++;
+		std::vector<std::string> fields = splitAtSpace(line);
+		if(fields.empty() || fields[0][0] == '#') continue;
+		StaticFaultSpec spec;
+		spec.site_id = atoi(fields[0].c_str());
+		spec.bit = fields.size() > 1 ? (unsigned)atoi(fields[1].c_str()) : 0;
+		std::string mode = fields.size() > 2 ? fields[2] : "";
+		if(mode == "stuck0") spec.mode = SF_STUCK0;
+		else if(mode == "stuck1") spec.mode = SF_STUCK1;
+		else if(mode == "flip") spec.mode = SF_FLIP;
+		else {
+			report_fatal_error("[staticfault] " + sf_specs + ":" + utostr(lineno) +
+				": expected <fault site ID> <bit> <stuck0|stuck1|flip>");
+		}
+		spec.variant = specs.size() + 1;
+		specs.push_back(spec);
+	}
+}
 
-		/*Check if I is of type AllocaInst and inject error if true*/
-	if(AllocaInst *allcInst = dyn_cast<AllocaInst>(inst))
-	{	
-		User *allcInstu = &*allcInst;
-		Value *tVal=ConstantInt::get(allcInstu->getOperand(0)->getType(),mask);
-		Value *top = &(*(allcInstu->getOperand(0)));	
-		BinaryOperator *N = BinaryOperator::Create(Instruction::And, tVal, allcInstu->getOperand(0), top->getName(), BI);	     
-		BI->setOperand(0, N);		       
-		return true;
-	}/*end if*/
+// Number of bits of the value corrupted by a fault of <type> at <I>, 0 if it
+//   cannot be corrupted. operand is the operand to corrupt, or -1 for the result.
+static unsigned getStaticFaultWidth(Instruction* I, FaultType type, int& operand) {
+	Value* v = NULL;
+	operand = -1;
+	if(type == DYN_FAULT_DATA) {
+		if(isa<BinaryOperator>(I) || isa<CmpInst>(I) || isa<LoadInst>(I)) v = I;
+		else if(isa<StoreInst>(I)) { operand = 0; v = I->getOperand(0); }
+	} else {
+		if(isa<LoadInst>(I)) { operand = 0; v = I->getOperand(0); }
+		else if(isa<StoreInst>(I)) { operand = 1; v = I->getOperand(1); }
+		else if(isa<AllocaInst>(I) || isa<CallInst>(I)) v = I;
+	}
+	if(!v) return 0;
+	Type* ty = v->getType();
+	if(ty->isPointerTy()) return 64;
+	if(ty->isIntegerTy() || ty->isFloatTy() || ty->isDoubleTy())
+		return ty->getPrimitiveSizeInBits();
+	return 0;
+}
 
-	/*Check if I is of type CallInst and inject error if true*/
-	if(CallInst *callInst = dyn_cast<CallInst>(inst))
-	{ 
-		Type* calledTy = callInst->getCalledValue()->getType();
-		Value *top = &(*(callInst->getCalledValue()));  
-		if(isa<PointerType>(calledTy)) {
-			Value* iAddr = new PtrToIntInst(callInst->getCalledValue(),
-					IntegerType::getInt64Ty(getGlobalContext()),
-					top->getName(),
-					callInst
-				);
-			if(!iAddr) assert(0);
-			Value* tVal = ConstantInt::get(IntegerType::getInt64Ty(getGlobalContext()),
-				mask);
-			BinaryOperator *N = BinaryOperator::Create(Instruction::And, 
-				tVal, iAddr, top->getName(), BI);
-			Value* corruptedCalledValue = new IntToPtrInst(N,
-				calledTy,
-				top->getName(),
-				callInst
-				);
-			callInst->setCalledFunction(corruptedCalledValue);
-			return true;  
-		} else {
-			Value *tVal=ConstantInt::get(callInst->getCalledValue()->getType(),mask);
-			BinaryOperator *N = BinaryOperator::Create(Instruction::And, 
-				tVal, callInst->getCalledValue(), top->getName(), BI);       
-			
-			// Is the code supposed to change the object on which the function is
-			//   called ?
-			// BI->setOperand(0, N);
-			callInst->setCalledFunction(N);
-			return true;
-		}
-	}/*end if*/
+// Applies the masks of <site> to its value
+static void insertStaticFault(StaticFaultSite& site, unsigned width, int operand) {
+	Instruction* I = site.inst;
+	Value* v = operand == -1 ? (Value*)I : I->getOperand(operand);
+	Instruction* insert_before = I;
+	if(operand == -1) {
+		BasicBlock::iterator next(I);
+		next++;
+		insert_before = next;
+	}
+	IRBuilder<> irb(insert_before);
+	Type* ity = IntegerType::get(I->getContext(), width);
+	Value* iv = v->getType()->isPointerTy() ? irb.CreatePtrToInt(v, ity) :
+		irb.CreateBitCast(v, ity); // v itself if it is an integer
+	Value* faulty = irb.CreateAnd(iv, irb.CreateLoad(site.and_mask));
+	Instruction* first = cast<Instruction>(iv != v ? iv : faulty); // The one that reads v
+	faulty = irb.CreateOr(faulty, irb.CreateLoad(site.or_mask));
+	faulty = irb.CreateXor(faulty, irb.CreateLoad(site.xor_mask));
+	faulty = v->getType()->isPointerTy() ? irb.CreateIntToPtr(faulty, v->getType()) :
+		irb.CreateBitCast(faulty, v->getType());
+	if(operand != -1) {
+		I->setOperand(operand, faulty);
+	} else {
+		// All uses but the one that computes the faulty value
+		I->replaceAllUsesWith(faulty);
+		first->replaceUsesOfWith(faulty, I);
+	}
+}
 
-	/*Check if I is of type ReturnInst and inject error if true*/
-	if(ReturnInst *retInst = dyn_cast<ReturnInst>(inst))
-	{	
-		Value *tVal=ConstantInt::get(retInst->getReturnValue()->getType(),mask);
-		Value *top = &(*(retInst->getReturnValue()));	
-		BinaryOperator *N = BinaryOperator::Create(Instruction::And, tVal, retInst->getReturnValue(), top->getName(), BI);	     
-		BI->setOperand(0, N);		       
-		return true;
-	}/*end if*/
-	return false;
-}/*end InjectError_PtrError*/
-/******************************************************************************************************************************/
+// kulfi_variant = atoi(getenv("KULFI_VARIANT")), then the masks of that variant
+static void createVariantSelector(Module& M, const std::vector<StaticFaultSpec>& specs,
+	std::map<int, StaticFaultSite>& sites) {
+	LLVMContext& C = M.getContext();
+	Type* i32 = Type::getInt32Ty(C);
+	Type* i8ptr = Type::getInt8PtrTy(C);
+	GlobalVariable* variant = new GlobalVariable(M, i32, false, GlobalValue::ExternalLinkage,
+		ConstantInt::get(i32, 0), "kulfi_variant");
+
+	std::vector<Type*> params(1, i8ptr);
+	Constant* func_getenv = M.getOrInsertFunction("getenv", FunctionType::get(i8ptr, params, false));
+	Constant* func_atoi = M.getOrInsertFunction("atoi", FunctionType::get(i32, params, false));
+	Function* ctor = Function::Create(FunctionType::get(Type::getVoidTy(C), false),
+		GlobalValue::InternalLinkage, "kulfi.select_variant", &M);
+	BasicBlock* entry = BasicBlock::Create(C, "entry", ctor);
+	BasicBlock* parse = BasicBlock::Create(C, "parse", ctor);
+	BasicBlock* done = BasicBlock::Create(C, "done", ctor);
+	IRBuilder<> irb(entry);
+	Value* env = irb.CreateCall(func_getenv, irb.CreateGlobalStringPtr("KULFI_VARIANT"));
+	irb.CreateCondBr(irb.CreateIsNull(env), done, parse);
+	irb.SetInsertPoint(parse);
+	Value* selected = irb.CreateCall(func_atoi, env);
+	irb.CreateStore(selected, variant);
+	SwitchInst* sw = irb.CreateSwitch(selected, done, specs.size());
+	irb.SetInsertPoint(done);
+	irb.CreateRetVoid();
+
+	for(unsigned i = 0; i < specs.size(); i++) {
+		const StaticFaultSpec& spec = specs[i];
+		std::map<int, StaticFaultSite>::iterator it = sites.find(spec.site_id);
+		if(it == sites.end()) continue;
+		StaticFaultSite& site = it->second;
+		IntegerType* ity = cast<IntegerType>(site.and_mask->getType()->getElementType());
+		APInt bit = APInt::getOneBitSet(ity->getBitWidth(), spec.bit % ity->getBitWidth());
+		BasicBlock* bb = BasicBlock::Create(C, "variant", ctor, done);
+		sw->addCase(ConstantInt::get(cast<IntegerType>(i32), spec.variant), bb);
+		irb.SetInsertPoint(bb);
+		if(spec.mode == SF_STUCK0) irb.CreateStore(ConstantInt::get(ity, ~bit), site.and_mask);
+		if(spec.mode == SF_STUCK1) irb.CreateStore(ConstantInt::get(ity, bit), site.or_mask);
+		if(spec.mode == SF_FLIP) irb.CreateStore(ConstantInt::get(ity, bit), site.xor_mask);
+		irb.CreateBr(done);
+	}
+	appendToGlobalCtors(M, ctor, 65535);
+}
 
-/*Static Fault Injection LLVM Pass*/
 namespace {
 	class staticfault : public ModulePass 
 	{
@@ -1780,76 +2995,91 @@ namespace {
 			static char ID; 
 			staticfault() : ModulePass(ID) {}	                
 			virtual bool runOnModule(Module &M) {
-				assert(0); // Disabled for the moment. June 26
-				srand(time(NULL));
+				srand(seed);
 				if(byte_val < 0 || byte_val > 7) 
 					byte_val = rand()%8;
 						/*Check for assertion violation(s)*/
 				assert(byte_val<=7 && byte_val>=0);
 				assert(ef>=0 && tf>=1 && ef<=tf);
-				assert(ijo==1 || ijo==0);
-				assert(print_fs==1 || print_fs==0);
 				assert(ptr_err==1 || ptr_err==0);
 				assert(data_err==1 || data_err==0);                
-				bool func_flag=false;
-				bool insert_flag=false;
-				StringRef lstr;                
-				Module::FunctionListType &functionList = M.getFunctionList();
-				unsigned int j=0;
-				/*Cache function references to be considered for fault injection*/
-				for (Module::iterator it = functionList.begin(); it != functionList.end(); ++it,j++) {
-					lstr = it->getName();
-					cstr = lstr.str();                   
-					if(!cstr.compare("main"))
+				if(call_boundary)
+					report_fatal_error("[staticfault] -cb is only supported by -dynfault");
+				readFunctionInjWhitelist();
+				std::vector<Function*> targets;
+				std::vector<bool> whitelisted;
+				collectTargets(M, targets, whitelisted);
+
+				/*Number the fault sites as instrumentFunction() does*/
+				std::vector<std::pair<Instruction*, FaultType> > candidates(1); // IDs start at 1
+				for(unsigned i = 0; i < targets.size(); i++) {
+					if(!whitelisted[i]) continue;
+					for(inst_iterator I = inst_begin(targets[i]), E = inst_end(targets[i]); I != E; ++I) {
+						if(!isFaultSiteCandidate(&*I)) continue;
+						if(ptr_err) candidates.push_back(std::make_pair(&*I, DYN_FAULT_PTR));
+						if(data_err) candidates.push_back(std::make_pair(&*I, DYN_FAULT_DATA));
+					}
+				}
+				int num_sites = candidates.size() - 1;
+
+				std::vector<StaticFaultSpec> specs;
+				if(sf_specs != "") {
+					readStaticFaultSpecs(specs);
+				} else if(num_sites > 0 && (rand()%tf)+1 <= ef) {
+					StaticFaultSpec spec;
+					spec.site_id = rand()%num_sites + 1;
+					spec.bit = 8*byte_val + rand()%8;
+					spec.mode = SF_STUCK0;
+					spec.variant = 0; // Always on
+					specs.push_back(spec);
+				}
+
+				/*Masks of the sites that have a fault in some variant*/
+				std::map<int, StaticFaultSite> sites;
+				unsigned num_skipped = 0;
+				for(unsigned i = 0; i < specs.size(); i++) {
+					int id = specs[i].site_id;
+					if(sites.count(id)) continue;
+					if(id < 1 || id > num_sites) {
+						errs() << "[staticfault] No fault site " << id << "\n";
+						num_skipped++;
 						continue;
-					Function *F = it;	
-				 	if(F->begin() == F->end())
-						continue;	
-						 
-					func_flag=true;
-					std::set<Instruction*> ilist;
-					/*Cache instruction references with in a function to be considered for fault injection*/             
-					for(inst_iterator I=inst_begin(F),E=inst_end(F);I!=E;I++) {
-						Value *in = &(*I);
-						if(data_err)
-						if(isa<BinaryOperator>(in) || 
-							isa<CmpInst>(in)) {                     
-							ilist.insert(&*I);
-						}
-						if(ptr_err)
-							if(isa<StoreInst>(in) || 
-							   isa<LoadInst>(in)  ||
-							   isa<CallInst>(in)  ||
-							   isa<AllocaInst>(in)) {                     
-								ilist.insert(&*I);
-							}
 					}
-					/*Check if instruction list is empty*/
-					if(ilist.empty()){
-							errs() << "No Valid Instruction Found!!" << '\n';
-							return false;
+					StaticFaultSite site;
+					site.inst = candidates[id].first;
+					site.type = candidates[id].second;
+					int operand;
+					unsigned width = getStaticFaultWidth(site.inst, site.type, operand);
+					if(width == 0) {
+						errs() << "[staticfault] Fault site " << id << " has no integer, float or pointer value\n";
+						num_skipped++;
+						continue;
 					}
-					lstsize = ilist.size();
-					unsigned int r = rand()%ilist.size();
-					unsigned int i=0;
-					/*Choose a random instuction from instruction list and insert either data or pointer error or both*/
-					for(std::set<Instruction*>::iterator its =ilist.begin();its!=ilist.end();its++,i++) {
-						if(r==i) {
-							Instruction* inst = *its;
-							if(data_err && !inst->mayReadOrWriteMemory())
-								if(InjectError_DataReg(inst))
-									insert_flag=true;                             
-							if(ptr_err && inst->mayReadOrWriteMemory())
-								if(InjectError_PtrError(inst))
-									insert_flag=true;                              
-							if(insert_flag) {
-								printStat(r,insert_flag,func_flag);
-								return true;
-							}
-					 	}
-					}/*end for*/
-				}/*end for*/
-				return false;
+					IntegerType* ity = IntegerType::get(M.getContext(), width);
+					APInt and_mask = APInt::getAllOnesValue(width), or_mask(width, 0), xor_mask(width, 0);
+					if(specs[i].variant == 0) { // The fault without -sf-specs
+						APInt bit = APInt::getOneBitSet(width, specs[i].bit % width);
+						and_mask = ~bit;
+					}
+					bool is_const = (specs[i].variant == 0);
+					std::string suffix = "." + itostr(id);
+					site.and_mask = new GlobalVariable(M, ity, is_const, GlobalValue::InternalLinkage,
+						ConstantInt::get(ity, and_mask), "kulfi.sf.and" + suffix);
+					site.or_mask = new GlobalVariable(M, ity, is_const, GlobalValue::InternalLinkage,
+						ConstantInt::get(ity, or_mask), "kulfi.sf.or" + suffix);
+					site.xor_mask = new GlobalVariable(M, ity, is_const, GlobalValue::InternalLinkage,
+						ConstantInt::get(ity, xor_mask), "kulfi.sf.xor" + suffix);
+					insertStaticFault(site, width, operand);
+					sites[id] = site;
+				}
+				if(sf_specs != "") createVariantSelector(M, specs, sites);
+
+				errs() << "[staticfault] " << num_sites << " fault sites, " << sites.size()
+					<< " with a fault";
+				if(sf_specs != "") errs() << ", " << specs.size() << " variants";
+				if(num_skipped) errs() << ", " << num_skipped << " faults skipped";
+				errs() << "\n";
+				return !sites.empty();
 			}/*end function definition*/
 	};/*end class definition*/
 }/*end namespace*/
@@ -1858,217 +3088,169 @@ static RegisterPass<staticfault> F1("staticfault", "Static Fault Injection emula
 
 /******************************************************************************************************************************/
 
-const char* getMyTypeName(const Value* v) {
+// Node types in the -kulfi-graph file; the index is the type ID
+static const char* node_type_names[] = {
+	"--", "BinOp", "Cmp", "ST", "LD", "GEP", "Ret", "Br", "Phi", "Call", "ICmp", "Alloca"
+};
+
+unsigned char getMyTypeId(const Value* v) {
 	if(isa<BinaryOperator>(v)) {
-		return "BinOp";
+		return 1;
 	} else if(isa<CmpInst>(v)) {
-		return "Cmp";
+		return 2;
 	} else if(isa<StoreInst>(v)) {
-		return "ST";
+		return 3;
 	} else if(isa<LoadInst>(v)) {
-		return "LD";
+		return 4;
 	} else if(isa<GetElementPtrInst>(v)) {
-		return "GEP";
+		return 5;
 	} else if(isa<ReturnInst>(v)) {
-		return "Ret";
+		return 6;
 	} else if(isa<BranchInst>(v)) {
-		return "Br";
+		return 7;
 	} else if(isa<PHINode>(v)) {
-		return "Phi";
+		return 8;
 	} else if(isa<CallInst>(v)) {
-		return "Call";
+		return 9;
 	} else if(isa<ICmpInst>(v)) {
-		return "ICmp";
+		return 10;
 	} else if(isa<AllocaInst>(v)) {
-		return "Alloca";
-	} else return "--";
+		return 11;
+	} else return 0;
 }
 
 // Experimental
 // I need the graph, really
-void recordUseDefChain(Module& M) {
-	errs() << "Backup ...... \n";
-	unsigned long nodeid = 0;
-	Module::FunctionListType& funcList = M.getFunctionList();
+// Only reads the IR: runs on the worker threads. first_node is set by instrumentFunction().
+void recordUseDefChain(Function& F, UseDefGraph& g) {
+	g.func = &F;
 
 	// Pass 1: Give every instruction a node ID (node in the graph for visualization)
-	for(Module::iterator itr = funcList.begin(); itr != funcList.end(); itr++) {
-		Function& F = *itr;
-		std::string s = F.getName().str();
-		const Function* pF = (const Function*)(&F);
-		if(isFunctionNameBlacklisted(s.c_str()) || (!shouldInjectFunction(pF))) {
-			continue;
+	unsigned nodeid = 0;
+	for(Function::iterator itr1 = F.begin(); itr1 != F.end(); itr1++) {
+		for(BasicBlock::iterator itr2 = itr1->begin(); itr2 != itr1->end(); itr2++) {
+			const Value* inst = (const Value*)(&(*itr2));
+			#ifdef TOMMY_TEST
+			test0[inst] = instToString(&(*itr2));
+			#endif
+			g.node_ids[inst] = nodeid;
+			nodeid ++;
 		}
-		std::list<const BasicBlock*> bbs;
-		Function::BasicBlockListType& bbList = F.getBasicBlockList();
-		for(Function::iterator itr1 = bbList.begin(); itr1 != bbList.end(); itr1++) {
-			BasicBlock& BB = *itr1;
-			BasicBlock* pBB = &(BB);
-			bbs.push_back((const BasicBlock*)pBB);
-			std::list<unsigned long> nodeids; nodeids.clear();
-			for(BasicBlock::iterator itr2 = BB.begin(); itr2 != BB.end(); itr2++) {
-				const Value* inst = (const Value*)(&(*itr2));
-				#ifdef TOMMY_TEST
-				test0[inst] = instToString(inst);
-				#endif
-				fault_site_to_nodeid[inst] = nodeid;
-				nodeids.push_back(nodeid);
-
-				node_type_names[nodeid] = getMyTypeName(inst);
-
-				if(isa<ReturnInst>(inst)) {// || isa<BranchInst>(inst)) {
-					is_terminator.insert(nodeid);
-				}
-				nodeid ++;
+	}
+	if(graph_file == "") return;
+	g.types.reserve(nodeid);
+	g.fault_site_ids.assign(nodeid, -1);
+	g.is_in_chain.resize(nodeid);
+	g.is_terminator.resize(nodeid);
+	g.edge_begin.reserve(nodeid + 1);
+
+	// Pass 2: Record all the use-def edges, in node order
+	nodeid = 0;
+	for(Function::iterator itr1 = F.begin(); itr1 != F.end(); itr1++) {
+		for(BasicBlock::iterator itr2 = itr1->begin(); itr2 != itr1->end(); itr2++, nodeid++) {
+			const Instruction* inst = &(*itr2);
+			g.types.push_back(getMyTypeId(inst));
+			g.edge_begin.push_back(g.edge_uses.size());
+
+			if(isa<ReturnInst>(inst)) {// || isa<BranchInst>(inst)) {
+				g.is_terminator.set(nodeid);
 			}
-			nodeids_in_basicblocks[pBB] = nodeids;
-			std::string bb_name = pBB->getName().str();
-//			bb_names[pBB] = bb_name;
-		}
-		bbs_in_funcs[pF] = bbs;
-	}
-	num_nodes = nodeid;
-	errs() << is_terminator.size() << " terminators\n";
-
-	// Pass 2: Record all the use-def edges
-	for(Module::iterator itr = funcList.begin(); itr != funcList.end(); itr++) {
-		Function& F = *itr;
-		const Function* f = (const Function*)(&F);
-		if(isFunctionNameBlacklisted(F.getName().str().c_str()) ||
-			(!shouldInjectFunction(f))) continue;
-		Function::BasicBlockListType& bbList = F.getBasicBlockList();
-		fprintf(stderr, "%s\n", F.getName().str().c_str());
-		for(Function::iterator itr1 = bbList.begin(); itr1 != bbList.end(); itr1++) {
-			BasicBlock& BB = *itr1;
-			for(BasicBlock::iterator itr2 = BB.begin(); itr2 != BB.end(); itr2++) {
-				const Instruction* inst = &(*itr2);
-				const Value* def = (const Value*)(inst);
-
-				if(isa<PHINode>(inst)) {
-					PHINode* phinode = (PHINode*)(inst);
-					unsigned n_incoming = phinode->getNumIncomingValues();
-					unsigned long to_nid = fault_site_to_nodeid.at((Value*)inst);
-					if(n_incoming > 0) {
-						for(unsigned i=0; i<n_incoming; i++) {
-							Value* inc = phinode->getIncomingValue(i);
-							if(fault_site_to_nodeid.find(inc) == fault_site_to_nodeid.end()) {
-								continue; // A PHI node may have a "constant" incoming value: e.g. %i.07.i2 = phi i32 [ 0, %NumOfBitsSet.exit ], [ %14, %12 ]
-							}
-							unsigned long from_nid = fault_site_to_nodeid.at(inc);
-							is_in_chain.insert(from_nid);
-							is_in_chain.insert(to_nid);
-						}
-					}
-				}
-				
-				{
-					Instruction::const_use_iterator itr3_begin = inst->use_begin();
-					Instruction::const_use_iterator itr3_end   = inst->use_end();
-					for(Instruction::const_use_iterator itr3 = itr3_begin;
-						itr3 != itr3_end; itr3++) {
-						const User* user = *itr3;
-						const Value* use = dynamic_cast<const Value*>(user);
-						if(use) {
-							unsigned long def_nid = fault_site_to_nodeid.at(def);
-							unsigned long use_nid = fault_site_to_nodeid.at(use);
-							usedef_edge_list.push_back(std::make_pair(def_nid, use_nid));
-							is_in_chain.insert(def_nid);
-							is_in_chain.insert(use_nid);
-						}
-					}
-				}
 
-				if(isa<BranchInst>(inst)) { // Add an ety to branch_edge_list
-					BranchInst* br_inst = (BranchInst*)(inst);
-					unsigned n_succ = br_inst->getNumSuccessors();
-					for(unsigned i=0; i<n_succ; i++) {
-						BasicBlock* succ = br_inst->getSuccessor(i);
-						Instruction* first_non_phi = succ->getFirstNonPHI();
-						unsigned long from_nid = fault_site_to_nodeid.at((Value*)(inst));
-						unsigned long to_nid   = fault_site_to_nodeid.at((Value*)(first_non_phi));
-						branch_edge_list.push_back(std::make_pair(from_nid, to_nid));
+			if(const PHINode* phinode = dyn_cast<PHINode>(inst)) {
+				unsigned n_incoming = phinode->getNumIncomingValues();
+				for(unsigned i=0; i<n_incoming; i++) {
+					DenseMap<const Value*, unsigned>::const_iterator from =
+						g.node_ids.find(phinode->getIncomingValue(i));
+					if(from == g.node_ids.end()) {
+						continue; // A PHI node may have a "constant" incoming value: e.g. %i.07.i2 = phi i32 [ 0, %NumOfBitsSet.exit ], [ %14, %12 ]
 					}
+					g.is_in_chain.set(from->second);
+					g.is_in_chain.set(nodeid);
 				}
 			}
-		}
-	}
 
-	errs() << "[recordUseDefChain] " << usedef_edge_list.size() << " entries in use-def graph.\n";
-
-}
-
-void writeFaultSiteDOTGraph() {
-	errs() << "Printing out DOT graph.\n";
-
-	FILE* out = fopen("usedefchain.dot", "w");
-	fprintf(out, "digraph G {\tnode [shape=rectangle;] \n");
-	// Cluster idx
-	int cluster_idx = 0;
-	for(std::map<const Function*, std::list<const BasicBlock*> >::const_iterator itr0 = bbs_in_funcs.begin();
-		itr0 != bbs_in_funcs.end(); itr0++) {
-		const std::list<const BasicBlock*> blist = itr0->second;
-		if(!shouldInjectFunction(itr0->first)) continue;
-		std::string s = itr0->first->getName().str();
-		fprintf(stderr, "%s\n", s.c_str());
-		fprintf(out, "\tsubgraph cluster%d { label=\"%s\"\n", cluster_idx, s.c_str());
-		cluster_idx++;
-		for(std::list<const BasicBlock*>::const_iterator itr = blist.begin(); itr != blist.end(); itr++) {
-			BasicBlock* pBB = (BasicBlock*)(*itr);
-			if(nodeids_in_basicblocks.find(pBB) == nodeids_in_basicblocks.end()) continue;
-			std::list<unsigned long>& nodes = nodeids_in_basicblocks[pBB];
-			std::string bb_name = bb_names[pBB];
-
-			std::list<unsigned long> filtered;
-			for(std::list<unsigned long>::iterator itr1 = nodes.begin(); itr1 != nodes.end(); itr1++) {
-				unsigned long nodeid = *itr1;
-				if(is_in_chain.find(nodeid) != is_in_chain.end())
-					filtered.push_back(nodeid);
-			}
-
-			if(filtered.size() > 0) {
-//				fprintf(out, "\t\tsubgraph cluster%d { label=\"%s\" ", cluster_idx, bb_name.c_str());
-//				cluster_idx++;
-				for(std::list<unsigned long>::iterator itr1 = filtered.begin(); itr1 != filtered.end(); itr1++) {
-					fprintf(out, "Node%lu; ", *itr1);
-				}
-//				fprintf(out, "}\n");
+			for(Value::const_use_iterator itr3 = inst->use_begin();
+				itr3 != inst->use_end(); itr3++) {
+				DenseMap<const Value*, unsigned>::const_iterator use = g.node_ids.find(*itr3);
+				assert(use != g.node_ids.end());
+				g.edge_uses.push_back(use->second);
+				g.is_in_chain.set(nodeid);
+				g.is_in_chain.set(use->second);
 			}
 		}
-		fprintf(out, "\t}\n");
-	}
-
-	for(unsigned long i=0; i<num_nodes; i++) { 
-		if(is_in_chain.find(i) != is_in_chain.end()) {
-			fprintf(out, "\tNode%lu [", i);
-			bool should_color = false;
-			bool should_double_circle = false;
-			int fault_idx = -1;
-			if(nodeid_to_fault_site_id.find(i) != nodeid_to_fault_site_id.end()) {
-				fault_idx = nodeid_to_fault_site_id[i];
-				if(injected_fault_indices.find(fault_idx) !=
-					injected_fault_indices.end())
-					should_color = true;
-			}
-			if(is_terminator.find(i) != is_terminator.end())
-				should_double_circle = true;
-			if(should_color) {
-				fprintf(out, "label=\"%s\\n(FS%d)\" color=\"red\"", node_type_names[i], fault_idx);
-			} else {
-				fprintf(out, "label=\"%s\"", node_type_names[i]);
-			}
+	}
+	g.edge_begin.push_back(g.edge_uses.size());
+}
 
-			if(should_double_circle) {
-				fprintf(out, " shape=\"doublecircle\"");
-			}
+// -kulfi-graph file, native byte order (little endian on x86):
+//   "KULFIUDG" | u32 version | u32 num_types | num_types NUL-terminated type names
+// followed by one record per function, in the order they were instrumented:
+//   u32 name_len | name | u64 first_node | u32 num_nodes | u32 num_edges |
+//   u8 types[num_nodes] | u8 flags[num_nodes] | i32 fault_site_ids[num_nodes] |
+//   u32 edge_begin[num_nodes+1] | u32 edge_uses[num_edges]
+// Nodes in a record are local (0 .. num_nodes-1); edges go from a definition
+//   to its uses (CSR, see UseDefGraph). Fault site IDs are local to the module.
+#define KULFI_GRAPH_VERSION 1
+enum { GRAPH_TERMINATOR = 1, GRAPH_IN_CHAIN = 2, GRAPH_INJECTED = 4 };
+static FILE* graph_out = NULL;
+static unsigned long graph_num_edges = 0;
+
+static void writeU32(FILE* f, unsigned v) {
+	fwrite(&v, sizeof(v), 1, f);
+}
 
-			fprintf(out, "]\n");
-		}
+static bool beginUseDefGraph() {
+	graph_out = fopen(graph_file.c_str(), "wb");
+	if(!graph_out) {
+		report_fatal_error("[dynfault] Cannot write " + graph_file);
 	}
-	for(std::list<std::pair<unsigned long, unsigned long> >::iterator itr =
-		usedef_edge_list.begin(); itr != usedef_edge_list.end(); itr++) {
-		unsigned long from = itr->first, to = itr->second;
-		fprintf(out, "\tNode%lu -> Node%lu\n", from, to);
+	fwrite("KULFIUDG", 8, 1, graph_out);
+	writeU32(graph_out, KULFI_GRAPH_VERSION);
+	unsigned num_types = sizeof(node_type_names) / sizeof(const char*);
+	writeU32(graph_out, num_types);
+	for(unsigned i=0; i<num_types; i++)
+		fwrite(node_type_names[i], strlen(node_type_names[i]) + 1, 1, graph_out);
+	return true;
+}
+
+// Appends the record of one function
+void writeUseDefGraph(const UseDefGraph& g) {
+	if(graph_file == "") return;
+	if(!graph_out) beginUseDefGraph();
+	FILE* out = graph_out;
+	std::string name = g.func->getName().str();
+	unsigned n = g.types.size();
+
+	std::vector<unsigned char> flags(n, 0);
+	for(unsigned i = 0; i < n; i++) {
+		if(g.is_terminator.test(i)) flags[i] |= GRAPH_TERMINATOR;
+		if(g.is_in_chain.test(i)) flags[i] |= GRAPH_IN_CHAIN;
+		if(g.fault_site_ids[i] != -1 && getFaultSite(g.fault_site_ids[i]).injected)
+			flags[i] |= GRAPH_INJECTED;
 	}
-	fprintf(out, "}\n");
-	fclose(out);
+
+	writeU32(out, name.size());
+	fwrite(name.data(), name.size(), 1, out);
+	unsigned long long first_node = g.first_node;
+	fwrite(&first_node, sizeof(first_node), 1, out);
+	writeU32(out, n);
+	writeU32(out, g.edge_uses.size());
+	if(n > 0) {
+		fwrite(&g.types[0], 1, n, out);
+		fwrite(&flags[0], 1, n, out);
+		fwrite(&g.fault_site_ids[0], sizeof(int), n, out);
+	}
+	fwrite(&g.edge_begin[0], sizeof(unsigned), n + 1, out);
+	if(!g.edge_uses.empty())
+		fwrite(&g.edge_uses[0], sizeof(unsigned), g.edge_uses.size(), out);
+	graph_num_edges += g.edge_uses.size();
+}
+
+void endUseDefGraph() {
+	if(graph_file == "") return;
+	if(!graph_out) beginUseDefGraph(); // No function was instrumented
+	fclose(graph_out);
+	graph_out = NULL;
+	errs() << "[recordUseDefChain] " << graph_num_edges << " entries in use-def graph, written to "
+		<< graph_file << ".\n";
 }
@@ -1,7 +1,7 @@
 /*******************************************************************************************/
 /* Name        : Corrupt.c                                                                 */
-/* Description : This file contains code for corrupting data and pointer. It is linked at  */
-/*               compiled time to the target code where fault(s) need to be injected       */
+/* Description : This file contains code for corrupting data and pointer. It is built into */
+/*               libkulfi_rt (see Makefile) and linked to the instrumented target code     */
 /*      																				   */
 /* Owner       : This tool is owned by Gauss Research Group at School of Computing,        */
 /*               University of Utah, Salt Lake City, USA.                                  */
@@ -18,15 +18,53 @@
 //                   of each BasicBlock of the original bytecode.
 // Changes on Jul 31: Need specify bit position.
 // Changes on Sep 08: Use env vars instead of file I/O to speed up
+// Changes on Oct 18: Output monitor. Writes to stdout and to designated output files
+//                   are compared against a golden digest (one hash per 4 KiB block)
+//                   and the run is stopped at the first differing block.
+// Changes on Oct 18: Built once into libkulfi_rt (Makefile). The fault pass only emits
+//                   declarations, whose prototypes are in kulfi_rt.h.
+// Changes on Oct 18: The corrupt* functions are instances of one template (corruptValue).
+//                   The countdown test is inlined into the target by the fault pass
+//                   (kulfi_site_countdown); only the cold path is in here.
+// Changes on Oct 18: The cold path gets a pointer to the site's descriptor (kulfi_rt.h)
+//                   instead of fault_index, ijo, ef, tf and byte_val.
+// Changes on Oct 18: Reads the fault site manifests linked into the program.
+// Changes on Oct 18: Site IDs in the descriptors are local to their module; the
+//                   histogram and the reports use global IDs (kulfi_register_module).
+// Changes on Oct 18: Vector fault sites. kulfi_vector_lane chooses the lane, whose
+//                   element goes through the cold path of its type; the lane is reported.
+// Changes on Oct 18: kulfi_mf_corrupt, the cold path of the machine register fault sites
+//                   of kulfi-llc (through kulfi_mf_cold in kulfi_mf_stub.S).
+// Changes on Oct 18: Timer mode for programs that are not instrumented at all: with
+//                   LD_PRELOAD=libkulfi_rt.so and KULFI_TIMER_FAULT, a CPU time timer
+//                   flips a bit of a register of the interrupted context.
+// Changes on Oct 18: Memory mode (KULFI_MEM_FAULT): tracks the heap blocks and the
+//                   globals of the manifest, and flips a bit of a live word, at the
+//                   fault site the countdown selects or when a CPU time timer expires.
+// Changes on Oct 18: Thread targeting (KULFI_TARGET_THREAD): the fault sites of the other
+//                   threads are neither counted nor injected.
+// Changes on Oct 18: MPI rank targeting (KULFI_TARGET_RANK): Kulfi is disabled in the
+//                   other ranks.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <time.h>
 #include <assert.h>
 #include <map>
 #include <string>
 #include <string.h>
 #include <unordered_map>
+#include <iostream>
+#include <ext/stdio_sync_filebuf.h>
+#include "kulfi_rt.h"
+#include <unistd.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 // Changes on Aug 27: Log event: entering some basic block
 #define IS_BB_LOG_USE_SQLITE
@@ -47,12 +85,19 @@ extern "C" {
 #endif
 
 	static bool is_kulfi_enabled = true;
+	static void armFastPath();
+	static void disarmFastPath();
+	// Set in memory mode: the selected fault site corrupts a word of memory instead
+	static void (*memory_fault_at_site)(const struct kulfi_site* site, int fault_index,
+		int ef, int tf) = NULL;
 	
 	void EnableKulfi() {
 		is_kulfi_enabled = true;
+		armFastPath();
 	}
 	
 	void DisableKulfi() {
+		disarmFastPath();
 		is_kulfi_enabled = false;
 	}
 
@@ -75,6 +120,22 @@ extern "C" {
 	int max_fault_interval = -1;
 	static long next_fault_countdown = -1;
 	// Next fault falls into this BB
+
+	// Fast path, inlined into the target at every fault site by the fault pass:
+	//   if(kulfi_site_countdown > 0) { kulfi_site_countdown--; return value; }
+	//   else return corrupt*_{ijo,multi}(...);
+	// While "armed", it holds the sites that can be skipped before the next
+	//   fault and next_fault_countdown only holds the rest (1). It must be
+	//   disarmed before next_fault_countdown is looked at. It stays 0, so that
+	//   every site reaches the runtime, while Kulfi is disabled and when the
+	//   fault site histogram is enabled.
+	long long kulfi_site_countdown = 0;
+	// The countdown of the machine register fault sites of kulfi-llc, which have no
+	//   isNextFaultInThisBB predicate: while a fault is pending it starts at
+	//   kulfi_site_countdown (kulfi_mf_armed), otherwise it is LLONG_MAX, so that
+	//   the sites never reach kulfi_mf_corrupt when there is nothing to inject.
+	long long kulfi_mf_countdown = LLONG_MAX;
+	static long long kulfi_mf_armed = LLONG_MAX;
 	
 	/*random seed initialization flag*/
 	int rand_flag=0;
@@ -112,6 +173,13 @@ extern "C" {
 	std::unordered_map<std::string, unsigned long>* g_bbhistogram;
 	
 	static bool is_dump_bb_trace = false, is_count_bb_histogram = false;
+
+	// When stdout is monitored, "stdout" points to the monitor and the runtime's
+	//   own messages must not be mixed into the program's output.
+	static FILE* g_real_stdout = NULL;
+	static FILE* kulfiStdout() {
+		return g_real_stdout ? g_real_stdout : stdout;
+	}
 	
 	// This guy should be idempotent
 	static void incrementFaultSiteHit(int fsid) {
@@ -140,7 +208,25 @@ extern "C" {
 		}
 		
 		fclose(f);
-		printf("Fault site hit histogram saved to %s.\n", filename);
+		fprintf(kulfiStdout(), "Fault site hit histogram saved to %s.\n", filename);
+	}
+	
+	static void disarmFastPath() {
+		next_fault_countdown += kulfi_site_countdown;
+		if(kulfi_mf_armed != LLONG_MAX)
+			next_fault_countdown -= kulfi_mf_armed - kulfi_mf_countdown; // Skipped machine sites
+		kulfi_site_countdown = 0;
+		kulfi_mf_countdown = kulfi_mf_armed = LLONG_MAX;
+	}
+
+	static void armFastPath() {
+		disarmFastPath();
+		if(is_kulfi_enabled && !enable_fault_site_hist && next_fault_countdown > 1) {
+			kulfi_site_countdown = next_fault_countdown - 1;
+			next_fault_countdown = 1;
+		}
+		if(is_kulfi_enabled && (enable_fault_site_hist || next_fault_countdown >= 0))
+			kulfi_mf_countdown = kulfi_mf_armed = kulfi_site_countdown;
 	}
 	
 	// Program Statistics
@@ -179,7 +265,7 @@ extern "C" {
 				assert(err == SQLITE_DONE);
 				sqlite3_finalize(insert_stmt);
 			}
-			printf("Wrote %u entries to DB\n", BBHIST_FLUSH_INTERVAL);
+			fprintf(kulfiStdout(), "Wrote %u entries to DB\n", BBHIST_FLUSH_INTERVAL);
 			sqlite3_exec(g_bbhist_db, "COMMIT", NULL, NULL, NULL);
 		#else
 			// Output BB history not using SQLite3?
@@ -187,9 +273,183 @@ extern "C" {
 		#endif
 	}
 	
+	// Thread targeting: with KULFI_TARGET_THREAD, only the fault sites of the selected
+	//   thread are counted and injected; in the other threads isNextFaultInThisBB is
+	//   always false, so they skip every site. The selector is
+	//     <N>        : the N-th thread created with pthread_create, 0 being the main thread
+	//     omp:<N>    : the thread whose OpenMP thread number (omp_get_thread_num) is N
+	//     fn:<name>  : the threads created with <name> as start routine (needs the
+	//                  symbol in the dynamic symbol table, e.g. linked with -rdynamic)
+	//   A thread is classified once, by incrementFaultSiteCount at its first fault site
+	//   (it runs before isNextFaultInThisBB in every BB), so that isNextFaultInThisBB
+	//   stays read-only. The countdown and the current BB state are only touched by
+	//   the target thread.
+	int omp_get_thread_num() __attribute__((weak));
+
+	enum ThreadSelector { TARGET_ALL_THREADS, TARGET_THREAD_INDEX, TARGET_OMP_THREAD, TARGET_START_ROUTINE };
+	static ThreadSelector thread_selector = TARGET_ALL_THREADS;
+	static long target_thread_index = 0;
+	static void* target_start_routine = NULL;
+	static volatile long num_threads_created = 0;
+	// 1: target, -1: not the target, 0: not classified yet
+	static __thread signed char is_target_thread = 0;
+
+	static bool kulfiIsTargetThread() {
+		if(is_target_thread == 0) {
+			bool target = false;
+			if(thread_selector == TARGET_OMP_THREAD)
+				target = ((omp_get_thread_num ? omp_get_thread_num() : 0) == target_thread_index);
+			else if(thread_selector == TARGET_THREAD_INDEX)
+				target = (target_thread_index == 0); // Threads not from pthread_create: the main thread
+			is_target_thread = target ? 1 : -1;
+		}
+		return is_target_thread > 0;
+	}
+
+	struct ThreadStart {
+		void* (*start_routine)(void*);
+		void* arg;
+		signed char is_target;
+	};
+
+	static void* kulfiThreadStart(void* p) {
+		ThreadStart ts = *(ThreadStart*)p;
+		free(p);
+		is_target_thread = ts.is_target;
+		return ts.start_routine(ts.arg);
+	}
+
+	typedef int (*pthread_create_t)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+	int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+		void* (*start_routine)(void*), void* arg) {
+		static pthread_create_t real_pthread_create = NULL;
+		if(!real_pthread_create) {
+			real_pthread_create = (pthread_create_t)dlsym(RTLD_NEXT, "pthread_create");
+			if(!real_pthread_create)
+				real_pthread_create = (pthread_create_t)dlsym(RTLD_DEFAULT, "pthread_create");
+			assert(real_pthread_create && real_pthread_create != pthread_create);
+		}
+		if(thread_selector != TARGET_THREAD_INDEX && thread_selector != TARGET_START_ROUTINE)
+			return real_pthread_create(thread, attr, start_routine, arg);
+
+		long index = __sync_add_and_fetch(&num_threads_created, 1);
+		ThreadStart* ts = (ThreadStart*)malloc(sizeof(ThreadStart));
+		ts->start_routine = start_routine;
+		ts->arg = arg;
+		if(thread_selector == TARGET_THREAD_INDEX)
+			ts->is_target = (index == target_thread_index) ? 1 : -1;
+		else
+			ts->is_target = ((void*)start_routine == target_start_routine) ? 1 : -1;
+		int err = real_pthread_create(thread, attr, kulfiThreadStart, ts);
+		if(err) free(ts);
+		return err;
+	}
+
+	__attribute__((constructor))
+	static void kulfiReadThreadTarget() {
+		char* target = getenv("KULFI_TARGET_THREAD");
+		if(!target) return;
+		if(!strncmp(target, "omp:", 4)) {
+			thread_selector = TARGET_OMP_THREAD;
+			target_thread_index = atol(target + 4);
+		} else if(!strncmp(target, "fn:", 3)) {
+			thread_selector = TARGET_START_ROUTINE;
+			target_start_routine = dlsym(RTLD_DEFAULT, target + 3);
+			if(!target_start_routine) {
+				fprintf(stderr, "[Thread targeting] %s: no such symbol (link with -rdynamic)\n",
+					target + 3);
+				exit(1);
+			}
+		} else {
+			thread_selector = TARGET_THREAD_INDEX;
+			target_thread_index = atol(target);
+		}
+		// The main thread is classified by kulfiIsTargetThread
+	}
+
+	// MPI rank targeting: with KULFI_TARGET_RANK=<N>, only rank N of MPI_COMM_WORLD
+	//   injects; the other ranks run with Kulfi disabled, which skips every fault
+	//   site. The rank is taken from the environment of the launcher (Open MPI,
+	//   MPICH/Hydra, PMIx, MVAPICH); otherwise every rank is disabled until
+	//   MPI_Init, after which MPI_Comm_rank decides (the sites before MPI_Init are
+	//   then not counted). MPI_Comm_rank is found with dlsym, so the runtime does
+	//   not depend on an MPI implementation.
+	static int target_rank = -1;     // -1: every rank
+	static int mpi_rank = -1;        // -1: not known yet
+	static bool is_rank_pending = false; // Disabled until MPI_Init
+	static bool is_enabled_after_mpi_init = false;
+
+	static const char* rank_env_vars[] = {
+		"OMPI_COMM_WORLD_RANK", "PMI_RANK", "PMIX_RANK", "MV2_COMM_WORLD_RANK"
+	};
+
+	__attribute__((constructor))
+	static void kulfiReadRankTarget() {
+		char* target = getenv("KULFI_TARGET_RANK");
+		if(!target) return;
+		target_rank = atoi(target);
+		for(unsigned i=0; i<sizeof(rank_env_vars)/sizeof(rank_env_vars[0]); i++) {
+			char* rank = getenv(rank_env_vars[i]);
+			if(rank) {
+				mpi_rank = atoi(rank);
+				break;
+			}
+		}
+	}
+
+	// Called at the end of initializeFaultInjectionCampaign
+	static void kulfiApplyRankTarget() {
+		if(target_rank < 0 || mpi_rank == target_rank) return;
+		if(mpi_rank < 0) {
+			is_rank_pending = true;
+			is_enabled_after_mpi_init = is_kulfi_enabled;
+		}
+		DisableKulfi();
+	}
+
+	static void kulfiOnMpiInit() {
+		if(!is_rank_pending) return;
+		is_rank_pending = false;
+		// MPI_Comm is an int in the MPICH family and a pointer in Open MPI
+		void* comm_rank = dlsym(RTLD_DEFAULT, "MPI_Comm_rank");
+		void* ompi_comm_world = dlsym(RTLD_DEFAULT, "ompi_mpi_comm_world");
+		if(!comm_rank) return;
+		if(ompi_comm_world)
+			((int (*)(void*, int*))comm_rank)(ompi_comm_world, &mpi_rank);
+		else
+			((int (*)(int, int*))comm_rank)(0x44000000, &mpi_rank); // MPICH's MPI_COMM_WORLD
+		if(mpi_rank == target_rank && is_enabled_after_mpi_init) {
+			fprintf(stderr, "[Rank targeting] Rank %d is the target\n", mpi_rank);
+			EnableKulfi();
+		}
+	}
+
+	typedef int (*mpi_init_t)(int*, char***);
+	typedef int (*mpi_init_thread_t)(int*, char***, int, int*);
+
+	int MPI_Init(int* argc, char*** argv) {
+		static mpi_init_t real_mpi_init = NULL;
+		if(!real_mpi_init) real_mpi_init = (mpi_init_t)dlsym(RTLD_NEXT, "MPI_Init");
+		assert(real_mpi_init && real_mpi_init != MPI_Init);
+		int err = real_mpi_init(argc, argv);
+		kulfiOnMpiInit();
+		return err;
+	}
+
+	int MPI_Init_thread(int* argc, char*** argv, int required, int* provided) {
+		static mpi_init_thread_t real_mpi_init_thread = NULL;
+		if(!real_mpi_init_thread)
+			real_mpi_init_thread = (mpi_init_thread_t)dlsym(RTLD_NEXT, "MPI_Init_thread");
+		assert(real_mpi_init_thread && real_mpi_init_thread != MPI_Init_thread);
+		int err = real_mpi_init_thread(argc, argv, required, provided);
+		kulfiOnMpiInit();
+		return err;
+	}
+
 	// This will be called from faults.cpp
 	void incrementFaultSiteCount(char* bbname, int bb_fs_count) {
 		if(!is_kulfi_enabled) { return; }
+		if(thread_selector != TARGET_ALL_THREADS && !kulfiIsTargetThread()) return;
 		
 		// When "logging fault site hit histograms" option is enabled,
 		//   must always set "curr_bb_no_fault" to false, such that corrupt* is called
@@ -241,16 +501,315 @@ extern "C" {
 		EnableKulfi();
 	}
 	
+	// Fault site manifests, between the linker-defined __start_/__stop_ symbols
+	//   of the section. Weak, so that programs without one still link.
+	extern const char __start_kulfi_manifest[] __attribute__((weak));
+	extern const char __stop_kulfi_manifest[] __attribute__((weak));
+
+	static const struct kulfi_manifest* kulfiNextManifest(const struct kulfi_manifest* m) {
+		const char* p = m ? ((const char*)m + m->size) : __start_kulfi_manifest;
+		if(!p || p + sizeof(struct kulfi_manifest) > __stop_kulfi_manifest) return NULL;
+		m = (const struct kulfi_manifest*)p;
+		if(memcmp(m->magic, KULFI_MANIFEST_MAGIC, 8) != 0 || m->version != KULFI_MANIFEST_VERSION)
+			return NULL;
+		return m;
+	}
+
+	static const struct kulfi_manifest_site* kulfiManifestSites(const struct kulfi_manifest* m) {
+		return (const struct kulfi_manifest_site*)(m + 1);
+	}
+
+	static const struct kulfi_manifest_bb* kulfiManifestBBs(const struct kulfi_manifest* m) {
+		return (const struct kulfi_manifest_bb*)(kulfiManifestSites(m) + m->num_sites);
+	}
+
+	static const unsigned* kulfiManifestFuncs(const struct kulfi_manifest* m) {
+		return (const unsigned*)(kulfiManifestBBs(m) + m->num_bbs);
+	}
+
+	const char* kulfi_manifest_string(const struct kulfi_manifest* m, unsigned offset) {
+		const char* strings = (const char*)(kulfiManifestFuncs(m) + m->num_funcs);
+		return (offset < m->strings_size) ? (strings + offset) : "?";
+	}
+
+	const struct kulfi_manifest_site* kulfi_find_manifest_site(unsigned module_hash, int site_id,
+		const struct kulfi_manifest** manifest) {
+		for(const struct kulfi_manifest* m = kulfiNextManifest(NULL); m; m = kulfiNextManifest(m)) {
+			if(m->module_hash != module_hash) continue;
+			const struct kulfi_manifest_site* sites = kulfiManifestSites(m);
+			for(unsigned i=0; i<m->num_sites; i++) {
+				if(sites[i].site_id != site_id) continue;
+				if(manifest) *manifest = m;
+				return &(sites[i]);
+			}
+		}
+		return NULL;
+	}
+
+	// The base of a module is where its manifest is in the section, so the IDs do
+	//   not depend on the order the constructors run in, and kulfi_manifest.py
+	//   computes the same ones. Modules without a manifest come after all the others.
+	void kulfi_register_module(struct kulfi_module* module) {
+		static int unlisted_base = -1;
+		int base = 0;
+		for(const struct kulfi_manifest* m = kulfiNextManifest(NULL); m; m = kulfiNextManifest(m)) {
+			if(m->module_hash == module->hash) {
+				module->site_base = base;
+				return;
+			}
+			base += m->num_site_ids;
+		}
+		if(unlisted_base < 0) unlisted_base = base;
+		module->site_base = unlisted_base;
+		unlisted_base += module->num_sites;
+	}
+
+	static int kulfiGlobalSiteId(const struct kulfi_site* site) {
+		const struct kulfi_module* module = site->config->module;
+		return module ? (module->site_base + site->site_id) : site->site_id;
+	}
+
+	static unsigned kulfiCountManifestSites() {
+		unsigned n = 0;
+		for(const struct kulfi_manifest* m = kulfiNextManifest(NULL); m; m = kulfiNextManifest(m))
+			n += m->num_sites;
+		return n;
+	}
+
+	// Output monitor
+	//   KULFI_OUTPUT_MONITOR="<target>=<digest file> ..." where <target> is either
+	//   "stdout" or the path the program passes to fopen(). Each digest holds the
+	//   FNV-1a hash of every 4 KiB block of the golden output (see writedigest() in
+	//   the example scripts). Bytes written to a monitored target are hashed on the
+	//   fly and never reach the disk. The outcome is written to KULFI_OUTCOME
+	//   (or stderr) as "<BENIGN|SDC|LENGTH>\t<target>\t<byte offset>".
+	#define KULFI_DIGEST_BLOCK_SIZE 4096
+	#define KULFI_MAX_OUTPUT_MONITORS 8
+	#define KULFI_SDC_EXIT_CODE 86
+	static const unsigned long long FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+	static const unsigned long long FNV_PRIME = 0x100000001b3ULL;
+
+	class OutputMonitor {
+	public:
+		char* target;
+		unsigned long long* golden; // One hash per block
+		unsigned long num_blocks;
+		unsigned long long golden_len;
+		unsigned long long offset;  // # of bytes seen so far
+		unsigned long long hash;    // Hash of the current (partial) block
+		unsigned block_fill;
+	};
+	static OutputMonitor g_output_monitors[KULFI_MAX_OUTPUT_MONITORS];
+	static int g_num_output_monitors = 0;
+	static OutputMonitor* g_stdout_monitor = NULL;
+	static char* g_outcome_path = NULL;
+	static bool g_outcome_written = false;
+
+	static void kulfiReportOutcome(const char* kind, const char* target,
+		unsigned long long offset) {
+		if(g_outcome_written) return;
+		g_outcome_written = true;
+		FILE* f = NULL;
+		if(g_outcome_path) f = fopen(g_outcome_path, "w");
+		if(!f) f = stderr;
+		fprintf(f, "%s\t%s\t%llu\n", kind, target, offset);
+		if(f != stderr) fclose(f);
+	}
+
+	// First differing block: stop the experiment right here.
+	static void kulfiOnOutputDiverged(OutputMonitor* mon, const char* kind,
+		unsigned long long offset) {
+		kulfiReportOutcome(kind, mon->target, offset);
+		fflush(stderr);
+		_exit(KULFI_SDC_EXIT_CODE);
+	}
+
+	static void kulfiFeedOutputMonitor(OutputMonitor* mon, const char* buf, size_t len) {
+		for(size_t i=0; i<len; i++) {
+			if(mon->offset >= mon->golden_len)
+				kulfiOnOutputDiverged(mon, "LENGTH", mon->golden_len);
+			mon->hash = (mon->hash ^ (unsigned char)(buf[i])) * FNV_PRIME;
+			mon->offset++;
+			mon->block_fill++;
+			if(mon->block_fill == KULFI_DIGEST_BLOCK_SIZE) {
+				unsigned long blk = (mon->offset - 1) / KULFI_DIGEST_BLOCK_SIZE;
+				if(mon->hash != mon->golden[blk])
+					kulfiOnOutputDiverged(mon, "SDC", (unsigned long long)blk * KULFI_DIGEST_BLOCK_SIZE);
+				mon->hash = FNV_OFFSET_BASIS;
+				mon->block_fill = 0;
+			}
+		}
+	}
+
+	static ssize_t kulfiOutputCookieWrite(void* cookie, const char* buf, size_t len) {
+		kulfiFeedOutputMonitor((OutputMonitor*)cookie, buf, len);
+		return len;
+	}
+
+	static int kulfiOutputCookieClose(void* cookie) {
+		return 0; // State is kept; the file may be re-opened in append mode
+	}
+
+	static FILE* kulfiOpenMonitorStream(OutputMonitor* mon) {
+		cookie_io_functions_t funcs;
+		memset(&funcs, 0, sizeof(funcs));
+		funcs.write = kulfiOutputCookieWrite;
+		funcs.close = kulfiOutputCookieClose;
+		FILE* f = fopencookie(mon, "w", funcs);
+		if(f) setvbuf(f, NULL, _IOFBF, KULFI_DIGEST_BLOCK_SIZE);
+		return f;
+	}
+
+	static bool kulfiReadDigest(OutputMonitor* mon, const char* path) {
+		FILE* f = fopen(path, "r");
+		if(!f) return false;
+		unsigned block_size = 0;
+		if(fscanf(f, "KULFI-DIGEST 1 %u %llu %lu", &block_size, &mon->golden_len,
+			&mon->num_blocks) != 3 || block_size != KULFI_DIGEST_BLOCK_SIZE ||
+			mon->num_blocks != (mon->golden_len + KULFI_DIGEST_BLOCK_SIZE - 1) / KULFI_DIGEST_BLOCK_SIZE) {
+			fclose(f);
+			return false;
+		}
+		mon->golden = (unsigned long long*)malloc(sizeof(unsigned long long) *
+			(mon->num_blocks + 1));
+		for(unsigned long i=0; i<mon->num_blocks; i++) {
+			if(fscanf(f, "%llx", &(mon->golden[i])) != 1) {
+				fclose(f);
+				return false;
+			}
+		}
+		fclose(f);
+		return true;
+	}
+
+	// Runs with no divergence are classified here. Streams the program left open
+	//   are only flushed after the atexit handlers, so flush them first.
+	static void kulfiFinishOutputMonitors() {
+		fflush(NULL);
+		for(int i=0; i<g_num_output_monitors; i++) {
+			OutputMonitor* mon = &(g_output_monitors[i]);
+			if(mon->offset != mon->golden_len) {
+				kulfiReportOutcome("LENGTH", mon->target, mon->offset);
+				return;
+			}
+			if(mon->block_fill > 0) {
+				unsigned long blk = mon->offset / KULFI_DIGEST_BLOCK_SIZE;
+				if(mon->hash != mon->golden[blk]) {
+					kulfiReportOutcome("SDC", mon->target,
+						(unsigned long long)blk * KULFI_DIGEST_BLOCK_SIZE);
+					return;
+				}
+			}
+		}
+		kulfiReportOutcome("BENIGN", "-", 0);
+	}
+
+	// Called by initializeFaultInjectionCampaign and by the constructors of the timer
+	//   and memory modes; a program built with the pass may run both, so only the
+	//   first call installs the monitors.
+	static void kulfiInstallOutputMonitors() {
+		static bool installed = false;
+		if(installed) return;
+		installed = true;
+		char* spec = getenv("KULFI_OUTPUT_MONITOR");
+		if(!spec) return;
+		char* outcome = getenv("KULFI_OUTCOME");
+		if(outcome) g_outcome_path = strdup(outcome);
+		spec = strdup(spec);
+		char* saveptr = NULL;
+		for(char* tok = strtok_r(spec, " ", &saveptr); tok != NULL;
+			tok = strtok_r(NULL, " ", &saveptr)) {
+			char* eq = strrchr(tok, '=');
+			if(!eq || g_num_output_monitors == KULFI_MAX_OUTPUT_MONITORS) {
+				fprintf(stderr, "[Output monitor] Ignoring \"%s\"\n", tok);
+				continue;
+			}
+			*eq = '\0';
+			OutputMonitor* mon = &(g_output_monitors[g_num_output_monitors]);
+			memset(mon, 0, sizeof(OutputMonitor));
+			mon->target = tok;
+			mon->hash = FNV_OFFSET_BASIS;
+			if(!kulfiReadDigest(mon, eq+1)) {
+				fprintf(stderr, "[Output monitor] Cannot read digest %s\n", eq+1);
+				exit(1);
+			}
+			g_num_output_monitors++;
+			printf("   Monitoring output %s against %s\n", tok, eq+1);
+			if(!strcmp(tok, "stdout")) g_stdout_monitor = mon;
+		}
+		if(g_stdout_monitor) {
+			fflush(stdout);
+			FILE* f = kulfiOpenMonitorStream(g_stdout_monitor);
+			if(f) {
+				g_real_stdout = stdout;
+				stdout = f;
+				// std::cout holds on to the real stdout; send it through the monitor
+				//   stream as well, which keeps it in order with printf.
+				static std::ios_base::Init ios_init;
+				std::cout.flush();
+				std::cout.rdbuf(new __gnu_cxx::stdio_sync_filebuf<char>(f));
+			}
+		}
+		atexit(kulfiFinishOutputMonitors);
+	}
+
+	static OutputMonitor* kulfiFindOutputMonitor(const char* path) {
+		for(int i=0; i<g_num_output_monitors; i++) {
+			if(!strcmp(g_output_monitors[i].target, path))
+				return &(g_output_monitors[i]);
+		}
+		return NULL;
+	}
+
+	// Writes to designated output files go to the monitor instead of the disk.
+	typedef FILE* (*fopen_t)(const char*, const char*);
+	static fopen_t kulfiRealFopen(const char* name) {
+		fopen_t real = (fopen_t)dlsym(RTLD_NEXT, name);
+		if(!real) real = (fopen_t)dlsym(RTLD_DEFAULT, name); // e.g. running under lli
+		return real;
+	}
+
+	FILE* fopen(const char* path, const char* mode) {
+		static fopen_t real_fopen = NULL;
+		if(g_num_output_monitors > 0 && (strchr(mode, 'w') || strchr(mode, 'a'))) {
+			OutputMonitor* mon = kulfiFindOutputMonitor(path);
+			if(mon) return kulfiOpenMonitorStream(mon);
+		}
+		if(!real_fopen) real_fopen = kulfiRealFopen("fopen");
+		assert(real_fopen && real_fopen != fopen);
+		return real_fopen(path, mode);
+	}
+
+	FILE* fopen64(const char* path, const char* mode) {
+		static fopen_t real_fopen64 = NULL;
+		if(g_num_output_monitors > 0 && (strchr(mode, 'w') || strchr(mode, 'a'))) {
+			OutputMonitor* mon = kulfiFindOutputMonitor(path);
+			if(mon) return kulfiOpenMonitorStream(mon);
+		}
+		if(!real_fopen64) real_fopen64 = kulfiRealFopen("fopen64");
+		assert(real_fopen64 && real_fopen64 != fopen64);
+		return real_fopen64(path, mode);
+	}
+
+	// Unbuffered writes to fd 1 bypass stdio.
+	ssize_t write(int fd, const void* buf, size_t len) {
+		if(fd == STDOUT_FILENO && g_stdout_monitor) {
+			kulfiFeedOutputMonitor(g_stdout_monitor, (const char*)buf, len);
+			return len;
+		}
+		return syscall(SYS_write, fd, buf, len);
+	}
+	
 	void initializeFaultInjectionCampaign(int ef, int tf) {
-		printf("[Fault Injection Campaign details]\n");
+		fprintf(kulfiStdout(), "[Fault Injection Campaign details]\n");
 		max_fault_interval = ((tf - 1) / ef) + 1;
-		printf("   Max interval: %d\n", max_fault_interval);
+		fprintf(kulfiStdout(), "   Max interval: %d\n", max_fault_interval);
 	
 		// Read the specified fault site from configuration file.
 		{
 			FILE* f = fopen("fault_injection.conf", "r");
 			if(f) {
-				printf("   Injection campaign configuration found.\n");
+				fprintf(kulfiStdout(), "   Injection campaign configuration found.\n");
 				ssize_t read;
 				size_t len = 0;
 				char* line = NULL;
@@ -274,7 +833,7 @@ extern "C" {
 				}
 				fclose(f);
 			} else {
-				printf("Reading configuration from environment variables.\n");
+				fprintf(kulfiStdout(), "Reading configuration from environment variables.\n");
 				// Read environment variables
 				char* nfcd = getenv("NEXT_FAULT_COUNTDOWN");
 				if(nfcd)
@@ -312,20 +871,21 @@ extern "C" {
 					assert(sscanf(enabled, "%d", &x)==1);
 					is_kulfi_enabled = (bool) x;
 					if(!is_kulfi_enabled) {
-						printf("Kulfi is disabled.\n");
+						fprintf(kulfiStdout(), "Kulfi is disabled.\n");
 					}
 				}
 			}
 			
-			printf("   Next fault CountDown = %ld\n", next_fault_countdown);
-			printf("   Should initialize randseed = %d\n", rand_flag);
+			fprintf(kulfiStdout(), "   Next fault CountDown = %ld\n", next_fault_countdown);
+			fprintf(kulfiStdout(), "   Should initialize randseed = %d\n", rand_flag);
 			if(enable_fault_site_hist) {
-				printf("   Will print fault site histogram to fault_site_histogram.txt\n");
+				fprintf(kulfiStdout(), "   Will print fault site histogram to fault_site_histogram.txt\n");
 				fault_site_hist = (unsigned*)(malloc(sizeof(unsigned) * curr_hist_size));
 				for(int i=0; i<curr_hist_size; i++) fault_site_hist[i] = 0;
 			}
-			printf("   Bit position for faults=%d\n", bit_position);
-			printf("   Dump BB Trace=%d\n", is_dump_bb_trace);
+			fprintf(kulfiStdout(), "   Bit position for faults=%d\n", bit_position);
+			fprintf(kulfiStdout(), "   Fault sites in manifest=%u\n", kulfiCountManifestSites());
+			fprintf(kulfiStdout(), "   Dump BB Trace=%d\n", is_dump_bb_trace);
 		}
 		
 		if(is_dump_bb_trace)
@@ -335,7 +895,7 @@ extern "C" {
 				int err;
 				err = sqlite3_open("basic_block_history.db", &g_bbhist_db);
 				if(err != SQLITE_OK) {
-					printf("Error: cannot open SQLite database.\n");
+					fprintf(kulfiStdout(), "Error: cannot open SQLite database.\n");
 					exit(1);
 				}
 				
@@ -345,7 +905,7 @@ extern "C" {
 					&drop_stmt, NULL);
 				err = sqlite3_step(drop_stmt);
 				if(err != SQLITE_DONE) {
-					printf("Error: error initializing DB (1)\n");
+					fprintf(kulfiStdout(), "Error: error initializing DB (1)\n");
 				}
 				sqlite3_finalize(drop_stmt);
 				
@@ -356,7 +916,7 @@ extern "C" {
 					&create_stmt, NULL);
 				err = sqlite3_step(create_stmt);
 				if(err != SQLITE_DONE) {
-					printf("Error: error initializing DB (2)\n");
+					fprintf(kulfiStdout(), "Error: error initializing DB (2)\n");
 				}
 				sqlite3_finalize(create_stmt);
 				
@@ -377,27 +937,56 @@ extern "C" {
 		}
 		
 		if(rand_flag) {
-			printf("   Initialized randomization seed.\n");
+			fprintf(kulfiStdout(), "   Initialized randomization seed.\n");
 			srand(time(0));
 		}
+
+		// Does nothing if the timer or memory mode already installed the monitors;
+		//   the messages above go to kulfiStdout() either way.
+		kulfiInstallOutputMonitors();
+		armFastPath();
+		kulfiApplyRankTarget();
 	}
 	
 	// This thing may be confusing
 	//   because 1 instruction can have 2 error sites
 	__attribute__((noinline))
 	void __printInstCount() {
-		printf("\n***********************************************************\n");
-		printf("\nTotal # of fault sites enumerated: %lu\n", fault_site_count);
-		printf("\n***********************************************************\n");
+		fprintf(kulfiStdout(), "\n***********************************************************\n");
+		fprintf(kulfiStdout(), "\nTotal # of fault sites enumerated: %lu\n", fault_site_count);
+		fprintf(kulfiStdout(), "\n***********************************************************\n");
 	}
 	
+	// Lane chosen by the last kulfi_vector_lane call, -1 once the cold path consumed it
+	static int vector_lane = -1;
+
+	// Called by the slow path of vector fault sites, right before the cold path of
+	//   the element in the lane it returns
+	int kulfi_vector_lane(const struct kulfi_site* site, int nlanes) {
+		vector_lane = rand() % nlanes;
+		return vector_lane;
+	}
+
 	void printFaultInfo(const char* error_type, unsigned bPos, int fault_index,
-		int ef, int tf) {
+		int ef, int tf, const struct kulfi_site* site, int lane) {
 		 fprintf(stderr, "\n/*********************************Start**************************************/");
 		 fprintf(stderr, "\nSucceffully injected %s!!", error_type);
 		 fprintf(stderr, "\nTotal # faults injected : %d",fault_injection_count);
 		 fprintf(stderr, "\nBit position is: %u",bPos);      
+		 if(lane >= 0)
+			fprintf(stderr, "\nVector lane is: %d",lane);
 		 fprintf(stderr, "\nIndex of the fault site : %d",fault_index);
+		 if(site) {
+			fprintf(stderr, "\nFunction / BasicBlock : %s / %s",site->func,site->bb);
+			const struct kulfi_module* module = site->config->module;
+			const struct kulfi_manifest_site* ms = NULL;
+			if(module) {
+				fprintf(stderr, "\nModule / local index : %08x / %d",module->hash,site->site_id);
+				ms = kulfi_find_manifest_site(module->hash, site->site_id, NULL);
+			}
+			if(ms && ms->line)
+				fprintf(stderr, "\nSource line : %u",ms->line);
+		 }
 		 fprintf(stderr, "\nUser defined probablity is: %d/%d",ef,tf);
 		 fprintf(stderr, "\nTotal # of fault sites enumerated: %lu\n", fault_site_count);
 		 fprintf(stderr, "\n/*********************************End**************************************/\n");
@@ -430,7 +1019,7 @@ extern "C" {
 				std::string x = itr->first;
 				unsigned long fs_count = itr->second;
 				fprintf(f, "%s\t%lu\n", x.c_str(), fs_count);
-				printf("%s\t%lu\n", x.c_str(), fs_count);
+				fprintf(kulfiStdout(), "%s\t%lu\n", x.c_str(), fs_count);
 			}
 		}
 		return 0;
@@ -438,6 +1027,8 @@ extern "C" {
 	
 	bool isNextFaultInThisBB() {
 		if(!is_kulfi_enabled) return false;
+		// Classified by incrementFaultSiteCount; pure (kulfi_rt.h), so no classifying here
+		if(thread_selector != TARGET_ALL_THREADS && is_target_thread <= 0) return false;
 		return (!curr_bb_no_fault);
 	}
 	
@@ -451,338 +1042,523 @@ extern "C" {
 		} else return 0;
 	}
 	
-	// Changed in order for PHINode to work
-	// (If there is no PHINode, it's legal to use an i32 where an i1 is required)
-	// but with PHINode, this has become illegal
+	extern "C++" {
+	// Flips bit <bPos> of the value as it is stored in memory (little endian),
+	//   so floats and long doubles are corrupted in their IEEE representation.
+	template <typename T>
+	static T flipBit(T value, unsigned bPos) {
+		unsigned char* p = (unsigned char*)(&value);
+		p[bPos / 8] ^= (unsigned char)(0x1 << (bPos % 8));
+		return value;
+	}
 
+	// The cold path of every fault site. NBits is the width that can be corrupted,
+	//   IsAdr selects the pointer or the data inject-once flag and InjectOnce is
+	//   the -ijo option of the fault pass, which selects the instance to call.
 	// Don't add to fault_site_count b/c they are already pre-added when entering a B.B.
-
-	bool corruptIntData_1bit(int fault_index, int inject_once, int ef, int tf, int byte_val, char inst_data) {
-		if(!is_kulfi_enabled) return (bool)inst_data;
-		unsigned int bPos;
+	// <site> is NULL when called through the old entry points.
+	template <typename T, unsigned NBits, bool IsAdr, bool InjectOnce>
+	static T corruptValue(int fault_index, int ef, int tf, const struct kulfi_site* site,
+		T inst_data, int* site_counter, const char* error_type) {
+		int lane = vector_lane;
+		vector_lane = -1;
+		if(!is_kulfi_enabled) return inst_data;
 		incrementFaultSiteHit(fault_index);
-//		fault_site_count++;
-		fault_site_intData1bit++;
-		if(inject_once == 1)
-			ijo_flag_data = 1;
-		if(ijo_flag_data == 1 && fault_injection_count>0)
+		(*site_counter)++;
+		int& ijo_flag = IsAdr ? ijo_flag_add : ijo_flag_data;
+		if(InjectOnce)
+			ijo_flag = 1;
+		if(ijo_flag == 1 && fault_injection_count>0)
 			return inst_data;
-		if(!shouldInject(ef, tf)) return inst_data;
-		if(bit_position == 0) {	
-			fault_injection_count++;
-			printFaultInfo("1-bit Int Data Error", bPos, fault_index, ef, tf);
-			if(inst_data) return false;
-			else return true;
-		} else {
-			printf("Fault not injected because the set bit position is > 0");
+
+		int inject = shouldInject(ef, tf);
+		armFastPath();
+		if(!inject) return inst_data;
+		if(memory_fault_at_site) {
+			memory_fault_at_site(site, fault_index, ef, tf);
 			return inst_data;
 		}
-	}
-	
-	char corruptIntData_8bit(int fault_index, int inject_once, int ef, int tf, int byte_val, char inst_data) {
-		if(!is_kulfi_enabled) return inst_data;
+
 		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);
-//		fault_site_count++;
-		fault_site_intData8bit++;
-		if(inject_once == 1)
-			ijo_flag_data=1;
-		if(ijo_flag_data == 1 && fault_injection_count>0)
+		// A 1-bit value is only corrupted when -b 0 is set (not by default)
+		if(NBits == 1 && bit_position != 0) {
+			fprintf(kulfiStdout(), "Fault not injected because the set bit position is > 0\n");
 			return inst_data;
-		if(!shouldInject(ef, tf)) return inst_data;
-		
+		}
 		if(bit_position == -1)
-			bPos = rand()%8;
-		else if(bit_position < 8 && bit_position >= 0)
-			bPos = bit_position;
-		else return inst_data;
-		
-		fault_injection_count++;
-		printFaultInfo("8-bit Int Data Error", bPos, fault_index, ef, tf);
-		return (char)((inst_data & 0xFF) ^ (0x1 << bPos));   
-	}
-	
-	short corruptIntData_16bit(int fault_index, int inject_once, int ef, int tf, int byte_val, short inst_data) {
-		if(!is_kulfi_enabled) return inst_data;
-		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);
-		int rp;
-//		fault_site_count++;
-		fault_site_intData16bit++;
-		if(inject_once == 1)
-			ijo_flag_data=1;
-		if(ijo_flag_data == 1 && fault_injection_count>0)
-			return inst_data;
-		
-		if(!shouldInject(ef, tf)) return inst_data;
-											 
-		if(bit_position == -1)                                       
-			bPos=rand() % 16;
-		else if(bit_position >= 0 && bit_position < 16)
+			bPos = rand() % NBits;
+		else if(bit_position >= 0 && bit_position < (int)NBits)
 			bPos = bit_position;
 		else
 			return inst_data;
-	
+
 		fault_injection_count++;
-		printFaultInfo("16-bit Int Data Error", bPos, fault_index, ef, tf);
-		return (short)((inst_data & 0xFFFF) ^ (0x1 << bPos));   
+		printFaultInfo(error_type, bPos, fault_index, ef, tf, site, lane);
+		return flipBit(inst_data, bPos);
 	}
-	
-	int corruptIntData_32bit(int fault_index, int inject_once, int ef, int tf, int byte_val, int inst_data) {
-		if(!is_kulfi_enabled) return inst_data;
-		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);
-		int rp;
-//		fault_site_count++;
-		fault_site_intData32bit++;
-		if(inject_once == 1)
-			ijo_flag_data=1;
-	
-		if(ijo_flag_data == 1 && fault_injection_count>0)
-			return inst_data;
-		 
-		if(!shouldInject(ef, tf)) return inst_data;
-		
-		if(bit_position == -1)
-			bPos = rand() % 32;
-		else if(bit_position >= 0 && bit_position < 32)
-			bPos = bit_position;
+	} // extern "C++"
+
+	// For each value type:
+	//   name         : old entry point, takes inject_once at run time
+	//   name##_ijo   : instance for -ijo 1, called from the fast path with the site descriptor
+	//   name##_multi : instance for -ijo 0, called from the fast path with the site descriptor
+	#define DEFINE_CORRUPT_FUNCTIONS(name, T, nbits, is_adr, counter, error_type) \
+		T name(int fault_index, int inject_once, int ef, int tf, int byte_val, T inst_data) { \
+			if(inject_once == 1) \
+				return corruptValue<T, nbits, is_adr, true>(fault_index, ef, tf, NULL, inst_data, &counter, error_type); \
+			return corruptValue<T, nbits, is_adr, false>(fault_index, ef, tf, NULL, inst_data, &counter, error_type); \
+		} \
+		__attribute__((noinline, cold)) \
+		T name##_ijo(const struct kulfi_site* site, T inst_data) { \
+			return corruptValue<T, nbits, is_adr, true>(kulfiGlobalSiteId(site), site->config->ef, \
+				site->config->tf, site, inst_data, &counter, error_type); \
+		} \
+		__attribute__((noinline, cold)) \
+		T name##_multi(const struct kulfi_site* site, T inst_data) { \
+			return corruptValue<T, nbits, is_adr, false>(kulfiGlobalSiteId(site), site->config->ef, \
+				site->config->tf, site, inst_data, &counter, error_type); \
+		}
+
+	// Machine register faults (src/tools/kulfi-llc): the site has already decremented
+	//   kulfi_mf_countdown past 0, which the IR fast path would not have done. Without
+	//   IR sites, no incrementFaultSiteCount classifies the thread, so it is done here.
+	//   The countdown is shared by the threads: when another thread reaches the due
+	//   fault, the sites get KULFI_MF_RETRY more (not taken off the countdown) before
+	//   the next try, instead of calling in here at every site until the target
+	//   thread gets there.
+	#define KULFI_MF_RETRY 4096
+	long long kulfi_mf_corrupt(int site_id, int width, long long value, void* pc) {
+		kulfi_mf_countdown++;
+		if(thread_selector != TARGET_ALL_THREADS && !kulfiIsTargetThread()) {
+			armFastPath(); // Takes the machine sites skipped so far off the countdown
+			if(kulfi_mf_countdown == 0) { // Due
+				kulfi_mf_countdown = KULFI_MF_RETRY;
+				kulfi_mf_armed = LLONG_MAX;
+			}
+			return value;
+		}
+		int injected = fault_injection_count;
+		if(width == 32)
+			value = (unsigned)corruptValue<int, 32, false, true>(site_id, 0, 0, NULL, (int)value,
+				&fault_site_intData32bit, "32-bit Machine Register Error");
 		else
-			return inst_data;
-		
-		fault_injection_count++;
-		printFaultInfo("32-bit Int Data Error", bPos, fault_index, ef, tf);
-		return (int)((inst_data & 0xFFFFFFFF) ^ (0x1 << bPos));   
+			value = corruptValue<long long, 64, false, true>(site_id, 0, 0, NULL, value,
+				&fault_site_intData64bit, "64-bit Machine Register Error");
+		if(fault_injection_count != injected)
+			fprintf(stderr, "Machine fault site %d, return address %p\n", site_id, pc);
+		return value;
 	}
-	
-	float corruptFloatData_32bit(int fault_index, int inject_once, int ef, int tf, int byte_val, float inst_data) {
-		if(!is_kulfi_enabled) return inst_data;
-		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);
-		int rp;
-//		fault_site_count++;
-		fault_site_float32bit++;
-		if(inject_once == 1)
-			ijo_flag_data=1;
-	
-		if(ijo_flag_data == 1 && fault_injection_count>0)
-			return inst_data;
-		 
-		if(!shouldInject(ef, tf)) return inst_data;
-	
-		if(bit_position == -1)
-			bPos = rand() % 32;
-		else if(bit_position >= 0 && bit_position < 32)
-			bPos = bit_position;
-		else
-			return inst_data;
-			
-		fault_injection_count++;
-		printFaultInfo("32-bit IEEE Float Data Error", bPos, fault_index, ef, tf);
-		return (float)((int)inst_data ^ (0x1 << bPos));   
+
+#if defined(__linux__)
+	// The CPU time timer of the timer and memory modes. KULFI_TIMER_SEED seeds the
+	//   expiry and the choices of the handler (default: time and pid).
+	static timer_t kulfi_cpu_timer;
+
+	static unsigned kulfiTimerSeed() {
+		char* seed_str = getenv("KULFI_TIMER_SEED");
+		unsigned seed = seed_str ? (unsigned)atol(seed_str) : (unsigned)(time(0) ^ getpid());
+		srand(seed);
+		return seed;
 	}
-	
-	long long corruptIntData_64bit(int fault_index, int inject_once, int ef, int tf,  int byte_val, long long inst_data) {
-		if(!is_kulfi_enabled) return inst_data;
-		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);
-		int rp;
-//		fault_site_count++;
-		fault_site_intData64bit++;
-		if(inject_once == 1)
-			 ijo_flag_data=1;
-	
-		if(ijo_flag_data == 1 && fault_injection_count>0)
-				 return inst_data;        
-		 
-		if(!shouldInject(ef, tf)) return inst_data;
-		
-		if(bit_position == -1)
-			bPos = rand() % 64;
-		else if(bit_position >= 0 && bit_position < 64)
-			bPos = bit_position;
-		else
-			return inst_data;
-		
-		fault_injection_count++;
-		printFaultInfo("64-bit Int Data Error", bPos, fault_index, ef, tf);
-		return inst_data ^ (0x1L << bPos);   
+
+	static void kulfiSetCpuTimer(long expiry_ms) {
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its)); // One shot
+		its.it_value.tv_sec = expiry_ms / 1000;
+		its.it_value.tv_nsec = (expiry_ms % 1000) * 1000000L;
+		timer_settime(kulfi_cpu_timer, 0, &its, NULL);
 	}
-	
-	double corruptFloatData_64bit(int fault_index, int inject_once, int ef, int tf,  int byte_val, double inst_data){
-		if(!is_kulfi_enabled) return inst_data;
-		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);
-		int rp;
-//		fault_site_count++;
-		fault_site_float64bit++;
-		if(inject_once == 1)
-			ijo_flag_data=1;
-	
-		if(ijo_flag_data == 1 && fault_injection_count>0)
-			return inst_data;        
-	
-		if(!shouldInject(ef, tf)) return inst_data;
-		
-		if(bit_position == -1)
-			bPos = rand() % 64;
-		else if(bit_position >= 0 && bit_position < 64)
-			bPos = bit_position;
-		else
-			return inst_data;
-		
-		fault_injection_count++;
-		printFaultInfo("64-bit IEEE Float Data Error", bPos, fault_index, ef, tf);
-		return (double)((long long)inst_data ^ (0x1L << bPos));   
+
+	// Reports of the SIGPROF handlers. The handler may interrupt the program inside
+	//   stdio, malloc or rand, so it only uses write(2), and every random choice
+	//   is made before the timer is armed.
+	static void kulfiSignalWrite(const char* str) {
+		ssize_t ret = write(STDERR_FILENO, str, strlen(str));
+		(void)ret;
 	}
-	
-	// THIS GUY IS SPECIAL.
-	long double corruptFloatData_80bit(int fault_index, int inject_once, int ef, int tf,  int byte_val, long double inst_data){
-		if(!is_kulfi_enabled) return inst_data;
-		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);
-		int rp;
-//		fault_site_count++;
-		fault_site_float80bit++;
-		if(inject_once == 1)
-			ijo_flag_data=1;
-	
-		if(ijo_flag_data == 1 && fault_injection_count>0)
-			return inst_data;        
-	
-		if(!shouldInject(ef, tf)) return inst_data;
-		
-		if(bit_position == -1)
-			bPos = rand() % 80;
-		else if(bit_position >= 0 && bit_position < 80)
-			bPos = bit_position;
-		else
-			return inst_data;
 
-		fault_injection_count++;
-		printFaultInfo("X86_FP80 80-bit IEEE Float Data Error", bPos, fault_index, ef, tf);
-		
-		int byte_pos = bit_position / 8;
-		int bit_in_byte = byte_pos - 8*byte_pos;
-		unsigned char mask = (0x1L << bit_in_byte);
-		unsigned char* p_instd = (unsigned char*)(&inst_data);
-		unsigned char newchar = mask ^ (p_instd[byte_pos]);
-		p_instd[byte_pos] = newchar;
-		
-		return inst_data;   
+	static void kulfiSignalWriteNum(unsigned long long v, bool hex) {
+		char buf[24];
+		int i = sizeof(buf);
+		unsigned base = hex ? 16 : 10;
+		do { buf[--i] = "0123456789abcdef"[v % base]; v /= base; } while(v);
+		if(hex) { buf[--i] = 'x'; buf[--i] = '0'; }
+		ssize_t ret = write(STDERR_FILENO, buf + i, sizeof(buf) - i);
+		(void)ret;
 	}
-	
-	int* corruptIntAdr_32bit(int fault_index, int inject_once, int ef, int tf,  int byte_val, int* inst_add){
-		if(!is_kulfi_enabled) return inst_add;
-		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);
-		int rp;
-//		fault_site_count++;
-		fault_site_adr++;
-		if(inject_once == 1)
-			ijo_flag_add=1;
-	
-		if(ijo_flag_add == 1 && fault_injection_count>0)
-			return inst_add;           
-	
-		if(!shouldInject(ef, tf)) return inst_add;
-	
-		if(bit_position == -1)
-			bPos = rand() % 64;
-		else if(bit_position >= 0 && bit_position < 64)
-			bPos = bit_position;
-		else
-			return inst_add;
-		
-		fault_injection_count++;
-	
-		printFaultInfo("Ptr32 Error", bPos, fault_index, ef, tf);
-		return (int *)((long long)inst_add ^ (0x1L << bPos));   
+
+	// The fields of printFaultInfo that make sense without a fault site
+	static void kulfiSignalReportFault(const char* error_type, const char* what, unsigned bPos) {
+		kulfiSignalWrite("\n/*********************************Start**************************************/");
+		kulfiSignalWrite("\nSucceffully injected ");
+		kulfiSignalWrite(error_type);
+		kulfiSignalWrite(" (");
+		kulfiSignalWrite(what);
+		kulfiSignalWrite(")!!\nTotal # faults injected : ");
+		kulfiSignalWriteNum(fault_injection_count, false);
+		kulfiSignalWrite("\nBit position is: ");
+		kulfiSignalWriteNum(bPos, false);
+		kulfiSignalWrite("\n/*********************************End**************************************/\n");
 	}
-	
-	long long* corruptIntAdr_64bit(int fault_index, int inject_once, int ef, int tf,  int byte_val, long long* inst_add){
-		if(!is_kulfi_enabled) return inst_add;
-		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);                
-		int rp;
-//		fault_site_count++;
-		fault_site_adr++;
-		if(inject_once == 1)
-			ijo_flag_add=1;
-	
-		if(ijo_flag_add == 1 && fault_injection_count>0)
-			return inst_add;           
-	
-		if(!shouldInject(ef, tf)) return inst_add;
-	
-		if(bit_position == -1)
-			bPos = rand() % 64;
-		else if(bit_position >= 0 && bit_position < 64)
-			bPos = bit_position;
-		else
-			return inst_add;
-		
+
+	// Runs <handler> on SIGPROF after <expiry_ms> ms of CPU time of the process
+	static void kulfiArmCpuTimer(long expiry_ms, void (*handler)(int, siginfo_t*, void*),
+		const char* mode) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = handler;
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGPROF, &sa, NULL);
+
+		struct sigevent sev;
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_notify = SIGEV_SIGNAL;
+		sev.sigev_signo = SIGPROF;
+		if(timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &kulfi_cpu_timer) != 0) {
+			fprintf(stderr, "[%s] timer_create failed\n", mode);
+			exit(1);
+		}
+		kulfiSetCpuTimer(expiry_ms);
+	}
+#endif
+
+	// Timer mode: no fault sites, the program runs uninstrumented (LD_PRELOAD) until a
+	//   CPU time timer expires, at a time drawn uniformly in [1, KULFI_TIMER_FAULT] ms.
+	//   The SIGPROF handler flips one bit of a register in the interrupted context:
+	//     KULFI_TIMER_REG  : rax .. r15, rip, xmm0 .. xmm15, "gpr", "xmm" or "any" (default)
+	//     KULFI_TIMER_SEED : seed of the time, register and bit (default: time and pid)
+	//     BIT_POSITION     : the bit, as for the fault sites (default: random)
+	//   The fault is reported like the others, and the output monitors classify the run.
+#if defined(__x86_64__) && defined(__linux__)
+	static const char* timer_gpr_names[] = {
+		"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+		"rdi", "rsi", "rbp", "rbx", "rdx", "rax", "rcx", "rsp", "rip"
+	};
+	static const int timer_num_gprs = 17;     // The order of REG_R8 .. REG_RIP in gregs
+	static const int timer_num_xmms = 16;
+	static int timer_reg = -1;                 // gregs index, or timer_num_gprs + xmm number
+	static unsigned timer_bit = 0;             // Drawn before the timer is armed
+	static char timer_reg_name[16];
+
+	static void kulfiTimerHandler(int sig, siginfo_t* info, void* ctx) {
+		ucontext_t* uc = (ucontext_t*)ctx;
+		if(timer_reg < timer_num_gprs) {
+			uc->uc_mcontext.gregs[timer_reg] ^= (greg_t)(1ULL << timer_bit);
+		} else {
+			if(!uc->uc_mcontext.fpregs) return;
+			int xmm = timer_reg - timer_num_gprs;
+			uc->uc_mcontext.fpregs->_xmm[xmm].element[timer_bit / 32] ^= (1U << (timer_bit % 32));
+		}
 		fault_injection_count++;
-	
-		printFaultInfo("Ptr64 Error", bPos, fault_index, ef, tf);
-		return (long long *)((long long)inst_add ^ (0x1L << bPos));   
+		kulfiSignalReportFault("Timer Register Error", timer_reg_name, timer_bit);
+		kulfiSignalWrite("Interrupted at ");
+		kulfiSignalWriteNum(uc->uc_mcontext.gregs[REG_RIP], true);
+		kulfiSignalWrite("\n");
 	}
-	
-	float* corruptFloatAdr_32bit(int fault_index, int inject_once, int ef, int tf,  int byte_val, float* inst_add){
-		if(!is_kulfi_enabled) return inst_add;
-		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);
-		int rp;
-//		fault_site_count++;
-		fault_site_adr++;
-		if(inject_once == 1)
-			ijo_flag_add=1;
-	
-		if(ijo_flag_add == 1 && fault_injection_count>0)
-			return inst_add;           
-	
-		if(!shouldInject(ef, tf)) return inst_add;
-		
-		if(bit_position == -1)
-			bPos = rand() % 64;
-		else if(bit_position >= 0 && bit_position < 64)
-			bPos = bit_position;
+
+	static int kulfiTimerParseReg(const char* reg) {
+		for(int i=0; i<timer_num_gprs; i++)
+			if(!strcmp(reg, timer_gpr_names[i])) return i;
+		int xmm;
+		if(sscanf(reg, "xmm%d", &xmm) == 1 && xmm >= 0 && xmm < timer_num_xmms)
+			return timer_num_gprs + xmm;
+		if(!strcmp(reg, "gpr")) return rand() % 16; // Not rip
+		if(!strcmp(reg, "xmm")) return timer_num_gprs + rand() % timer_num_xmms;
+		if(!strcmp(reg, "any")) {
+			int r = rand() % (16 + timer_num_xmms);
+			return (r < 16) ? r : (timer_num_gprs + r - 16);
+		}
+		return -1;
+	}
+
+	__attribute__((constructor))
+	static void kulfiStartTimerMode() {
+		char* max_ms_str = getenv("KULFI_TIMER_FAULT");
+		if(!max_ms_str) return;
+		long max_ms = atol(max_ms_str);
+		unsigned seed = kulfiTimerSeed();
+		char* reg = getenv("KULFI_TIMER_REG");
+		timer_reg = kulfiTimerParseReg(reg ? reg : "any");
+		if(max_ms <= 0 || timer_reg < 0) {
+			fprintf(stderr, "[Timer mode] KULFI_TIMER_FAULT=%s KULFI_TIMER_REG=%s: invalid\n",
+				max_ms_str, reg ? reg : "any");
+			exit(1);
+		}
+		unsigned width = (timer_reg < timer_num_gprs) ? 64 : 128;
+		char* bit = getenv("BIT_POSITION");
+		timer_bit = bit ? ((unsigned)atoi(bit) % width) : (rand() % width);
+		if(timer_reg < timer_num_gprs)
+			snprintf(timer_reg_name, sizeof(timer_reg_name), "%s", timer_gpr_names[timer_reg]);
 		else
-			return inst_add;
-		
+			snprintf(timer_reg_name, sizeof(timer_reg_name), "xmm%d", timer_reg - timer_num_gprs);
+		long expiry_ms = 1 + rand() % max_ms;
+		fprintf(stderr, "[Timer mode] Seed %u, fault after %ld ms of CPU time\n", seed, expiry_ms);
+		kulfiInstallOutputMonitors();
+		kulfiArmCpuTimer(expiry_ms, kulfiTimerHandler, "Timer mode");
+	}
+#endif
+
+	// Memory mode: a bit of a live word of memory is flipped, like an upset in DRAM.
+	//   The words are those of the heap blocks (malloc, calloc and realloc, from the
+	//   start of the program) and of the globals the fault pass lists in the
+	//   "kulfi_globals" section, next to the manifest. Loads and stores are not
+	//   instrumented; the fault is injected
+	//     KULFI_MEM_FAULT=site : at the fault site the countdown selects (the word is
+	//                            corrupted instead of the site's value)
+	//     KULFI_MEM_FAULT=<ms> : when a CPU time timer expires, at a time drawn uniformly
+	//                            in [1, <ms>] ms (see timer mode; also with LD_PRELOAD)
+	//   The word is chosen uniformly among all live words, BIT_POSITION selects the bit.
+#if defined(__linux__) && defined(__GLIBC__)
+	extern void* __libc_malloc(size_t size);
+	extern void* __libc_calloc(size_t n, size_t size);
+	extern void* __libc_realloc(void* ptr, size_t size);
+	extern void __libc_free(void* ptr);
+
+	extern const struct kulfi_global __start_kulfi_globals[] __attribute__((weak));
+	extern const struct kulfi_global __stop_kulfi_globals[] __attribute__((weak));
+
+	// Live heap blocks: open addressing on the block address, in mmap'ed memory so
+	//   that the table itself does not go through malloc
+	struct HeapBlock { void* ptr; size_t size; };
+	static void* const DELETED_BLOCK = (void*)1;
+	static HeapBlock* heap_blocks = NULL;
+	static size_t heap_capacity = 0, heap_used = 0, heap_live = 0;
+	static volatile int heap_lock = 0;
+	static bool is_mem_tracking = false;
+
+	static void kulfiHeapLock() { while(__sync_lock_test_and_set(&heap_lock, 1)) ; }
+	static void kulfiHeapUnlock() { __sync_lock_release(&heap_lock); }
+
+	static size_t kulfiHeapSlot(void* ptr) {
+		return (((size_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL) & (heap_capacity - 1);
+	}
+
+	static void kulfiHeapInsert(void* ptr, size_t size);
+
+	static void kulfiHeapGrow() {
+		HeapBlock* old = heap_blocks;
+		size_t old_capacity = heap_capacity;
+		heap_capacity = old_capacity ? (old_capacity * 2) : 4096;
+		heap_blocks = (HeapBlock*)mmap(NULL, heap_capacity * sizeof(HeapBlock),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		assert(heap_blocks != MAP_FAILED);
+		heap_used = heap_live = 0;
+		for(size_t i=0; i<old_capacity; i++) {
+			if(old[i].ptr && old[i].ptr != DELETED_BLOCK)
+				kulfiHeapInsert(old[i].ptr, old[i].size);
+		}
+		if(old) munmap(old, old_capacity * sizeof(HeapBlock));
+	}
+
+	static void kulfiHeapInsert(void* ptr, size_t size) {
+		if(2 * (heap_used + 1) > heap_capacity) kulfiHeapGrow();
+		size_t i = kulfiHeapSlot(ptr);
+		while(heap_blocks[i].ptr && heap_blocks[i].ptr != DELETED_BLOCK)
+			i = (i + 1) & (heap_capacity - 1);
+		if(!heap_blocks[i].ptr) heap_used++;
+		heap_blocks[i].ptr = ptr;
+		heap_blocks[i].size = size;
+		heap_live++;
+	}
+
+	static void kulfiHeapRemove(void* ptr) {
+		if(!heap_capacity) return;
+		for(size_t i = kulfiHeapSlot(ptr); heap_blocks[i].ptr; i = (i + 1) & (heap_capacity - 1)) {
+			if(heap_blocks[i].ptr == ptr) {
+				heap_blocks[i].ptr = DELETED_BLOCK;
+				heap_live--;
+				return;
+			}
+		}
+	}
+
+	static void kulfiTrackBlock(void* old_ptr, void* new_ptr, size_t size) {
+		kulfiHeapLock();
+		if(old_ptr) kulfiHeapRemove(old_ptr);
+		if(new_ptr) kulfiHeapInsert(new_ptr, size);
+		kulfiHeapUnlock();
+	}
+
+	void* malloc(size_t size) {
+		void* p = __libc_malloc(size);
+		if(is_mem_tracking) kulfiTrackBlock(NULL, p, size);
+		return p;
+	}
+
+	void* calloc(size_t n, size_t size) {
+		void* p = __libc_calloc(n, size);
+		if(is_mem_tracking) kulfiTrackBlock(NULL, p, n * size);
+		return p;
+	}
+
+	void* realloc(void* ptr, size_t size) {
+		void* p = __libc_realloc(ptr, size);
+		if(is_mem_tracking && (p || !size)) kulfiTrackBlock(ptr, p, size);
+		return p;
+	}
+
+	void free(void* ptr) {
+		if(is_mem_tracking && ptr) kulfiTrackBlock(ptr, NULL, 0);
+		__libc_free(ptr);
+	}
+
+	// Random numbers of memory mode, which may be drawn in the SIGPROF handler, where
+	//   rand() could deadlock (xorshift64*, seeded by kulfiStartMemoryMode)
+	static unsigned long long mem_rng_state = 0x9e3779b97f4a7c15ULL;
+
+	static unsigned long long kulfiMemoryRandom() {
+		mem_rng_state ^= mem_rng_state >> 12;
+		mem_rng_state ^= mem_rng_state << 25;
+		mem_rng_state ^= mem_rng_state >> 27;
+		return mem_rng_state * 2685821657736338717ULL;
+	}
+
+	struct MemoryFault {
+		long* word;
+		char* block;         // The global or heap block of the word
+		size_t block_size;
+		const char* name;    // Of the global, NULL for the heap
+		unsigned bPos;
+	};
+
+	// Flips a bit of a word chosen uniformly among the live words; false if there
+	//   is none. The caller holds the heap lock. Signal safe, the caller reports.
+	static bool kulfiFlipMemoryWord(MemoryFault& mf) {
+		unsigned long long num_words = 0;
+		for(const struct kulfi_global* g = __start_kulfi_globals; g && g < __stop_kulfi_globals; g++)
+			num_words += g->size / sizeof(long);
+		for(size_t i=0; i<heap_capacity; i++) {
+			if(heap_blocks[i].ptr && heap_blocks[i].ptr != DELETED_BLOCK)
+				num_words += heap_blocks[i].size / sizeof(long);
+		}
+		if(num_words == 0) return false;
+		unsigned long long w = kulfiMemoryRandom() % num_words;
+		mf.name = NULL;
+		mf.block = NULL;
+		mf.block_size = 0;
+		for(const struct kulfi_global* g = __start_kulfi_globals; g && g < __stop_kulfi_globals; g++) {
+			if(w < g->size / sizeof(long)) {
+				mf.block = (char*)g->addr; mf.block_size = g->size; mf.name = g->name;
+				break;
+			}
+			w -= g->size / sizeof(long);
+		}
+		for(size_t i=0; !mf.block && i<heap_capacity; i++) {
+			if(!heap_blocks[i].ptr || heap_blocks[i].ptr == DELETED_BLOCK) continue;
+			if(w < heap_blocks[i].size / sizeof(long)) {
+				mf.block = (char*)heap_blocks[i].ptr; mf.block_size = heap_blocks[i].size;
+				break;
+			}
+			w -= heap_blocks[i].size / sizeof(long);
+		}
+		mf.word = (long*)(mf.block + w * sizeof(long));
+		mf.bPos = (bit_position >= 0 && bit_position < (int)(8 * sizeof(long))) ?
+			bit_position : (kulfiMemoryRandom() % (8 * sizeof(long)));
+		*mf.word ^= (1L << mf.bPos);
 		fault_injection_count++;
-	
-		printFaultInfo("Float Addr32 Error", bPos, fault_index, ef, tf);
-		return (float *)((long long)inst_add ^ (0x1L << (bPos)));   
+		return true;
 	}
-	
-	double* corruptFloatAdr_64bit(int fault_index, int inject_once, int ef, int tf,  int byte_val, double* inst_add){
-		if(!is_kulfi_enabled) return inst_add;
-		unsigned int bPos;
-		incrementFaultSiteHit(fault_index);
-		int rp;
-//		fault_site_count++;
-		fault_site_adr++;
+
+	static void kulfiMemoryFaultAtSite(const struct kulfi_site* site, int fault_index,
+		int ef, int tf) {
+		MemoryFault mf;
+		kulfiHeapLock();
+		bool injected = kulfiFlipMemoryWord(mf);
+		kulfiHeapUnlock();
+		if(!injected) {
+			fprintf(stderr, "[Memory mode] No live words, no fault injected\n");
+			return;
+		}
+		printFaultInfo(mf.name ? "Memory Word Error (global)" : "Memory Word Error (heap)",
+			mf.bPos, fault_index, ef, tf, site, -1);
+		fprintf(stderr, "Word at %p, offset %lu of %s at %p (%lu bytes)\n", (void*)mf.word,
+			(unsigned long)((char*)mf.word - mf.block), mf.name ? mf.name : "the block",
+			(void*)mf.block, (unsigned long)mf.block_size);
+	}
+
+	// The timer may interrupt malloc or free: if they hold the lock, retry 1 ms later
+	static void kulfiMemoryTimerHandler(int sig, siginfo_t* info, void* ctx) {
+		if(__sync_lock_test_and_set(&heap_lock, 1)) {
+			kulfiSetCpuTimer(1);
+			return;
+		}
+		MemoryFault mf;
+		bool injected = kulfiFlipMemoryWord(mf);
+		kulfiHeapUnlock();
+		if(!injected) {
+			kulfiSignalWrite("[Memory mode] No live words, no fault injected\n");
+			return;
+		}
+		kulfiSignalReportFault("Memory Word Error", mf.name ? "global" : "heap", mf.bPos);
+		kulfiSignalWrite("Word at ");
+		kulfiSignalWriteNum((unsigned long long)mf.word, true);
+		kulfiSignalWrite(", offset ");
+		kulfiSignalWriteNum((char*)mf.word - mf.block, false);
+		kulfiSignalWrite(" of ");
+		kulfiSignalWrite(mf.name ? mf.name : "the block");
+		kulfiSignalWrite(" at ");
+		kulfiSignalWriteNum((unsigned long long)mf.block, true);
+		kulfiSignalWrite(" (");
+		kulfiSignalWriteNum(mf.block_size, false);
+		kulfiSignalWrite(" bytes)\n");
+	}
+
+	__attribute__((constructor))
+	static void kulfiStartMemoryMode() {
+		char* mode = getenv("KULFI_MEM_FAULT");
+		if(!mode) return;
+		if(getenv("KULFI_TIMER_FAULT")) {
+			fprintf(stderr, "[Memory mode] KULFI_MEM_FAULT and KULFI_TIMER_FAULT are exclusive\n");
+			exit(1);
+		}
+		char* bit = getenv("BIT_POSITION");
+		if(bit) bit_position = atoi(bit);
+		is_mem_tracking = true;
+		unsigned seed = kulfiTimerSeed();
+		mem_rng_state ^= ((unsigned long long)seed << 32) | seed;
+		if(!strcmp(mode, "site")) {
+			memory_fault_at_site = kulfiMemoryFaultAtSite;
+			return;
+		}
+		long max_ms = atol(mode);
+		if(max_ms <= 0) {
+			fprintf(stderr, "[Memory mode] KULFI_MEM_FAULT=%s: invalid\n", mode);
+			exit(1);
+		}
+		long expiry_ms = 1 + rand() % max_ms;
+		fprintf(stderr, "[Memory mode] Seed %u, fault after %ld ms of CPU time\n", seed, expiry_ms);
+		kulfiInstallOutputMonitors();
+		kulfiArmCpuTimer(expiry_ms, kulfiMemoryTimerHandler, "Memory mode");
+	}
+#endif
+
+	// Changed in order for PHINode to work
+	// (If there is no PHINode, it's legal to use an i32 where an i1 is required)
+	// but with PHINode, this has become illegal
+	bool corruptIntData_1bit(int fault_index, int inject_once, int ef, int tf, int byte_val, char inst_data) {
 		if(inject_once == 1)
-			ijo_flag_add=1;
-	
-		if(ijo_flag_add == 1 && fault_injection_count>0)
-			return inst_add;           
-	
-		if(!shouldInject(ef, tf)) return inst_add;
-		
-		if(bit_position == -1)
-			bPos = rand() % 64;
-		else if(bit_position >= 0 && bit_position < 64)
-			bPos = bit_position;
-		else
-			return inst_add;
-		
-		fault_injection_count++;
-		printFaultInfo("Float Addr64 Error", bPos, fault_index, ef, tf);
-		return (double *)((long long)inst_add ^ (0x1L << bPos));   
+			return (bool)corruptValue<char, 1, false, true>(fault_index, ef, tf, NULL, inst_data,
+				&fault_site_intData1bit, "1-bit Int Data Error");
+		return (bool)corruptValue<char, 1, false, false>(fault_index, ef, tf, NULL, inst_data,
+			&fault_site_intData1bit, "1-bit Int Data Error");
 	}
 
+	DEFINE_CORRUPT_FUNCTIONS(corruptIntData_8bit,    char,        8,  false, fault_site_intData8bit,  "8-bit Int Data Error")
+	DEFINE_CORRUPT_FUNCTIONS(corruptIntData_16bit,   short,       16, false, fault_site_intData16bit, "16-bit Int Data Error")
+	DEFINE_CORRUPT_FUNCTIONS(corruptIntData_32bit,   int,         32, false, fault_site_intData32bit, "32-bit Int Data Error")
+	DEFINE_CORRUPT_FUNCTIONS(corruptIntData_64bit,   long long,   64, false, fault_site_intData64bit, "64-bit Int Data Error")
+	DEFINE_CORRUPT_FUNCTIONS(corruptFloatData_32bit, float,       32, false, fault_site_float32bit,   "32-bit IEEE Float Data Error")
+	DEFINE_CORRUPT_FUNCTIONS(corruptFloatData_64bit, double,      64, false, fault_site_float64bit,   "64-bit IEEE Float Data Error")
+	// THIS GUY IS SPECIAL. Only the 80 bits of the x87 register are corrupted, not the padding.
+	DEFINE_CORRUPT_FUNCTIONS(corruptFloatData_80bit, long double, 80, false, fault_site_float80bit,   "X86_FP80 80-bit IEEE Float Data Error")
+
+	// Pointers are 64 bits wide, whatever they point to
+	DEFINE_CORRUPT_FUNCTIONS(corruptIntAdr_32bit,    int*,        64, true,  fault_site_adr, "Ptr32 Error")
+	DEFINE_CORRUPT_FUNCTIONS(corruptIntAdr_64bit,    long long*,  64, true,  fault_site_adr, "Ptr64 Error")
+	DEFINE_CORRUPT_FUNCTIONS(corruptFloatAdr_32bit,  float*,      64, true,  fault_site_adr, "Float Addr32 Error")
+	DEFINE_CORRUPT_FUNCTIONS(corruptFloatAdr_64bit,  double*,     64, true,  fault_site_adr, "Float Addr64 Error")
+
 #ifdef __cplusplus
 }
 #endif
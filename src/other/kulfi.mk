@@ -0,0 +1,61 @@
+# Pattern rules to instrument a program one translation unit at a time
+#
+# Each source file is compiled to bitcode, run through the fault pass and
+# compiled to an object on its own, so make -j instruments the files in
+# parallel and only the files that changed are instrumented again. Fault
+# site IDs are local to each file; the runtime makes them global when the
+# program starts (see kulfi_register_module in kulfi_rt.h).
+#
+# Usage, in the program's Makefile:
+#   KULFI_PASS = <path-to-faults.so>/faults.so
+#   KULFI_OPTS = -dynfault -ef 10 -tf 100
+#   include <path-to-KULFI>/src/other/kulfi.mk
+#
+#   prog-corrupt: main.kulfi.o util.kulfi.o $(KULFI_RT_LIB)
+#   	$(KULFI_LINK) $(filter %.o,$^) -o $@ $(KULFI_LIBS)
+#
+# Do not llvm-link the files together (or with the runtime) first. KULFI_LIBS
+# names libkulfi_rt.a by path; -lkulfi_rt would pick libkulfi_rt.so.
+#
+# To instrument inside clang's own -O3 pipeline instead of running opt on
+# -O1 bitcode, use the .kulfi-ep.o objects; KULFI_EP is the point of the
+# pipeline (see -kulfi-ep) and KULFI_EP_OPTS the pass options:
+#   KULFI_EP_OPTS = -ef=10 -tf=100
+#   prog-corrupt: main.kulfi-ep.o util.kulfi-ep.o $(KULFI_RT_LIB)
+#   	$(KULFI_LINK) $(filter %.o,$^) -o $@ $(KULFI_LIBS)
+
+KULFI_RT_DIR := $(patsubst %/,%,$(dir $(lastword $(MAKEFILE_LIST))))
+KULFI_PASS ?= faults.so
+KULFI_OPTS ?= -dynfault
+KULFI_CFLAGS ?= -O1
+KULFI_LINK ?= clang++
+KULFI_EP ?= optimizer-last
+KULFI_EP_CFLAGS ?= -O3
+KULFI_EP_OPTS ?=
+KULFI_EP_FLAGS = -Xclang -load -Xclang $(KULFI_PASS) -mllvm -kulfi-ep=$(KULFI_EP) \
+	$(addprefix -mllvm ,$(KULFI_EP_OPTS))
+KULFI_RT_LIB = $(KULFI_RT_DIR)/libkulfi_rt.a
+KULFI_LIBS = $(KULFI_RT_LIB) -lsqlite3 -ldl -lrt
+
+%.bc: %.c
+	clang $(KULFI_CFLAGS) $(CPPFLAGS) -emit-llvm -c $< -o $@
+
+%.bc: %.cpp
+	clang++ $(KULFI_CFLAGS) $(CPPFLAGS) -emit-llvm -c $< -o $@
+
+%.kulfi.bc: %.bc $(KULFI_PASS)
+	opt -load $(KULFI_PASS) $(KULFI_OPTS) < $< > $@
+
+%.kulfi.o: %.kulfi.bc
+	llc -O2 -filetype=obj $< -o $@
+
+%.kulfi-ep.o: %.c $(KULFI_PASS)
+	clang $(KULFI_EP_CFLAGS) $(CPPFLAGS) $(KULFI_EP_FLAGS) -c $< -o $@
+
+%.kulfi-ep.o: %.cpp $(KULFI_PASS)
+	clang++ $(KULFI_EP_CFLAGS) $(CPPFLAGS) $(KULFI_EP_FLAGS) -c $< -o $@
+
+$(KULFI_RT_LIB):
+	$(MAKE) -C $(KULFI_RT_DIR) libkulfi_rt.a
+
+.PRECIOUS: %.bc %.kulfi.bc
@@ -1,35 +1,34 @@
 import os,sys,random,shlex
-def printstats(numseg,numbenign,numoob,numsdc,i):
-	falseop = open("faulty_"+sys.argv[1]+"/"+str(i)+".out",'r') # faulty .out file
-	trueop= open("actual_"+sys.argv[1]+"/"+str(i)+".out",'r') # actual .out file
+# Golden output digest: FNV-1a hash of every 4 KiB block, read by the
+# output monitor of the runtime (KULFI_OUTPUT_MONITOR)
+def writedigest(outfile,digestfile):
+	data=bytearray(open(outfile,'rb').read())
+	hashes=[]
+	for start in range(0,len(data),4096):
+		h=0xcbf29ce484222325
+		for c in data[start:start+4096]:
+			h=((h^c)*0x100000001b3) & 0xffffffffffffffff
+		hashes.append(h)
+	d=open(digestfile,'w')
+	d.write("KULFI-DIGEST 1 4096 "+str(len(data))+" "+str(len(hashes))+"\n")
+	for h in hashes:
+		d.write("%016x\n" % h)
+	d.close()
 
-	line=trueop.readline()
-	s = shlex.split(line)
-	for i in range(len(s)):
-		s[i]=int(s[i])
-	line1=falseop.readline()
-	if(not line1):
+# Outcome record written by the runtime: "<BENIGN|SDC|LENGTH>\t<target>\t<offset>"
+def readoutcome(numseg,numbenign,numoob,numsdc,i):
+	outcome="faulty_"+sys.argv[1]+"/"+str(i)+".outcome"
+	if(not os.path.exists(outcome)):
 		numseg+=1
 		return numseg,numbenign,numoob,numsdc
+	kind=open(outcome,'r').readline().split("\t")[0]
+	if(kind=="BENIGN"):
+		numbenign+=1
+	elif(kind=="SDC"):
+		numsdc+=1
 	else:
-		t=[]    
-		t = shlex.split(line1)
-		for i in range(len(t)):
-			t[i]=int(t[i])
-		if(len(s)==len(t)):
-			flag=0
-			for d in range(len(s)):
-				if(t[d]!=s[d]):
-					numsdc+=1
-					return numseg,numbenign,numoob,numsdc
-		else:
-			numoob+=1
-			return numseg,numbenign,numoob,numsdc
-
-	numbenign+=1
+		numoob+=1
 	return numseg,numbenign,numoob,numsdc
-	falseop.close()
-	trueop.close()
 
 def geninput(size):
 	f=open('tempinput.txt','w')
@@ -52,6 +51,7 @@ if __name__=="__main__":
 		os.system("rm *.bc *.txt");
 		os.system("rm -rf faulty_*");
 		os.system("rm -rf actual_*");
+		os.system("rm -rf .kulfi_cache");
                 sys.exit()
 
 	if(len(sys.argv) !=9 or (len(sys.argv)==2 and sys.argv[1]=="--help")):
@@ -95,17 +95,21 @@ if __name__=="__main__":
 
 	os.system("clang -O1 -emit-llvm "+sys.argv[1]+".c -c -o "+sys.argv[1]+".bc")
 	
-	if(not os.path.exists("Corrupt.c")):
-		print("Corrupt.c Not found")
+	# libkulfi_rt is built from the Corrupt.cpp next to this script
+	rtdir=os.path.dirname(os.path.realpath(__file__))
+	if(not os.path.exists(rtdir+"/Corrupt.cpp")):
+		print("Corrupt.cpp Not found")
 		sys.exit()
-
-	os.system("clang -O1 -emit-llvm Corrupt.c -c -o Corrupt.bc")
-	os.system("llvm-link Corrupt.bc "+sys.argv[1]+".bc -o linked.bc")
 	
+	# Native executables, built once and cached under .kulfi_cache
+	sys.path.insert(0,rtdir)
+	import kulfi_build
 	if(injecttype):
-		os.system("opt -load ./faults.so -dynfault -ef "+str(ef)+" -tf "+str(tf)+" -pe "+str(pointerror)+" -de "+str(dataerror)+" -b 0 -ijo "+str(injectonce)+" <linked.bc> final.bc")
+		passopts="-dynfault -ef "+str(ef)+" -tf "+str(tf)+" -pe "+str(pointerror)+" -de "+str(dataerror)+" -b 0 -ijo "+str(injectonce)
 	else:
-		os.system("opt -load ./faults.so -staticfault -ef "+str(ef)+" -tf "+str(tf)+ "-pe "+str(pointerror)+" -de "+str(dataerror)+" -b 0 -ijo "+str(injectonce)+" <linked.bc> final.bc")
+		passopts="-staticfault -ef "+str(ef)+" -tf "+str(tf)+" -pe "+str(pointerror)+" -de "+str(dataerror)+" -b 0 -ijo "+str(injectonce)
+	faultyexe=kulfi_build.instrumented(sys.argv[1]+".bc","./faults.so",passopts,rtdir,".kulfi_cache")
+	goldenexe=kulfi_build.golden(sys.argv[1]+".bc",".kulfi_cache")
 
 	stats=open("stats.txt","w")
 	segiters=open("segiter.txt","w")
@@ -116,8 +120,11 @@ if __name__=="__main__":
 		size=random.randint(2000,10000)
 		geninput(size)
 		print("-----------Iteration Number: "+str(i)+"--------------")
-		os.system("lli "+sys.argv[1]+".bc tempinput.txt actual_"+sys.argv[1]+"/"+str(i)+".out")
-		s=os.system("timeout 10 lli final.bc tempinput.txt faulty_"+sys.argv[1]+"/"+str(i)+".out")
+		actual="actual_"+sys.argv[1]+"/"+str(i)+".out"
+		faulty="faulty_"+sys.argv[1]+"/"+str(i)+".out"
+		os.system(goldenexe+" tempinput.txt "+actual)
+		writedigest(actual,actual+".digest")
+		s=os.system("KULFI_OUTPUT_MONITOR='"+faulty+"="+actual+".digest' KULFI_OUTCOME=faulty_"+sys.argv[1]+"/"+str(i)+".outcome timeout 10 "+faultyexe+" tempinput.txt "+faulty)
 
 		if(s == 35584):
 			numseg+=1
@@ -128,7 +135,7 @@ if __name__=="__main__":
 			hangiters.write(str(i)+"\n")
 			continue
 		else:
-			numseg,numbenign,numoob,numsdc=printstats(numseg,numbenign,numoob,numsdc,i)
+			numseg,numbenign,numoob,numsdc=readoutcome(numseg,numbenign,numoob,numsdc,i)
 
 	stats.write("Segmentation Faults: "+str(numseg)+" Benign Faults: "+str(numbenign)+" Out of Bounds: "+str(numoob)+" SDC: "+str(numsdc))
 			
@@ -0,0 +1,80 @@
+# Builds native executables from the golden and the instrumented bitcode
+# with llc and the system linker, so that experiments do not pay for JIT
+# compilation on every run.
+#
+# Results are cached in <cachedir>/<key>/, where <key> is the SHA-1 of the
+# inputs. The instrumented bitcode only depends on the input bitcode, the fault
+# pass and the pass options (the pass output is deterministic), and the
+# executable on that bitcode and the runtime library. Re-running a campaign
+# with unchanged inputs reuses what is already built, and rebuilding the
+# runtime does not run the pass again.
+import os,sys,hashlib,shutil
+
+# Dependencies of the runtime library (libkulfi_rt.a, built from Corrupt.cpp)
+RTLIBS="-lsqlite3 -ldl -lrt"
+
+def cachekey(paths,extra):
+	h=hashlib.sha1()
+	for p in paths:
+		f=open(p,'rb')
+		h.update(f.read())
+		f.close()
+	h.update(extra.encode('utf-8'))
+	return h.hexdigest()
+
+def runcmd(cmd):
+	print(cmd)
+	if(os.system(cmd)!=0):
+		print("Command failed: "+cmd)
+		sys.exit(1)
+
+# Returns the cached file <name> for <key>, building it with build(workdir, path)
+# if it does not exist yet. The entry only appears once it is complete.
+def cached(cachedir,key,build,name="prog"):
+	entry=os.path.join(cachedir,key)
+	out=os.path.join(entry,name)
+	if(os.path.exists(out)):
+		print("Using cached "+out)
+		return out
+	workdir=entry+".tmp"
+	if(os.path.exists(workdir)):
+		shutil.rmtree(workdir)
+	os.makedirs(workdir)
+	build(workdir,os.path.join(workdir,name))
+	if(os.path.exists(entry)):
+		shutil.rmtree(entry)
+	os.rename(workdir,entry)
+	return out
+
+# Builds libkulfi_rt.a in <rtdir> (src/other) if it is out of date
+def buildruntime(rtdir):
+	runcmd("make -s -C "+rtdir+" libkulfi_rt.a")
+	return os.path.join(rtdir,"libkulfi_rt.a")
+
+def compilebc(bcfile,workdir,exe,libs):
+	obj=os.path.join(workdir,"prog.o")
+	runcmd("llc -O2 -filetype=obj "+bcfile+" -o "+obj)
+	runcmd("clang++ "+obj+" -o "+exe+" "+libs)
+
+# Uninstrumented program
+def golden(bcfile,cachedir):
+	def build(workdir,exe):
+		compilebc(bcfile,workdir,exe,"")
+	return cached(cachedir,cachekey([bcfile],"golden"),build)
+
+# <bcfile> is the target bitcode; <passopts> are the opt flags,
+# e.g. "-dynfault -ef 10 -tf 100".
+def instrumentbc(bcfile,faultpass,passopts,cachedir):
+	def build(workdir,finalbc):
+		runcmd("opt -load "+faultpass+" "+passopts+" < "+bcfile+" > "+finalbc)
+	return cached(cachedir,cachekey([bcfile,faultpass],passopts),build,"final.bc")
+
+# The pass only declares the runtime's entry points, which are resolved
+# against libkulfi_rt.a from <rtdir>. It is linked by path: -lkulfi_rt would
+# pick libkulfi_rt.so, and the executable would not run outside <rtdir>.
+def instrumented(bcfile,faultpass,passopts,rtdir,cachedir):
+	rtlib=buildruntime(rtdir)
+	finalbc=instrumentbc(bcfile,faultpass,passopts,cachedir)
+	def build(workdir,exe):
+		compilebc(finalbc,workdir,exe,rtlib+" "+RTLIBS)
+	return cached(cachedir,cachekey([finalbc,rtlib],"instrumented"),build)
@@ -0,0 +1,165 @@
+# Reads the use-def graph written by the fault pass with -kulfi-graph=<file>
+# (see writeUseDefGraph in faults.cpp).
+#
+# Usage:
+#   python kulfi_graph.py <file> functions
+#     one line per function: Function  Nodes  Edges  FaultSites
+#   python kulfi_graph.py <file> dot <function>
+#     the use-def chain of <function> in DOT
+#   python kulfi_graph.py <file> slice <fault site ID> [dot]
+#     the instructions that use the value of the fault site, directly or not
+#     (forward slice in its function); fault site IDs are local to the module
+import sys,struct
+
+MAGIC="KULFIUDG"
+VERSION=1
+TERMINATOR=1
+IN_CHAIN=2
+INJECTED=4
+
+class Graph:
+	pass
+
+def readstring(data,pos):
+	end=data.index(b"\0",pos)
+	return data[pos:end].decode('utf-8'),end+1
+
+# Yields a Graph per function; reads the file once, the arrays of a function
+# are only unpacked when it is used
+def graphs(path):
+	f=open(path,'rb')
+	data=f.read()
+	f.close()
+	if(data[0:8]!=MAGIC.encode('ascii')):
+		print(path+" is not a use-def graph")
+		sys.exit(1)
+	version,ntypes=struct.unpack_from("<II",data,8)
+	if(version!=VERSION):
+		print("Unknown use-def graph version "+str(version))
+		sys.exit(1)
+	pos=16
+	types=[]
+	for i in range(ntypes):
+		name,pos=readstring(data,pos)
+		types.append(name)
+	while(pos<len(data)):
+		g=Graph()
+		namelen=struct.unpack_from("<I",data,pos)[0]
+		pos=pos+4
+		g.name=data[pos:pos+namelen].decode('utf-8')
+		pos=pos+namelen
+		g.first_node,n,e=struct.unpack_from("<QII",data,pos)
+		pos=pos+16
+		g.n=n
+		g.e=e
+		g.data=data
+		g.typenames=types
+		g.typeoff=pos
+		g.flagoff=g.typeoff+n
+		g.siteoff=g.flagoff+n
+		g.beginoff=g.siteoff+4*n
+		g.useoff=g.beginoff+4*(n+1)
+		pos=g.useoff+4*e
+		yield g
+
+def unpack(g):
+	g.types=struct.unpack_from("<"+str(g.n)+"B",g.data,g.typeoff)
+	g.flags=struct.unpack_from("<"+str(g.n)+"B",g.data,g.flagoff)
+	g.sites=struct.unpack_from("<"+str(g.n)+"i",g.data,g.siteoff)
+	g.begin=struct.unpack_from("<"+str(g.n+1)+"I",g.data,g.beginoff)
+	g.uses=struct.unpack_from("<"+str(g.e)+"I",g.data,g.useoff)
+	return g
+
+def uses(g,i):
+	return g.uses[g.begin[i]:g.begin[i+1]]
+
+# Same style as the usedefchain.dot the pass used to write
+def writedot(g,nodes):
+	nodes=sorted(nodes)
+	inset=set(nodes)
+	print("digraph G {\tnode [shape=rectangle;] ")
+	print("\tsubgraph cluster0 { label=\""+g.name+"\"")
+	print("".join(["Node%d; " % (g.first_node+i) for i in nodes])+"\t}")
+	for i in nodes:
+		typename=g.typenames[g.types[i]]
+		if(g.flags[i]&INJECTED):
+			attrs="label=\"%s\\n(FS%d)\" color=\"red\"" % (typename,g.sites[i])
+		else:
+			attrs="label=\"%s\"" % typename
+		if(g.flags[i]&TERMINATOR):
+			attrs=attrs+" shape=\"doublecircle\""
+		print("\tNode%d [%s]" % (g.first_node+i,attrs))
+	for i in nodes:
+		for j in uses(g,i):
+			if(j in inset):
+				print("\tNode%d -> Node%d" % (g.first_node+i,g.first_node+j))
+	print("}")
+
+def functions(path):
+	print("Function\tNodes\tEdges\tFaultSites")
+	for g in graphs(path):
+		sites=struct.unpack_from("<"+str(g.n)+"i",g.data,g.siteoff)
+		nsites=len([s for s in sites if s!=-1])
+		print(g.name+"\t"+str(g.n)+"\t"+str(g.e)+"\t"+str(nsites))
+
+def dot(path,func):
+	for g in graphs(path):
+		if(g.name==func):
+			unpack(g)
+			writedot(g,[i for i in range(g.n) if g.flags[i]&IN_CHAIN])
+			return
+	print("No function "+func+" in "+path)
+	sys.exit(1)
+
+def forwardslice(path,site,asdot):
+	for g in graphs(path):
+		sites=struct.unpack_from("<"+str(g.n)+"i",g.data,g.siteoff)
+		if(site not in sites):
+			continue
+		unpack(g)
+		start=sites.index(site)
+		seen=set([start])
+		work=[start]
+		while(len(work)>0):
+			i=work.pop()
+			for j in uses(g,i):
+				if(j not in seen):
+					seen.add(j)
+					work.append(j)
+		if(asdot):
+			writedot(g,seen)
+			return
+		print("Node\tFunction\tType\tFaultSite")
+		for i in sorted(seen):
+			s=""
+			if(g.sites[i]!=-1):
+				s=str(g.sites[i])
+			print(str(g.first_node+i)+"\t"+g.name+"\t"+g.typenames[g.types[i]]+"\t"+s)
+		return
+	print("No fault site "+str(site)+" in "+path)
+	sys.exit(1)
+
+def usage():
+	print("Usage: python kulfi_graph.py <file> functions")
+	print("       python kulfi_graph.py <file> dot <function>")
+	print("       python kulfi_graph.py <file> slice <fault site ID> [dot]")
+	sys.exit(1)
+
+def main():
+	if(len(sys.argv)<3):
+		usage()
+	path=sys.argv[1]
+	cmd=sys.argv[2]
+	if(cmd=="functions" and len(sys.argv)==3):
+		functions(path)
+	elif(cmd=="dot" and len(sys.argv)==4):
+		dot(path,sys.argv[3])
+	elif(cmd=="slice" and len(sys.argv)==4):
+		forwardslice(path,int(sys.argv[3]),False)
+	elif(cmd=="slice" and len(sys.argv)==5 and sys.argv[4]=="dot"):
+		forwardslice(path,int(sys.argv[3]),True)
+	else:
+		usage()
+
+if __name__=="__main__":
+	main()
@@ -0,0 +1,84 @@
+# Prints the fault site manifest embedded in an instrumented executable or
+# object file (the "kulfi_manifest" section, see kulfi_rt.h), one line per
+# fault site:
+#   FaultSiteID  Module  LocalID  Type  Width  Function  BasicBlock  Line  Key
+#
+# LocalID is the ID of the site in its module (translation unit); FaultSiteID is
+# the global ID the runtime reports, i.e. LocalID plus the IDs of all the
+# manifests before it in the section. Both depend on everything instrumented
+# before the site; the key only on the site's function, so it matches sites
+# across builds.
+#
+# Usage: python kulfi_manifest.py <ELF file>
+import sys,struct
+
+MAGIC="KULFIMF\0"
+VERSION=3
+HEADER="<8sIIIIIIII"
+SITE="<iHHIIII"
+BB="<II"
+
+# Returns the contents of section <name> of a 64-bit little endian ELF file
+def readsection(path,name):
+	f=open(path,'rb')
+	data=f.read()
+	f.close()
+	if(data[0:4]!=b"\x7fELF" or data[4:5]!=b"\x02" or data[5:6]!=b"\x01"):
+		print(path+" is not a 64-bit little endian ELF file")
+		sys.exit(1)
+	shoff=struct.unpack_from("<Q",data,0x28)[0]
+	shentsize,shnum,shstrndx=struct.unpack_from("<HHH",data,0x3a)
+	def header(i):
+		return struct.unpack_from("<IIQQQQIIQQ",data,shoff+i*shentsize)
+	stroff=header(shstrndx)[4]
+	for i in range(shnum):
+		sh=header(i)
+		end=data.index(b"\0",stroff+sh[0])
+		if(data[stroff+sh[0]:end].decode('ascii')==name):
+			return data[sh[4]:sh[4]+sh[5]]
+	return None
+
+# Yields (global_id, module, site_id, kind, width, func, bb, line, key) for all
+# sites in all manifests
+def sites(section):
+	pos=0
+	base=0
+	while(pos+struct.calcsize(HEADER)<=len(section)):
+		magic,version,size,nsites,nbbs,nfuncs,strsize,module,nids=struct.unpack_from(HEADER,section,pos)
+		if(magic!=MAGIC.encode('ascii') or version!=VERSION):
+			print("Unknown manifest at offset "+str(pos))
+			sys.exit(1)
+		off=pos+struct.calcsize(HEADER)
+		siteoff=off
+		bboff=siteoff+nsites*struct.calcsize(SITE)
+		funcoff=bboff+nbbs*struct.calcsize(BB)
+		stroff=funcoff+nfuncs*4
+		def string(o):
+			end=section.index(b"\0",stroff+o)
+			return section[stroff+o:end].decode('utf-8')
+		for i in range(nsites):
+			sid,kind,width,func,bb,line,key=struct.unpack_from(SITE,section,siteoff+i*struct.calcsize(SITE))
+			funcname=string(struct.unpack_from("<I",section,funcoff+func*4)[0])
+			bbname=string(struct.unpack_from(BB,section,bboff+bb*struct.calcsize(BB))[0])
+			yield (base+sid,module,sid,kind,width,funcname,bbname,line,key)
+		base=base+nids
+		pos=pos+size
+
+def main():
+	if(len(sys.argv)!=2):
+		print("Usage: python kulfi_manifest.py <ELF file>")
+		sys.exit(1)
+	section=readsection(sys.argv[1],"kulfi_manifest")
+	if(section is None):
+		print("No fault site manifest in "+sys.argv[1])
+		sys.exit(1)
+	print("FaultSiteID\tModule\tLocalID\tType\tWidth\tFunction\tBasicBlock\tLine\tKey")
+	for gid,module,sid,kind,width,func,bb,line,key in sites(section):
+		if(kind==1):
+			kindname="Pointer"
+		else:
+			kindname="Data"
+		print(str(gid)+"\t"+("%08x" % module)+"\t"+str(sid)+"\t"+kindname+"\t"+str(width)+"\t"+func+"\t"+bb+"\t"+str(line)+"\t"+("%08x" % key))
+
+if __name__=="__main__":
+	main()
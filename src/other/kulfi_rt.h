@@ -0,0 +1,184 @@
+/*******************************************************************************************/
+/* Name        : kulfi_rt.h                                                                */
+/* Description : Entry points of the KULFI runtime library (libkulfi_rt). The dynfault     */
+/*               pass only emits declarations of these functions; their LLVM types in     */
+/*               declareRuntimeFunctions() (faults.cpp) must match the prototypes below.   */
+/* Copyright   : Refer to LICENSE document for details                                     */
+/*******************************************************************************************/
+#ifndef KULFI_RT_H
+#define KULFI_RT_H
+
+#ifndef __cplusplus
+	#include <stdbool.h>
+#endif
+
+/* The fault pass sets the same attributes on its declarations (declareRuntimeFunctions):
+   no entry point throws, isNextFaultInThisBB only reads the runtime's state, and the
+   cold paths do not keep the site pointer. */
+#ifdef __GNUC__
+	#define KULFI_RT_NOTHROW __attribute__((nothrow))
+	#define KULFI_RT_PURE    __attribute__((pure))
+	#define KULFI_RT_COLD    __attribute__((cold))
+#else
+	#define KULFI_RT_NOTHROW
+	#define KULFI_RT_PURE
+	#define KULFI_RT_COLD
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	void EnableKulfi();
+	void DisableKulfi();
+
+	/* Campaign setup, called at the entry of main() */
+	KULFI_RT_NOTHROW void initializeFaultInjectionCampaign(int ef, int tf);
+
+	/* Fault site accounting, called at the entry of each (original) BasicBlock */
+	KULFI_RT_NOTHROW void incrementFaultSiteCount(char* bbname, int bb_fs_count);
+	KULFI_RT_NOTHROW KULFI_RT_PURE bool isNextFaultInThisBB();
+
+	/* Called at the end of main() */
+	KULFI_RT_NOTHROW void __printInstCount();
+	KULFI_RT_NOTHROW int print_faultStatistics();
+
+	/* Emitted by the fault pass: kulfi.module and kulfi.config (one per module) and
+	   kulfi.sites, a constant table with one descriptor per fault site. The LLVM
+	   types in getModuleType() / getConfigType() / getSiteType() (faults.cpp) must
+	   match these. */
+
+	/* Site IDs are local to the module they were instrumented in (1 .. num_sites).
+	   A constructor emitted by the pass registers the module, which sets site_base
+	   so that site_base + site_id is unique in the program. */
+	struct kulfi_module {
+		unsigned hash;     /* Also in the module's manifest */
+		int num_sites;
+		int site_base;
+	};
+
+	KULFI_RT_NOTHROW void kulfi_register_module(struct kulfi_module* module);
+
+	struct kulfi_config {
+		int ef;
+		int tf;
+		int byte_val;
+		int inject_once;
+		struct kulfi_module* module;
+	};
+
+	#define KULFI_SITE_DATA 0
+	#define KULFI_SITE_PTR  1
+
+	struct kulfi_site {
+		int site_id;   /* fault_index, local to the module */
+		short kind;    /* KULFI_SITE_DATA / KULFI_SITE_PTR */
+		short width;   /* # of bits of the value */
+		const char* func;
+		const char* bb;
+		const struct kulfi_config* config;
+	};
+
+	/* Fault site manifest. Every instrumented module carries one in the
+	   "kulfi_manifest" section (writeManifest() in faults.cpp); the linker
+	   concatenates them. Names are offsets into the string pool that follows
+	   the function table. Fields are little endian, without padding.
+	     header | sites[num_sites] | bbs[num_bbs] | funcs[num_funcs] | strings
+	   Global site IDs follow the order of the manifests in the section: the
+	   base of a module is the sum of num_site_ids of the manifests before it. */
+	#define KULFI_MANIFEST_MAGIC "KULFIMF"
+	#define KULFI_MANIFEST_VERSION 3
+
+	struct kulfi_manifest {
+		char magic[8];
+		unsigned version;
+		unsigned size;     /* Of this manifest, a multiple of 8 */
+		unsigned num_sites;
+		unsigned num_bbs;
+		unsigned num_funcs;
+		unsigned strings_size;
+		unsigned module_hash;
+		unsigned num_site_ids; /* Site IDs are 1 .. num_site_ids */
+	};
+
+	struct kulfi_manifest_site {
+		int site_id;
+		unsigned short kind;
+		unsigned short width;
+		unsigned func;     /* Index into funcs */
+		unsigned bb;       /* Index into bbs */
+		unsigned line;     /* 0 without debug info */
+		unsigned key;      /* Same in every build of an unchanged function */
+	} __attribute__((packed));
+
+	struct kulfi_manifest_bb {
+		unsigned name;
+		unsigned func;
+	};
+
+	/* The globals of a module, in the "kulfi_globals" section (memory mode) */
+	struct kulfi_global {
+		void* addr;
+		unsigned long long size;
+		const char* name;
+	};
+
+	/* Returns the manifest site of local <site_id> in module <module_hash>, or NULL */
+	const struct kulfi_manifest_site* kulfi_find_manifest_site(unsigned module_hash, int site_id,
+		const struct kulfi_manifest** manifest);
+	const char* kulfi_manifest_string(const struct kulfi_manifest* manifest, unsigned offset);
+
+	/* Fast path state, see Corrupt.cpp. The fault pass inlines the test of this
+	   counter at every fault site and only calls the *_ijo / *_multi functions
+	   below when it is 0. */
+	extern long long kulfi_site_countdown;
+	/* The same for the machine register fault sites of kulfi-llc; LLONG_MAX while no
+	   fault is pending. */
+	extern long long kulfi_mf_countdown;
+
+	/* Data register faults. The *_ijo (-ijo 1) and *_multi (-ijo 0) variants are
+	   the cold paths called by the fast path; the others take inject_once at run time. */
+#define KULFI_DECLARE_CORRUPT(name, T) \
+	T name(int fault_index, int inject_once, int ef, int tf, int byte_val, T inst_data); \
+	KULFI_RT_NOTHROW KULFI_RT_COLD T name##_ijo(const struct kulfi_site* site, T inst_data); \
+	KULFI_RT_NOTHROW KULFI_RT_COLD T name##_multi(const struct kulfi_site* site, T inst_data);
+
+	bool corruptIntData_1bit(int fault_index, int inject_once, int ef, int tf, int byte_val, char inst_data);
+	KULFI_DECLARE_CORRUPT(corruptIntData_8bit, char)
+	KULFI_DECLARE_CORRUPT(corruptIntData_16bit, short)
+	KULFI_DECLARE_CORRUPT(corruptIntData_32bit, int)
+	KULFI_DECLARE_CORRUPT(corruptIntData_64bit, long long)
+	KULFI_DECLARE_CORRUPT(corruptFloatData_32bit, float)
+	KULFI_DECLARE_CORRUPT(corruptFloatData_64bit, double)
+	KULFI_DECLARE_CORRUPT(corruptFloatData_80bit, long double)
+
+	/* Pointer register faults */
+	KULFI_DECLARE_CORRUPT(corruptIntAdr_32bit, int*)
+	KULFI_DECLARE_CORRUPT(corruptIntAdr_64bit, long long*)
+	KULFI_DECLARE_CORRUPT(corruptFloatAdr_32bit, float*)
+	KULFI_DECLARE_CORRUPT(corruptFloatAdr_64bit, double*)
+
+#undef KULFI_DECLARE_CORRUPT
+
+	/* Vector data faults: the fast path of a site on an <nlanes x T> value calls this
+	   for the lane to corrupt, then the cold path of T on that lane's element. */
+	KULFI_RT_NOTHROW KULFI_RT_COLD int kulfi_vector_lane(const struct kulfi_site* site, int nlanes);
+
+	/* Machine register faults (kulfi-llc, x86-64): kulfi_mf_cold (kulfi_mf_stub.S) saves
+	   the registers and calls this with the value of the register written at site
+	   <site_id>, which the site reloads from the return value. <pc> is the return address
+	   of the call to kulfi_mf_cold, right after the site. */
+	KULFI_RT_NOTHROW KULFI_RT_COLD long long kulfi_mf_corrupt(int site_id, int width,
+		long long value, void* pc);
+
+	/* Timer mode (LD_PRELOAD=libkulfi_rt.so KULFI_TIMER_FAULT=<ms>) and memory mode
+	   (KULFI_MEM_FAULT) have no entry points: they start from constructors of the
+	   library, see Corrupt.cpp. Memory mode defines malloc, calloc, realloc and free;
+	   thread and rank targeting (KULFI_TARGET_THREAD, KULFI_TARGET_RANK) define
+	   pthread_create, MPI_Init and MPI_Init_thread, which call the real ones. */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KULFI_RT_H */
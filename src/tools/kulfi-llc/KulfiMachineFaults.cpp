@@ -0,0 +1,256 @@
+/*******************************************************************************************/
+/* Name        : KulfiMachineFaults                                                        */
+/*                                                                                         */
+/* Register faults after register allocation, for x86-64. After each instruction that      */
+/* writes a general purpose register, it inserts the countdown test of the fault pass's    */
+/* fast path on kulfi_mf_countdown (LLONG_MAX while no fault is pending, see Corrupt.cpp): */
+/*     subq $1, kulfi_mf_countdown(%rip)                                                   */
+/*     jl   cold                                                                           */
+/* and, at the end of the function, a cold block that hands the register to the runtime   */
+/* (kulfi_mf_cold in kulfi_mf_stub.S, which saves every register it may clobber) and       */
+/* reloads it. The program is otherwise the code llc would produce. The campaign is set    */
+/* up by the fault pass (opt -dynfault -de=0 -pe=0), so bitcode it has not instrumented    */
+/* is rejected.                                                                            */
+/*******************************************************************************************/
+
+#include <string.h>
+#include "llvm/Module.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/CodeGen/MachineInstrBuilder.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetInstrInfo.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetRegisterInfo.h"
+#include <algorithm>
+#include <set>
+
+using namespace llvm;
+
+static cl::list<std::string> mf_funcs("kulfi-mf-fn", cl::desc("Only inject into these functions"),
+	cl::value_desc("function"), cl::CommaSeparated);
+
+namespace {
+class KulfiMachineFaults : public MachineFunctionPass {
+public:
+	static char ID;
+	KulfiMachineFaults() : MachineFunctionPass(ID), num_sites(0), initialized(false) {}
+	virtual const char* getPassName() const { return "KULFI machine register faults"; }
+	virtual bool runOnMachineFunction(MachineFunction& MF);
+
+private:
+	struct Site {
+		MachineInstr* MI;
+		unsigned reg;   // The 64-bit register that holds the value
+		unsigned width; // # of bits written by MI
+	};
+
+	int num_sites; // Site IDs are 1 .. num_sites in the module
+	bool initialized;
+	const TargetInstrInfo* TII;
+	const TargetRegisterInfo* TRI;
+	const TargetRegisterClass *GR64, *GR32;
+	unsigned EFLAGS, RSP, RIP;
+	unsigned SUB64mi8, JL_4, JMP_4, LEA64r, PUSH64r, PUSH64i32, POP64r, CALL64pcrel32;
+
+	void initialize(MachineFunction& MF);
+	bool isSite(MachineInstr* MI, Site& site);
+	bool isFlagsDeadAfter(MachineInstr* MI);
+	void insertSite(MachineFunction& MF, const Site& site, int site_id);
+};
+}
+
+char KulfiMachineFaults::ID = 0;
+
+// The X86 opcodes and registers are looked up by name, so that this file does not
+//   need the X86 target's private headers.
+static unsigned findOpcode(const TargetInstrInfo* TII, const char* name) {
+	for(unsigned i = 0; i < TII->getNumOpcodes(); i++)
+		if(!strcmp(TII->getName(i), name)) return i;
+	report_fatal_error(std::string("[kulfi-mf] No X86 instruction ") + name);
+}
+
+static unsigned findRegister(const TargetRegisterInfo* TRI, const char* name) {
+	for(unsigned i = 1; i < TRI->getNumRegs(); i++)
+		if(!strcmp(TRI->getName(i), name)) return i;
+	report_fatal_error(std::string("[kulfi-mf] No X86 register ") + name);
+}
+
+static const TargetRegisterClass* findRegClass(const TargetRegisterInfo* TRI, const char* name) {
+	for(TargetRegisterInfo::regclass_iterator it = TRI->regclass_begin();
+		it != TRI->regclass_end(); it++) {
+		if(!strcmp((*it)->getName(), name)) return *it;
+	}
+	report_fatal_error(std::string("[kulfi-mf] No X86 register class ") + name);
+}
+
+void KulfiMachineFaults::initialize(MachineFunction& MF) {
+	if(initialized) return;
+	initialized = true;
+	// Without the fault pass, initializeFaultInjectionCampaign is never called and
+	//   no fault is ever pending
+	if(!MF.getFunction()->getParent()->getGlobalVariable("kulfi.module", true))
+		report_fatal_error("[kulfi-mf] The bitcode is not instrumented; run "
+			"opt -dynfault -de=0 -pe=0 on it first");
+	TII = MF.getTarget().getInstrInfo();
+	TRI = MF.getTarget().getRegisterInfo();
+	GR64 = findRegClass(TRI, "GR64");
+	GR32 = findRegClass(TRI, "GR32");
+	EFLAGS = findRegister(TRI, "EFLAGS");
+	RSP = findRegister(TRI, "RSP");
+	RIP = findRegister(TRI, "RIP");
+	SUB64mi8      = findOpcode(TII, "SUB64mi8");
+	JL_4          = findOpcode(TII, "JL_4");
+	JMP_4         = findOpcode(TII, "JMP_4");
+	LEA64r        = findOpcode(TII, "LEA64r");
+	PUSH64r       = findOpcode(TII, "PUSH64r");
+	PUSH64i32     = findOpcode(TII, "PUSH64i32");
+	POP64r        = findOpcode(TII, "POP64r");
+	CALL64pcrel32 = findOpcode(TII, "CALL64pcrel32");
+}
+
+// The countdown test clobbers EFLAGS, so only instructions after which it is dead
+//   are fault sites
+bool KulfiMachineFaults::isFlagsDeadAfter(MachineInstr* MI) {
+	MachineBasicBlock* MBB = MI->getParent();
+	MachineBasicBlock::iterator I = MI;
+	for(I++; I != MBB->end(); I++) {
+		if(I->readsRegister(EFLAGS, TRI)) return false;
+		if(I->definesRegister(EFLAGS, TRI)) return true;
+	}
+	for(MachineBasicBlock::succ_iterator SI = MBB->succ_begin(); SI != MBB->succ_end(); SI++)
+		if((*SI)->isLiveIn(EFLAGS)) return false;
+	return true;
+}
+
+// Instructions whose first operand is an explicit def of a GR64 or GR32 register
+//   other than the stack pointer, outside of the prologue
+bool KulfiMachineFaults::isSite(MachineInstr* MI, Site& site) {
+	if(MI->isTerminator() || MI->isCall() || MI->isPseudo() || MI->isInlineAsm() ||
+		MI->isTransient() || MI->isDebugValue() || MI->isLabel())
+		return false;
+	if(MI->getFlag(MachineInstr::FrameSetup)) return false;
+	if(MI->getNumOperands() == 0) return false;
+	const MachineOperand& MO = MI->getOperand(0);
+	if(!MO.isReg() || !MO.isDef() || MO.isImplicit() || !MO.getReg()) return false;
+	unsigned reg = MO.getReg();
+	if(GR64->contains(reg)) {
+		site.reg = reg;
+		site.width = 64;
+	} else if(GR32->contains(reg)) {
+		site.reg = 0;
+		for(MCSuperRegIterator SR(reg, TRI); SR.isValid(); ++SR)
+			if(GR64->contains(*SR)) site.reg = *SR;
+		if(!site.reg) return false;
+		site.width = 32;
+	} else {
+		return false;
+	}
+	if(site.reg == RSP) return false;
+	if(!isFlagsDeadAfter(MI)) return false;
+	site.MI = MI;
+	return true;
+}
+
+// Registers used in <MBB> before they are written, or live into its successors
+static void addLiveIns(MachineBasicBlock* MBB) {
+	std::set<unsigned> live;
+	for(MachineBasicBlock::succ_iterator SI = MBB->succ_begin(); SI != MBB->succ_end(); SI++)
+		live.insert((*SI)->livein_begin(), (*SI)->livein_end());
+	for(MachineBasicBlock::reverse_iterator I = MBB->rbegin(); I != MBB->rend(); I++) {
+		for(unsigned i = 0; i < I->getNumOperands(); i++) {
+			const MachineOperand& MO = I->getOperand(i);
+			if(MO.isReg() && MO.getReg() && MO.isDef() && !MO.isUndef()) live.erase(MO.getReg());
+		}
+		for(unsigned i = 0; i < I->getNumOperands(); i++) {
+			const MachineOperand& MO = I->getOperand(i);
+			if(MO.isReg() && MO.getReg() && MO.isUse() && !MO.isUndef()) live.insert(MO.getReg());
+		}
+	}
+	for(std::set<unsigned>::iterator it = live.begin(); it != live.end(); it++)
+		if(!MBB->isLiveIn(*it)) MBB->addLiveIn(*it);
+}
+
+// [ MBB ... MI ... ]  ->  [ MBB ... MI; sub; jl cold ] [ tail ... ]   ...   [ cold; jmp tail ]
+void KulfiMachineFaults::insertSite(MachineFunction& MF, const Site& site, int site_id) {
+	MachineInstr* MI = site.MI;
+	MachineBasicBlock* MBB = MI->getParent();
+	DebugLoc DL = MI->getDebugLoc();
+	MachineBasicBlock::iterator split = MI;
+	split++;
+
+	MachineBasicBlock* tail = MF.CreateMachineBasicBlock(MBB->getBasicBlock());
+	MF.insert(llvm::next(MachineFunction::iterator(MBB)), tail);
+	tail->splice(tail->end(), MBB, split, MBB->end());
+	tail->transferSuccessorsAndUpdatePHIs(MBB);
+	addLiveIns(tail);
+
+	MachineBasicBlock* cold = MF.CreateMachineBasicBlock(MBB->getBasicBlock());
+	MF.push_back(cold);
+	for(MachineBasicBlock::livein_iterator it = tail->livein_begin(); it != tail->livein_end(); it++)
+		cold->addLiveIn(*it);
+	if(!cold->isLiveIn(site.reg)) cold->addLiveIn(site.reg);
+
+	MBB->addSuccessor(tail);
+	MBB->addSuccessor(cold);
+	cold->addSuccessor(tail);
+
+	// The fast path
+	const GlobalValue* countdown = dyn_cast<GlobalValue>(
+		MF.getFunction()->getParent()->getOrInsertGlobal("kulfi_mf_countdown",
+			Type::getInt64Ty(MF.getFunction()->getContext())));
+	if(!countdown) report_fatal_error("[kulfi-mf] kulfi_mf_countdown is not an i64");
+	BuildMI(*MBB, MBB->end(), DL, TII->get(SUB64mi8))
+		.addReg(RIP).addImm(1).addReg(0).addGlobalAddress(countdown).addReg(0)
+		.addImm(1);
+	BuildMI(*MBB, MBB->end(), DL, TII->get(JL_4)).addMBB(cold);
+
+	// The cold path. Below the red zone: push the value, the width and the site ID,
+	//   call the stub, which writes the corrupted value over the pushed one, pop it.
+	BuildMI(*cold, cold->end(), DL, TII->get(LEA64r), RSP)
+		.addReg(RSP).addImm(1).addReg(0).addImm(-128).addReg(0);
+	BuildMI(*cold, cold->end(), DL, TII->get(PUSH64r)).addReg(site.reg);
+	BuildMI(*cold, cold->end(), DL, TII->get(PUSH64i32)).addImm(site.width);
+	BuildMI(*cold, cold->end(), DL, TII->get(PUSH64i32)).addImm(site_id);
+	// Without a register mask: the stub preserves every register
+	BuildMI(*cold, cold->end(), DL, TII->get(CALL64pcrel32)).addExternalSymbol("kulfi_mf_cold");
+	BuildMI(*cold, cold->end(), DL, TII->get(LEA64r), RSP)
+		.addReg(RSP).addImm(1).addReg(0).addImm(16).addReg(0);
+	BuildMI(*cold, cold->end(), DL, TII->get(POP64r), site.reg);
+	BuildMI(*cold, cold->end(), DL, TII->get(LEA64r), RSP)
+		.addReg(RSP).addImm(1).addReg(0).addImm(128).addReg(0);
+	BuildMI(*cold, cold->end(), DL, TII->get(JMP_4)).addMBB(tail);
+}
+
+bool KulfiMachineFaults::runOnMachineFunction(MachineFunction& MF) {
+	if(Triple(MF.getTarget().getTargetTriple()).getArch() != Triple::x86_64) return false;
+	if(MF.getTarget().getRelocationModel() == Reloc::PIC_)
+		report_fatal_error("[kulfi-mf] kulfi_mf_countdown is addressed RIP-relative; "
+			"use -relocation-model=static");
+	std::string name = MF.getFunction()->getName().str();
+	if(!mf_funcs.empty() &&
+		std::find(mf_funcs.begin(), mf_funcs.end(), name) == mf_funcs.end())
+		return false;
+	initialize(MF);
+
+	// Collected first: each site splits its block
+	std::vector<Site> sites;
+	for(MachineFunction::iterator FI = MF.begin(); FI != MF.end(); FI++) {
+		for(MachineBasicBlock::iterator I = FI->begin(); I != FI->end(); I++) {
+			Site site;
+			if(isSite(I, site)) sites.push_back(site);
+		}
+	}
+	for(unsigned i = 0; i < sites.size(); i++)
+		insertSite(MF, sites[i], ++num_sites);
+	errs() << "[kulfi-mf] " << name << ": " << sites.size() << " sites\n";
+	return !sites.empty();
+}
+
+FunctionPass* createKulfiMachineFaultPass() {
+	return new KulfiMachineFaults();
+}
@@ -0,0 +1,133 @@
+/*******************************************************************************************/
+/* Name        : kulfi-llc                                                                 */
+/*                                                                                         */
+/* Compiles a bitcode file to an x86-64 object file, like llc, with register faults        */
+/* inserted after register allocation (KulfiMachineFaults.cpp) instead of by the IR fault  */
+/* pass: the countdown test and the cold call are added to the final machine code, so      */
+/* the rest of the code is the same as in the uninstrumented build.                        */
+/*                                                                                         */
+/* Usage: kulfi-llc [-O N] [-filetype=asm] [-kulfi-mf-fn=f1,f2] Sample.bc -o Sample.o      */
+/*******************************************************************************************/
+
+#include "llvm/DataLayout.h"
+#include "llvm/LLVMContext.h"
+#include "llvm/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/CodeGen/Passes.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/IRReader.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+using namespace llvm;
+
+// Defined in KulfiMachineFaults.cpp
+FunctionPass* createKulfiMachineFaultPass();
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::desc("<input bitcode>"), cl::init("-"));
+static cl::opt<std::string> OutputFile("o", cl::desc("Output filename"), cl::value_desc("filename"),
+	cl::Required);
+static cl::opt<char> OptLevel("O", cl::desc("Optimization level: -O0, -O1, -O2 or -O3 (default: -O2)"),
+	cl::Prefix, cl::ZeroOrMore, cl::init('2'));
+static cl::opt<TargetMachine::CodeGenFileType> FileType("filetype",
+	cl::init(TargetMachine::CGFT_ObjectFile), cl::desc("Type of the output file"),
+	cl::values(
+		clEnumValN(TargetMachine::CGFT_AssemblyFile, "asm", "Assembly ('.s') file"),
+		clEnumValN(TargetMachine::CGFT_ObjectFile, "obj", "Native object ('.o') file"),
+		clEnumValEnd));
+
+// llc's pipeline, with the fault pass added right after the post-RA pseudo
+//   instructions are expanded: the registers are final, but later passes (block
+//   placement, the scheduler) still see the cold blocks.
+class KulfiPassManager : public PassManager {
+public:
+	virtual void add(Pass* P) {
+		AnalysisID id = P->getPassID();
+		PassManager::add(P);
+		if(id == &ExpandPostRAPseudosID)
+			PassManager::add(createKulfiMachineFaultPass());
+	}
+};
+
+int main(int argc, char** argv) {
+	sys::PrintStackTraceOnErrorSignal();
+	PrettyStackTraceProgram X(argc, argv);
+	LLVMContext& Context = getGlobalContext();
+	llvm_shutdown_obj Y;
+	InitializeNativeTarget();
+	InitializeNativeTargetAsmPrinter();
+	cl::ParseCommandLineOptions(argc, argv, "KULFI post register allocation fault injection\n");
+
+	SMDiagnostic Err;
+	Module* Mod = ParseIRFile(InputFile, Err, Context);
+	if(!Mod) {
+		Err.print(argv[0], errs());
+		return 1;
+	}
+	Triple TheTriple(Mod->getTargetTriple());
+	if(TheTriple.getTriple().empty())
+		TheTriple.setTriple(sys::getDefaultTargetTriple());
+	if(TheTriple.getArch() != Triple::x86_64) {
+		errs() << argv[0] << ": only x86-64 is supported, not " << TheTriple.getTriple() << "\n";
+		return 1;
+	}
+
+	std::string Error;
+	const Target* TheTarget = TargetRegistry::lookupTarget(TheTriple.getTriple(), Error);
+	if(!TheTarget) {
+		errs() << argv[0] << ": " << Error << "\n";
+		return 1;
+	}
+	CodeGenOpt::Level OLvl = CodeGenOpt::Default;
+	switch(OptLevel) {
+	case '0': OLvl = CodeGenOpt::None; break;
+	case '1': OLvl = CodeGenOpt::Less; break;
+	case '2': OLvl = CodeGenOpt::Default; break;
+	case '3': OLvl = CodeGenOpt::Aggressive; break;
+	default:
+		errs() << argv[0] << ": invalid optimization level.\n";
+		return 1;
+	}
+	// The sites address kulfi_mf_countdown RIP-relative, without the GOT
+	TargetOptions Options;
+	OwningPtr<TargetMachine> TM(TheTarget->createTargetMachine(TheTriple.getTriple(),
+		sys::getHostCPUName(), "", Options, Reloc::Static, CodeModel::Small, OLvl));
+	if(!TM.get()) {
+		errs() << argv[0] << ": could not allocate the target machine\n";
+		return 1;
+	}
+
+	std::string ErrorInfo;
+	OwningPtr<tool_output_file> Out(new tool_output_file(OutputFile.c_str(), ErrorInfo,
+		FileType == TargetMachine::CGFT_ObjectFile ? raw_fd_ostream::F_Binary : 0));
+	if(!ErrorInfo.empty()) {
+		errs() << ErrorInfo << "\n";
+		return 1;
+	}
+
+	KulfiPassManager PM;
+	if(const DataLayout* TD = TM->getDataLayout())
+		PM.add(new DataLayout(*TD));
+	else
+		PM.add(new DataLayout(Mod));
+	{
+		formatted_raw_ostream FOS(Out->os());
+		if(TM->addPassesToEmitFile(PM, FOS, FileType, false)) {
+			errs() << argv[0] << ": the target does not support generating this file type\n";
+			return 1;
+		}
+		PM.run(*Mod);
+	}
+	Out->keep();
+	return 0;
+}
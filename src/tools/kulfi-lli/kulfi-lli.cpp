@@ -0,0 +1,90 @@
+/*******************************************************************************************/
+/* Name        : kulfi-lli                                                                 */
+/*                                                                                         */
+/* Runs an uninstrumented bitcode file under the JIT, like lli, and instruments each       */
+/* function with the dynamic fault pass (faults.cpp) on its first call only: functions     */
+/* that never run are neither instrumented nor compiled. Fault site IDs and keys are the   */
+/* same as in the output of opt -dynfault with the same options.                           */
+/*                                                                                         */
+/* Usage: kulfi-lli -load=<path-to-KULFI>/src/other/libkulfi_rt.so [-ef N] [-tf N] ...     */
+/*          Sample.bc [program arguments]                                                  */
+/*******************************************************************************************/
+
+#include <errno.h>
+#include <stdlib.h>
+#include "llvm/LLVMContext.h"
+#include "llvm/Module.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/GenericValue.h"
+#include "llvm/ExecutionEngine/JIT.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/IRReader.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PluginLoader.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+// Defined in faults.cpp
+extern "C" void kulfi_enable_lazy_instrumentation(Module* M);
+extern "C" void kulfi_finish_lazy_instrumentation(Module* M);
+
+static cl::opt<std::string> InputFile(cl::desc("<input bitcode>"), cl::Positional, cl::init("-"));
+static cl::list<std::string> InputArgv(cl::ConsumeAfter, cl::desc("<program arguments>..."));
+static cl::opt<std::string> EntryFunc("entry-function", cl::desc("Function to call as main"),
+	cl::value_desc("function"), cl::init("main"));
+
+static Module* Mod = NULL;
+
+// The program may call exit() itself
+static void finish() {
+	kulfi_finish_lazy_instrumentation(Mod);
+}
+
+int main(int argc, char** argv, char* const* envp) {
+	sys::PrintStackTraceOnErrorSignal();
+	PrettyStackTraceProgram X(argc, argv);
+	LLVMContext& Context = getGlobalContext();
+	llvm_shutdown_obj Y;
+	cl::ParseCommandLineOptions(argc, argv, "KULFI lazy fault injection JIT\n");
+	InitializeNativeTarget();
+
+	SMDiagnostic Err;
+	Mod = ParseIRFile(InputFile, Err, Context);
+	if(!Mod) {
+		Err.print(argv[0], errs());
+		return 1;
+	}
+	Function* EntryFn = Mod->getFunction(EntryFunc);
+	if(!EntryFn) {
+		errs() << '\'' << EntryFunc << "\' function not found in module.\n";
+		return 1;
+	}
+
+	kulfi_enable_lazy_instrumentation(Mod);
+
+	std::string ErrorMsg;
+	EngineBuilder builder(Mod);
+	builder.setErrorStr(&ErrorMsg);
+	builder.setEngineKind(EngineKind::JIT);
+	ExecutionEngine* EE = builder.create();
+	if(!EE) {
+		errs() << argv[0] << ": error creating the JIT: " << ErrorMsg << "\n";
+		return 1;
+	}
+	// Functions are compiled (and instrumented) on their first call
+	EE->DisableLazyCompilation(false);
+
+	atexit(finish);
+	InputArgv.insert(InputArgv.begin(), InputFile);
+	errno = 0;
+	EE->runStaticConstructorsDestructors(false);
+	int Result = EE->runFunctionAsMain(EntryFn, InputArgv, envp);
+	EE->runStaticConstructorsDestructors(true);
+
+	// Runs the program's atexit handlers (and finish()) while the module still exists
+	exit(Result);
+}